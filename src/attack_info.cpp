@@ -0,0 +1,31 @@
+#include "attack_info.h"
+
+namespace Chess
+{
+
+    AttackInfo::AttackInfo(const Position &p)
+    {
+        const Bitboard occupied = p.pieces();
+
+        // Each piece scatters itself into the attackers of the squares it
+        // reaches, a few dozen bits instead of 64 attackers_to lookups
+        Bitboard occ = occupied;
+        while (occ)
+        {
+            const Square s = pop_lsb(occ);
+            const Piece pc = p.piece_on(s);
+            const PieceType pt = typeof_piece(pc);
+            const Color c = color_of(pc);
+
+            const Bitboard attacks = pt == Pawn ? pawn_attacks_bb(c, s) : attacks_bb(pt, s, occupied);
+
+            attacks_from[s] = attacks;
+            attacked_by[c][pt] |= attacks;
+            attacked_by[c][All_Pieces] |= attacks;
+
+            Bitboard targets = attacks;
+            while (targets)
+                attackers[c][pop_lsb(targets)] |= s;
+        }
+    }
+}
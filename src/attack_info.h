@@ -0,0 +1,28 @@
+#pragma once
+
+#include "types.h"
+#include "bitboard.h"
+#include "position.h"
+
+namespace Chess {
+
+    // Every attack set of one position, worked out once and shared by all
+    // feature extractors and relations built for it. Sliders are blocked by
+    // the full occupancy, as in attackers_to.
+    struct AttackInfo
+    {
+        // Squares attacked by the piece on each square, 0 on empty squares
+        Bitboard attacks_from[Square_NB]{};
+
+        // Pieces of each colour attacking each square
+        Bitboard attackers[Color_NB][Square_NB]{};
+
+        // Squares attacked by any piece of a colour and type, All_Pieces
+        // holds the union over all types
+        Bitboard attacked_by[Color_NB][Piece_Type_NB]{};
+
+        explicit AttackInfo(const Position &p);
+
+        Bitboard attackers_to(Square s, Color c) const { return attackers[c][s]; }
+    };
+}
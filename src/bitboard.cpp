@@ -1,143 +1,340 @@
+#include <bit>
+#include <cstring>
 #include <string>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
 #include "bitboard.h"
 
 namespace Chess
 {
 
+    namespace {
 
-    u8 SquareDistance[Square_NB][Square_NB];
+        constexpr size_t RookTableSize = 0x19000;
+        constexpr size_t BishopTableSize = 0x1480;
+
+        // Multipliers of the Multiply layout, found once by a seeded trial
+        // search. make_magic_table refuses to compile if one of them maps
+        // two blocker subsets with different attacks to the same index.
+        constexpr Bitboard RookMagicNumbers[Square_NB] = {
+            0x0A80004000801220ULL, 0x8040004010002008ULL, 0x2080200010008008ULL, 0x1100100008210004ULL,
+            0xC200209084020008ULL, 0x2100010004000208ULL, 0x0400081000822421ULL, 0x0200010422048844ULL,
+            0x0800800080400024ULL, 0x0001402000401000ULL, 0x3000801000802001ULL, 0x4400800800100083ULL,
+            0x0904802402480080ULL, 0x4040800400020080ULL, 0x0018808042000100ULL, 0x4040800080004100ULL,
+            0x0040048001458024ULL, 0x00A0004000205000ULL, 0x3100808010002000ULL, 0x4825010010000820ULL,
+            0x5004808008000401ULL, 0x2024818004000A00ULL, 0x0005808002000100ULL, 0x2100060004806104ULL,
+            0x0080400880008421ULL, 0x4062220600410280ULL, 0x010A004A00108022ULL, 0x0000100080080080ULL,
+            0x0021000500080010ULL, 0x0044000202001008ULL, 0x0000100400080102ULL, 0xC020128200040545ULL,
+            0x0080002000400040ULL, 0x0000804000802004ULL, 0x0000120022004080ULL, 0x010A386103001001ULL,
+            0x9010080080800400ULL, 0x8440020080800400ULL, 0x0004228824001001ULL, 0x000000490A000084ULL,
+            0x0080002000504000ULL, 0x200020005000C000ULL, 0x0012088020420010ULL, 0x0010010080080800ULL,
+            0x0085001008010004ULL, 0x0002000204008080ULL, 0x0040413002040008ULL, 0x0000304081020004ULL,
+            0x0080204000800080ULL, 0x3008804000290100ULL, 0x1010100080200080ULL, 0x2008100208028080ULL,
+            0x5000850800910100ULL, 0x8402019004680200ULL, 0x0120911028020400ULL, 0x0000008044010200ULL,
+            0x0020850200244012ULL, 0x0020850200244012ULL, 0x0000102001040841ULL, 0x140900040A100021ULL,
+            0x000200282410A102ULL, 0x000200282410A102ULL, 0x000200282410A102ULL, 0x4048240043802106ULL,
+        };
+
+        constexpr Bitboard BishopMagicNumbers[Square_NB] = {
+            0x40106000A1160020ULL, 0x0020010250810120ULL, 0x2010010220280081ULL, 0x002806004050C040ULL,
+            0x0002021018000000ULL, 0x2001112010000400ULL, 0x0881010120218080ULL, 0x1030820110010500ULL,
+            0x0000120222042400ULL, 0x2000020404040044ULL, 0x8000480094208000ULL, 0x0003422A02000001ULL,
+            0x000A220210100040ULL, 0x8004820202226000ULL, 0x0018234854100800ULL, 0x0100004042101040ULL,
+            0x0004001004082820ULL, 0x0010000810010048ULL, 0x1014004208081300ULL, 0x2080818802044202ULL,
+            0x0040880C00A00100ULL, 0x0080400200522010ULL, 0x0001000188180B04ULL, 0x0080249202020204ULL,
+            0x1004400004100410ULL, 0x00013100A0022206ULL, 0x2148500001040080ULL, 0x4241080011004300ULL,
+            0x4020848004002000ULL, 0x10101380D1004100ULL, 0x0008004422020284ULL, 0x01010A1041008080ULL,
+            0x0808080400082121ULL, 0x0808080400082121ULL, 0x0091128200100C00ULL, 0x0202200802010104ULL,
+            0x8C0A020200440085ULL, 0x01A0008080B10040ULL, 0x0889520080122800ULL, 0x100902022202010AULL,
+            0x04081A0816002000ULL, 0x0000681208005000ULL, 0x8170840041008802ULL, 0x0A00004200810805ULL,
+            0x0830404408210100ULL, 0x2602208106006102ULL, 0x1048300680802628ULL, 0x2602208106006102ULL,
+            0x0602010120110040ULL, 0x0941010801043000ULL, 0x000040440A210428ULL, 0x0008240020880021ULL,
+            0x0400002012048200ULL, 0x00AC102001210220ULL, 0x0220021002009900ULL, 0x84440C080A013080ULL,
+            0x0001008044200440ULL, 0x0004C04410841000ULL, 0x2000500104011130ULL, 0x1A0C010011C20229ULL,
+            0x0044800112202200ULL, 0x0434804908100424ULL, 0x0300404822C08200ULL, 0x48081010008A2A80ULL,
+        };
+
+        // Everything from here to the table definitions runs in the
+        // compiler, so the helpers avoid the intrinsics and lookup tables
+        // their runtime counterparts use
+
+        constexpr Bitboard bit(Square s) { return Bitboard(1) << s; }
+
+        constexpr int square_distance(Square s1, Square s2)
+        {
+            const int files = file_of(s1) > file_of(s2) ? file_of(s1) - file_of(s2) : file_of(s2) - file_of(s1);
+            const int ranks = rank_of(s1) > rank_of(s2) ? rank_of(s1) - rank_of(s2) : rank_of(s2) - rank_of(s1);
+            return files > ranks ? files : ranks;
+        }
 
-    Bitboard LineBB[Square_NB][Square_NB];
-    Bitboard BetweenBB[Square_NB][Square_NB];
-    Bitboard PseudoAttacks[Piece_Type_NB][Square_NB];
-    Bitboard PawnAttacks[Color_NB][Square_NB];
+        constexpr Bitboard safe_destination(Square s, int step) {
+            Square to = Square(s + step);
+            return is_ok(to) && square_distance(s, to) <= 2 ? bit(to) : Bitboard(0);
+        }
 
-    alignas(64) Magic Magics[Square_NB][2];
+        // Rook directions first, then bishop ones
+        constexpr Direction SliderDirections[8] = {Up, Down, Left, Right, UpRight, UpLeft, DownRight, DownLeft};
 
+        // Squares from s to the edge of the board along each direction
+        struct Rays {
+            Bitboard ray[8][Square_NB];
+        };
 
-    namespace {
-        Bitboard RookTable[0x19000];
-        Bitboard BishopTable[0x1480];
+        consteval Rays make_rays()
+        {
+            Rays rays{};
+
+            for (int d = 0; d < 8; d++)
+                for (Square s = A1; s <= H8; s = Square(s + 1))
+                    for (Square to = s; safe_destination(to, SliderDirections[d]);)
+                    {
+                        to = Square(to + SliderDirections[d]);
+                        rays.ray[d][s] |= bit(to);
+                    }
+
+            return rays;
+        }
 
-        void init_magics(PieceType t, Bitboard table[], Magic magics[][2]);
+        constexpr Rays SliderRays = make_rays();
 
-        Bitboard safe_destination(Square s, int step) {
-            Square to = Square(s + step);
-            return is_ok(to) && distance(s, to) <= 2 ? square_bb(to): Bitboard(0);
+        // A ray stops at its nearest blocker, which is the lowest square on
+        // rays going up the board and the highest on rays going down
+        constexpr Bitboard sliding_attack(PieceType pt, Square s, Bitboard occupied)
+        {
+            const int first = pt == Rook ? 0 : 4;
+            Bitboard attacks = 0;
+
+            for (int d = first; d < first + 4; d++)
+            {
+                Bitboard ray = SliderRays.ray[d][s];
+
+                if (Bitboard blockers = ray & occupied)
+                {
+                    const Square nearest = SliderDirections[d] > 0 ? Square(std::countr_zero(blockers))
+                                                                   : Square(63 - std::countl_zero(blockers));
+                    ray ^= SliderRays.ray[d][nearest];
+                }
+                attacks |= ray;
+            }
+
+            return attacks;
+        }
+
+        constexpr Bitboard slider_mask(PieceType pt, Square s)
+        {
+            Bitboard edges = ((Bb_Rank_1 | Bb_Rank_8) & ~rank_bb(s)) | ((Bb_File_A | Bb_File_H) & ~file_bb(s));
+            return sliding_attack(pt, s, 0) & ~edges;
         }
-    }
 
+        consteval BoardTables make_board_tables()
+        {
+            BoardTables t{};
 
+            for (Square s1 = A1; s1 <= H8; s1 = Square(s1 + 1))
+                for (Square s2 = A1; s2 <= H8; s2 = Square(s2 + 1))
+                    t.SquareDistance[s1][s2] = u8(square_distance(s1, s2));
 
-    // Returns an ASCII representation of a bitboard suitable
-    // to be printed to standard output. Useful for debugging.
-    std::string Bitboards::pretty(Bitboard b)
-    {
+            for (Square s1 = A1; s1 <= H8; s1 = Square(s1 + 1))
+            {
+                t.PawnAttacks[White][s1] = pawn_attacks_bb<White>(bit(s1));
+                t.PawnAttacks[Black][s1] = pawn_attacks_bb<Black>(bit(s1));
+
+                for (int step : {-9, -8, -7, -1, 1, 7, 8, 9})
+                    t.PseudoAttacks[King][s1] |= safe_destination(s1, step);
+
+                for (int step : {-17, -15, -10, -6, 6, 10, 15, 17})
+                    t.PseudoAttacks[Knight][s1] |= safe_destination(s1, step);
+
+                t.PseudoAttacks[Bishop][s1] = sliding_attack(Bishop, s1, 0);
+                t.PseudoAttacks[Rook][s1] = sliding_attack(Rook, s1, 0);
+                t.PseudoAttacks[Queen][s1] = t.PseudoAttacks[Bishop][s1] | t.PseudoAttacks[Rook][s1];
+
+                for (PieceType pt : {Bishop, Rook})
+                    for (Square s2 = A1; s2 <= H8; s2 = Square(s2 + 1))
+                    {
+                        if (t.PseudoAttacks[pt][s1] & bit(s2))
+                        {
+                            t.LineBB[s1][s2] = (sliding_attack(pt, s1, 0) & sliding_attack(pt, s2, 0)) | bit(s1) | bit(s2);
+                            t.BetweenBB[s1][s2] = sliding_attack(pt, s1, bit(s2)) & sliding_attack(pt, s2, bit(s1));
+                        }
+                        t.BetweenBB[s1][s2] |= bit(s2);
+                    }
+            }
 
-        std::string s = "\n";
+            return t;
+        }
 
-        for (Rank r = Rank_8; r >= Rank_1; --r)
+        template <size_t N>
+        struct SliderTable {
+            Bitboard attacks[N];
+        };
+
+        // The carry-rippler walks a square's blocker subsets in increasing
+        // PEXT order, so the PEXT layout is every subset in walk order
+        template <PieceType Pt, size_t N>
+        consteval SliderTable<N> make_pext_table()
         {
-            for (File f = File_A; f <= File_H; ++f)
-                s += b & make_square(f, r) ? "o" : ".";
+            SliderTable<N> t{};
+            size_t size = 0;
 
-            s += "\n";
+            for (Square s = A1; s <= H8; s = Square(s + 1))
+            {
+                const Bitboard mask = slider_mask(Pt, s);
+                Bitboard b = 0;
+
+                do
+                {
+                    t.attacks[size++] = sliding_attack(Pt, s, b);
+                    b = (b - mask) & mask;
+                } while (b);
+            }
+
+            return t;
         }
 
-        return s;
-    }
+        // Slider attacks are never empty, so a filled entry is non zero
+        template <PieceType Pt, size_t N>
+        consteval SliderTable<N> make_magic_table(const Bitboard (&magics)[Square_NB])
+        {
+            SliderTable<N> t{};
+            size_t offset = 0;
 
+            for (Square s = A1; s <= H8; s = Square(s + 1))
+            {
+                const Bitboard mask = slider_mask(Pt, s);
+                const int bits = std::popcount(mask);
+                Bitboard b = 0;
 
-    void Bitboards::init() {
+                do
+                {
+                    const size_t index = offset + size_t((b * magics[s]) >> (64 - bits));
+                    const Bitboard attacks = sliding_attack(Pt, s, b);
 
-        for (Square s1 = A1; s1 <= H8; ++s1)
-            for (Square s2 = A1; s2 <= H8; ++s2)
-                SquareDistance[s1][s2] = std::max(distance<File>(s1, s2), distance<Rank>(s1, s2));
+                    if (t.attacks[index] && t.attacks[index] != attacks)
+                        throw "magic number maps two blocker sets to one entry";
 
+                    t.attacks[index] = attacks;
+                    b = (b - mask) & mask;
+                } while (b);
 
-        init_magics(Rook, RookTable, Magics);
-        init_magics(Bishop, BishopTable, Magics);
+                offset += size_t(1) << bits;
+            }
 
-        for (Square s1 = A1; s1 <= H8; ++s1) {
-            PawnAttacks[White][s1] = pawn_attacks_bb<White>(square_bb(s1));
-            PawnAttacks[Black][s1] = pawn_attacks_bb<Black>(square_bb(s1));
+            return t;
+        }
 
+        constexpr SliderTable<RookTableSize> RookPextTable = make_pext_table<Rook, RookTableSize>();
+        constexpr SliderTable<BishopTableSize> BishopPextTable = make_pext_table<Bishop, BishopTableSize>();
+        constexpr SliderTable<RookTableSize> RookMagicTable = make_magic_table<Rook, RookTableSize>(RookMagicNumbers);
+        constexpr SliderTable<BishopTableSize> BishopMagicTable = make_magic_table<Bishop, BishopTableSize>(BishopMagicNumbers);
 
-            for (int step: { -9, -8, -7, -1, 1, 7, 8, 9})
-                PseudoAttacks[King][s1] |= safe_destination(s1, step);
+        consteval std::array<std::array<Magic, 2>, Square_NB> make_magics()
+        {
+            std::array<std::array<Magic, 2>, Square_NB> magics{};
+            size_t offset[2] = {};
 
-            for (int step: { -17, -15, -10, -6, 6, 10, 15, 17})
-                PseudoAttacks[Knight][s1] |= safe_destination(s1, step);
-            
+            for (Square s = A1; s <= H8; s = Square(s + 1))
+                for (PieceType pt : {Bishop, Rook})
+                {
+                    Magic &m = magics[s][pt - Bishop];
+                    size_t &o = offset[pt - Bishop];
 
-            PseudoAttacks[Queen][s1] = PseudoAttacks[Bishop][s1] = attacks_bb<Bishop>(s1, 0);
-            PseudoAttacks[Queen][s1] |= PseudoAttacks[Rook][s1] = attacks_bb<Rook>(s1, 0);
+                    m.mask = slider_mask(pt, s);
+                    m.magic = pt == Rook ? RookMagicNumbers[s] : BishopMagicNumbers[s];
+                    m.shift = unsigned(64 - std::popcount(m.mask));
+                    m.pext_attacks = pt == Rook ? &RookPextTable.attacks[o] : &BishopPextTable.attacks[o];
+                    m.magic_attacks = pt == Rook ? &RookMagicTable.attacks[o] : &BishopMagicTable.attacks[o];
 
-            for (PieceType pt : { Bishop, Rook })
-            for (Square s2 = A1; s2 <= H8; ++s2) {
-                if (PseudoAttacks[pt][s1] & s2) {
-                    LineBB[s1][s2] = (attacks_bb(pt, s1, 0) & attacks_bb(pt, s2, 0)) | s1 | s2;
-                    BetweenBB[s1][s2] = (attacks_bb(pt, s1, square_bb(s2)) & attacks_bb(pt, s2, square_bb(s1)));
+                    o += size_t(1) << std::popcount(m.mask);
                 }
-                BetweenBB[s1][s2] |= s2;
-            }
 
+            return magics;
+        }
 
+        void cpuid(unsigned leaf, unsigned subleaf, unsigned regs[4])
+        {
+#if defined(_MSC_VER)
+            int r[4];
+            __cpuidex(r, int(leaf), int(subleaf));
+            for (int i = 0; i < 4; i++)
+                regs[i] = unsigned(r[i]);
+#else
+            __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
         }
     }
 
 
-    namespace {
+    constexpr BoardTables Tables = make_board_tables();
 
-        Bitboard sliding_attack(PieceType pt, Square sq, Bitboard occupied) {
-            Bitboard attacks = 0;
-            Direction RookDirections[4] = { Up, Down, Left, Right };
-            Direction BishopDirections[4] = { UpRight, UpLeft, DownRight, DownLeft };
+    alignas(64) constexpr std::array<std::array<Magic, 2>, Square_NB> Magics = make_magics();
 
-            for (Direction d: (pt == Rook ? RookDirections : BishopDirections)) {
-                Square s = sq;
+    // Constant initialised, lookups made while other globals are being
+    // constructed see the build's default rather than an unset value
+#ifdef __BMI2__
+    constinit SliderLayout MagicLayout = SliderLayout::Pext;
+#else
+    constinit SliderLayout MagicLayout = SliderLayout::Multiply;
+#endif
 
-                while (safe_destination(s, d)) {
-                    attacks |= (s += d);
-                    if (occupied & s) {
-                        break;
-                    }
-                }
-            }
 
-            return attacks;
-                
-        }
+    // Returns an ASCII representation of a bitboard suitable
+    // to be printed to standard output. Useful for debugging.
+    std::string Bitboards::pretty(Bitboard b)
+    {
 
-        void init_magics(PieceType pt, Bitboard table[], Magic magics[][2])
+        std::string s = "\n";
+
+        for (Rank r = Rank_8; r >= Rank_1; --r)
         {
-            Bitboard reference[4096];
-            int size = 0;
+            for (File f = File_A; f <= File_H; ++f)
+                s += b & make_square(f, r) ? "o" : ".";
 
-            for (Square s = A1; s <= H8; ++s)
-            {
-                Bitboard edges = ((Bb_Rank_1 | Bb_Rank_8) & ~rank_bb(s)) | ((Bb_File_A | Bb_File_H) & ~file_bb(s));
+            s += "\n";
+        }
 
-                Magic &m = magics[s][pt - Bishop];
-                m.mask = sliding_attack(pt, s, 0) & ~edges;
+        return s;
+    }
 
-                m.attacks = s == A1 ? table : magics[s - 1][pt - Bishop].attacks + size;
-                size = 0;
+    bool Bitboards::pext_is_fast()
+    {
+        unsigned regs[4];
 
-                Bitboard b = 0;
+        cpuid(0, 0, regs);
+        if (regs[0] < 7)
+            return false;
 
-                do
-                {
+        char vendor[13] = {};
+        std::memcpy(vendor, &regs[1], 4);
+        std::memcpy(vendor + 4, &regs[3], 4);
+        std::memcpy(vendor + 8, &regs[2], 4);
 
-                    reference[size] = sliding_attack(pt, s, b);
-                    m.attacks[pext(b, m.mask)] = reference[size];
+        cpuid(7, 0, regs);
+        const bool bmi2 = regs[1] & (1u << 8);
 
-                    size++;
-                    b = (b - m.mask) & m.mask;
-                } while (b);
-            }
-        }
-}
+        if (!bmi2 || std::strcmp(vendor, "AuthenticAMD") != 0)
+            return bmi2;
+
+        cpuid(1, 0, regs);
+        unsigned family = (regs[0] >> 8) & 0xF;
+        if (family == 0xF)
+            family += (regs[0] >> 20) & 0xFF;
 
+        // Zen 1 and 2 are family 0x17, Zen 3 the first with PEXT in hardware
+        return family >= 0x19;
+    }
+
+    void Bitboards::set_slider_layout(SliderLayout layout) { MagicLayout = layout; }
+
+    SliderLayout Bitboards::slider_layout() { return MagicLayout; }
+
+    void Bitboards::pick_slider_layout()
+    {
+        set_slider_layout(pext_is_fast() ? SliderLayout::Pext : SliderLayout::Multiply);
+    }
 }
@@ -1,12 +1,16 @@
 #pragma once
 
+#ifdef _MSC_VER
 #include <intrin.h>
+#endif
 #include <immintrin.h>
 #define pext(b, m) _pext_u64(b, m)
 
+#include <array>
 #include <cassert>
 #include <algorithm>
 #include <cmath>
+#include <string>
 
 
 #include "types.h"
@@ -15,11 +19,31 @@
 namespace Chess {
 
 
-    namespace Bitboards {
+    // How a slider's blockers are turned into a table index. PEXT is a
+    // single instruction on Intel and on AMD since Zen 3, but microcoded
+    // and far slower than a multiply on older AMD parts.
+    enum class SliderLayout {
+        Pext,
+        Multiply
+    };
 
-        void init();
+    // Every table below is generated by the compiler and lives in read-only
+    // data. The slider layout starts out as the build targets, PEXT when
+    // BMI2 is enabled, until pick_slider_layout looks at the host.
+    namespace Bitboards {
 
         std::string pretty(Bitboard b);
+
+        // BMI2 is present and PEXT is not microcoded on this CPU
+        bool pext_is_fast();
+
+        // Not safe while other threads look up attacks
+        void set_slider_layout(SliderLayout layout);
+        SliderLayout slider_layout();
+
+        // Sets the layout pext_is_fast picks for this host. Called once at
+        // the start of main, before any thread is started.
+        void pick_slider_layout();
     }
 
     constexpr Bitboard Bb_File_A = 0x0101010101010101ULL;
@@ -41,17 +65,26 @@ namespace Chess {
     constexpr Bitboard Bb_Rank_8 = Bb_Rank_1 << (8 * 7);
 
 
+    extern SliderLayout MagicLayout;
+
+    // Each layout has its own table, the slice of a square holding
+    // 2^popcount(mask) entries in both
     struct Magic {
         Bitboard mask;
-        Bitboard* attacks;
-        unsigned index(Bitboard occupied) const {
-            return unsigned(pext(occupied, mask));
-        }
+        Bitboard magic;
+        const Bitboard* pext_attacks;
+        const Bitboard* magic_attacks;
+        unsigned shift;
+
+        Bitboard attacks_bb(Bitboard occupied) const {
+            if (MagicLayout == SliderLayout::Pext)
+                return pext_attacks[pext(occupied, mask)];
 
-        Bitboard attacks_bb(Bitboard occupied) const { return attacks[index(occupied)]; }
+            return magic_attacks[((occupied & mask) * magic) >> shift];
+        }
     };
 
-    extern Magic Magics[Square_NB][2];
+    extern const std::array<std::array<Magic, 2>, Square_NB> Magics;
 
     inline const Bitboard square_bb(Square s) {
         return (1ULL << s);
@@ -81,12 +114,16 @@ namespace Chess {
     constexpr Bitboard file_bb(Square s) { return file_bb(file_of(s)); }
 
 
-    extern u8 SquareDistance[Square_NB][Square_NB];
+    struct BoardTables {
+        u8 SquareDistance[Square_NB][Square_NB];
+
+        Bitboard BetweenBB[Square_NB][Square_NB];
+        Bitboard LineBB[Square_NB][Square_NB];
+        Bitboard PseudoAttacks[Piece_Type_NB][Square_NB];
+        Bitboard PawnAttacks[Color_NB][Square_NB];
+    };
 
-    extern Bitboard BetweenBB[Square_NB][Square_NB];
-    extern Bitboard LineBB[Square_NB][Square_NB];
-    extern Bitboard PseudoAttacks[Piece_Type_NB][Square_NB];
-    extern Bitboard PawnAttacks[Color_NB][Square_NB];
+    extern const BoardTables Tables;
 
     template <Direction D>
     constexpr Bitboard shift(Bitboard b)
@@ -113,19 +150,19 @@ namespace Chess {
 
     inline Bitboard pawn_attacks_bb(Color c, Square s)
     {
-        return PawnAttacks[c][s];
+        return Tables.PawnAttacks[c][s];
     }
 
 
     inline Bitboard line_bb(Square s1, Square s2) {
-        return LineBB[s1][s2];
+        return Tables.LineBB[s1][s2];
     }
 
     inline Bitboard between_bb(Square s1, Square s2) {
-        return BetweenBB[s1][s2];
+        return Tables.BetweenBB[s1][s2];
     }
 
-    inline bool aligned(Square s1, Square s2, Square s3) { return line_bb(s1, s2) * s3; }
+    inline bool aligned(Square s1, Square s2, Square s3) { return (line_bb(s1, s2) & s3) != 0; }
 
     template<typename T = Square>
     inline int distance(Square x, Square y);
@@ -142,7 +179,7 @@ namespace Chess {
 
     template<>
     inline int distance<Square>(Square x, Square y) {
-        return SquareDistance[x][y];
+        return Tables.SquareDistance[x][y];
     }
 
     inline int edge_distance(File f) { return std::min(f, File(File_H - f)); }
@@ -150,7 +187,7 @@ namespace Chess {
 
     template<PieceType T>
     inline Bitboard attacks_bb(Square s) {
-        return PseudoAttacks[T][s];
+        return Tables.PseudoAttacks[T][s];
     }
 
     template <PieceType T>
@@ -162,7 +199,7 @@ namespace Chess {
             case Queen:
             return attacks_bb<Bishop>(s, occupied) | attacks_bb<Rook>(s, occupied);
             default:
-            return PseudoAttacks[T][s];
+            return Tables.PseudoAttacks[T][s];
         }
     }
 
@@ -179,7 +216,7 @@ namespace Chess {
         case Queen:
             return attacks_bb<Bishop>(s, occupied) | attacks_bb<Rook>(s, occupied);
         default:
-            return PseudoAttacks[pt][s];
+            return Tables.PseudoAttacks[pt][s];
         }
     }
 
@@ -189,15 +226,23 @@ namespace Chess {
     }
 
     inline Square lsb(Bitboard b) {
+#ifdef _MSC_VER
         unsigned long idx;
         _BitScanForward64(&idx, b);
         return Square(idx);
+#else
+        return Square(__builtin_ctzll(b));
+#endif
     }
 
     inline Square msb(Bitboard b) {
+#ifdef _MSC_VER
         unsigned long idx;
         _BitScanReverse64(&idx, b);
         return Square(idx);
+#else
+        return Square(63 ^ __builtin_clzll(b));
+#endif
     }
 
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <vector>
 #include <cstdint>
 #include <cassert>
@@ -28,6 +29,14 @@ public:
         w[i >> 6] |= (1ULL << (i & 63));
     }
 
+    // For bitsets filled from several threads at once; neighbouring
+    // indices share a word
+    inline void set_atomic(size_t i)
+    {
+        assert(i < nbits);
+        std::atomic_ref<uint64_t>(w[i >> 6]).fetch_or(1ULL << (i & 63), std::memory_order_relaxed);
+    }
+
     inline void reset(size_t i) {
         assert(i < nbits);
         w[i >> 6] &= ~(1ULL << (i & 63));
@@ -37,6 +46,23 @@ public:
         std::fill(w.begin(), w.end(), 0ULL);
     }
 
+    // Sets bits [0, size()), the unused high bits of the last word stay clear
+    void fill() {
+        std::fill(w.begin(), w.end(), ~0ULL);
+        if (nbits & 63)
+            w.back() = (1ULL << (nbits & 63)) - 1;
+    }
+
+    // Grows in place, the new bits start cleared
+    void resize(size_t bits) {
+        assert(bits >= nbits);
+        nbits = bits;
+        w.resize((bits + 63) >> 6, 0ULL);
+    }
+
+    // Bits past size() are always clear, whole words can be compared
+    bool operator==(const Bitset &other) const = default;
+
     friend Bitset operator&(const Bitset &a, const Bitset &b);
     friend Bitset& operator&=(Bitset& a, const Bitset& b);
 
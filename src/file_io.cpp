@@ -1,4 +1,12 @@
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <cstring>
 #include <string>
 #include <stdexcept>
 #include <vector>
@@ -12,6 +20,25 @@
 namespace Util
 {
 
+#ifdef _WIN32
+    FileAppender::FileAppender(const std::string &filename, bool createPath)
+        : hFile(INVALID_HANDLE_VALUE), _isOpen(false), filename(filename)
+    {
+
+        if (createPath)
+        {
+            // Create directory structure if needed
+            size_t pos = filename.find_last_of("\\/");
+            if (pos != std::string::npos)
+            {
+                std::string path = filename.substr(0, pos);
+                CreateDirectoryA(path.c_str(), nullptr); // Ignores if exists
+            }
+        }
+
+        open();
+    }
+
     void FileAppender::throwLastError(const std::string &operation) const
     {
         DWORD error = GetLastError();
@@ -94,17 +121,118 @@ namespace Util
         _isOpen = true;
     }
 
+#else
+    FileAppender::FileAppender(const std::string &filename, bool createPath)
+        : fd(-1), _isOpen(false), filename(filename)
+    {
+
+        if (createPath)
+        {
+            // Create directory structure if needed
+            size_t pos = filename.find_last_of("\\/");
+            if (pos != std::string::npos)
+            {
+                std::string path = filename.substr(0, pos);
+                mkdir(path.c_str(), 0755); // Ignores if exists
+            }
+        }
+
+        open();
+    }
+
+    void FileAppender::throwLastError(const std::string &operation) const
+    {
+        throw std::system_error(errno,
+                                std::system_category(),
+                                "Failed to " + operation + " file: " + filename);
+    }
+
+    FileAppender &FileAppender::operator=(FileAppender &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (_isOpen)
+                ::close(fd);
+            fd = other.fd;
+            _isOpen = other._isOpen;
+            filename = std::move(other.filename);
+            other.fd = -1;
+            other._isOpen = false;
+        }
+        return *this;
+    }
+
+    void FileAppender::open()
+    {
+        if (_isOpen)
+            return;
+
+        fd = ::open(filename.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+
+        if (fd < 0)
+        {
+            throwLastError("open");
+        }
+
+        _isOpen = true;
+    }
+
+    void FileAppender::close()
+    {
+        if (_isOpen)
+        {
+            flush();
+            ::close(fd);
+            fd = -1;
+            _isOpen = false;
+        }
+    }
+
+    void FileAppender::clear()
+    {
+        if (!_isOpen)
+            return;
+
+        // Close the file
+        close();
+
+        // Reopen with truncation flag
+        fd = ::open(filename.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 0644);
+
+        if (fd < 0)
+        {
+            throwLastError("clear");
+        }
+
+        _isOpen = true;
+    }
+
+#endif
+
     // Write methods with return values
-    size_t FileAppender::write(const std::string &data)
+    size_t FileAppender::write(std::string_view data)
     {
-        return writeBinary(data.c_str(), data.size());
+        return writeBinary(data.data(), data.size());
     }
 
-    size_t FileAppender::writeLine(const std::string &data)
+    size_t FileAppender::writeLine(std::string_view data)
     {
-        return write(data + "\r\n");
+        // Stage short lines with their terminator on the stack, one write
+        // call per line and no allocation
+        char line[512];
+
+        if (data.size() + 2 > sizeof(line))
+        {
+            return write(data) + write("\r\n");
+        }
+
+        std::memcpy(line, data.data(), data.size());
+        line[data.size()] = '\r';
+        line[data.size() + 1] = '\n';
+        return writeBinary(line, data.size() + 2);
     }
 
+#ifdef _WIN32
     size_t FileAppender::writeBinary(const void *data, size_t size)
     {
         if (!_isOpen || !data || size == 0)
@@ -126,6 +254,24 @@ namespace Util
         return bytesWritten;
     }
 
+#else
+    size_t FileAppender::writeBinary(const void *data, size_t size)
+    {
+        if (!_isOpen || !data || size == 0)
+            return 0;
+
+        ssize_t bytesWritten = ::write(fd, data, size);
+
+        if (bytesWritten < 0)
+        {
+            throwLastError("write");
+        }
+
+        return static_cast<size_t>(bytesWritten);
+    }
+
+#endif
+
     // Write with timestamp
     size_t FileAppender::writeWithTimestamp(const std::string &data)
     {
@@ -144,6 +290,7 @@ namespace Util
         return (write(std::forward<Args>(args)) + ...);
     }
 
+#ifdef _WIN32
     bool FileAppender::flush()
     {
         if (!_isOpen)
@@ -165,9 +312,34 @@ namespace Util
         return 0;
     }
 
+#else
+    bool FileAppender::flush()
+    {
+        if (!_isOpen)
+            return false;
+        return fsync(fd) == 0;
+    }
+
+    // Get file info
+    size_t FileAppender::size() const
+    {
+        if (!_isOpen)
+            return 0;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0)
+        {
+            return static_cast<size_t>(st.st_size);
+        }
+        return 0;
+    }
+
+#endif
+
     bool FileAppender::isOpen() const { return _isOpen; }
     const std::string & FileAppender::getFilename() const { return filename; }
 
+#ifdef _WIN32
     // Seek to end (useful for ensuring we're at the end)
     bool FileAppender::seekToEnd()
     {
@@ -177,4 +349,14 @@ namespace Util
         LARGE_INTEGER distance = {0};
         return SetFilePointerEx(hFile, distance, nullptr, FILE_END) != 0;
     }
+#else
+    // Seek to end (useful for ensuring we're at the end)
+    bool FileAppender::seekToEnd()
+    {
+        if (!_isOpen)
+            return false;
+
+        return lseek(fd, 0, SEEK_END) != -1;
+    }
+#endif
 }
\ No newline at end of file
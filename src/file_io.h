@@ -1,11 +1,23 @@
 #pragma once
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include <string>
+#include <string_view>
+
 namespace Util {
 
     class FileAppender
     {
     private:
+#ifdef _WIN32
         HANDLE hFile;
+#else
+        int fd;
+#endif
         bool _isOpen;
         std::string filename;
 
@@ -13,39 +25,36 @@ namespace Util {
 
     public:
         // Constructor with options
-        explicit FileAppender(const std::string &filename, bool createPath = false)
-            : hFile(INVALID_HANDLE_VALUE), _isOpen(false), filename(filename)
-        {
-
-            if (createPath)
-            {
-                // Create directory structure if needed
-                size_t pos = filename.find_last_of("\\/");
-                if (pos != std::string::npos)
-                {
-                    std::string path = filename.substr(0, pos);
-                    CreateDirectoryA(path.c_str(), nullptr); // Ignores if exists
-                }
-            }
-
-            open();
-        }
+        explicit FileAppender(const std::string &filename, bool createPath = false);
 
         ~FileAppender()
         {
             if (_isOpen)
             {
+#ifdef _WIN32
                 CloseHandle(hFile);
+#else
+                ::close(fd);
+#endif
             }
         }
 
         // Move operations
+#ifdef _WIN32
         FileAppender(FileAppender &&other) noexcept
             : hFile(other.hFile), _isOpen(other._isOpen), filename(std::move(other.filename))
         {
             other.hFile = INVALID_HANDLE_VALUE;
             other._isOpen = false;
         }
+#else
+        FileAppender(FileAppender &&other) noexcept
+            : fd(other.fd), _isOpen(other._isOpen), filename(std::move(other.filename))
+        {
+            other.fd = -1;
+            other._isOpen = false;
+        }
+#endif
 
         FileAppender &operator=(FileAppender &&other) noexcept;
 
@@ -59,8 +68,8 @@ namespace Util {
         // Clear the file contents (truncate to 0)
         void clear();
         // Write methods with return values
-        size_t write(const std::string &data);
-        size_t writeLine(const std::string &data);
+        size_t write(std::string_view data);
+        size_t writeLine(std::string_view data);
         size_t writeBinary(const void *data, size_t size);
 
         // Write with timestamp
@@ -1,6 +1,9 @@
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <string_view>
 #include <sstream>
+#include <thread>
 
 #include "bitboard.h"
 #include "position.h"
@@ -8,6 +11,10 @@
 #include "matcher.h"
 #include "moves.h"
 #include "file_io.h"
+#include "position_store.h"
+#include "witness_line.h"
+#include "search.h"
+#include "pgn.h"
 
 
 
@@ -27,9 +34,9 @@ int adhoc_validate_puzzle_solution(Test::LichessPuzzle puzzle) {
     iss >> first_move;
     iss >> second_move;
 
-    p.make_move(Chess::Move::parse_uci(first_move));
+    p.make_move(p.parse_uci(first_move));
 
-    Chess::Move move = Chess::Move::parse_uci(second_move);
+    Chess::Move move = p.parse_uci(second_move);
 
     Chess::Piece a = p.piece_on(move.from_sq());
     Chess::Piece b = p.piece_on(move.to_sq());
@@ -41,50 +48,349 @@ int adhoc_validate_puzzle_solution(Test::LichessPuzzle puzzle) {
 }
 
 
-int main() {
+// Usage: main                              runs full_query on every row
+//        main --line <ply>:<feature> ...     rows whose solution line has
+//                                            each feature at its ply, ply 0
+//                                            being after the first move
+//        main --pgn <games.pgn[.gz|.zst]>    runs full_query on every
+//                                            position of every game, with
+//                                            --us and --verify as for rows
+//
+// Options go before the mode:
+// --us        flips every position with black to move, so features and
+//             dedup only ever see white to move
+// --verify    keeps only the full_query matches where a bounded tactical
+//             search confirms the side to move wins material
+// --track     with --line, numbers each piece once per line and links it
+//             from ply to ply, then prints the moves, captures and
+//             recaptures of each transition. Not with --us.
+// --append    after the query, each line read from stdin picks up the rows
+//             appended to the CSV since and runs only those through both
+//             passes, then queries again; until the end of input
+int main(int argc, char **argv) {
     std::cout << "Hello" << std::endl;
 
-    Chess::Bitboards::init();
+    Chess::Bitboards::pick_slider_layout();
+
+    bool color_canonical = false;
+    bool verify = false;
+    bool append = false;
+    bool track = false;
+
+    for (; argc > 1; argc--, argv++) {
+        const std::string_view option = argv[1];
+        if (option == "--us")
+            color_canonical = true;
+        else if (option == "--verify")
+            verify = true;
+        else if (option == "--append")
+            append = true;
+        else if (option == "--track")
+            track = true;
+        else
+            break;
+        argv[1] = argv[0];
+    }
 
     Chess::BitsetManager res;
+
+    if (track && !(argc > 1 && std::string_view(argv[1]) == "--line")) {
+        std::cout << "--track only applies to --line" << std::endl;
+        return 1;
+    }
+
+    if (append && argc > 1 && std::string_view(argv[1]).starts_with("--")) {
+        std::cout << "--append only applies to the puzzle query" << std::endl;
+        return 1;
+    }
+
+    if (argc > 2 && std::string_view(argv[1]) == "--pgn") {
+        Chess::PgnDatabase games;
+        if (!games.open_and_build_index(argv[2])) {
+            std::cout << "Cannot read " << argv[2] << std::endl;
+            return 1;
+        }
+
+        const u64 total = games.row_count();
+        std::cout << "Games: " << games.game_count() << ", positions: " << total << std::endl;
+
+        const size_t nb_workers = std::max(std::thread::hardware_concurrency(), 1u);
+
+        // Every pass decodes the SAN again, the timings include it
+        auto timed_pass = [&](const char *name, auto &&visit) {
+            std::cout << name << std::endl;
+            const auto start = std::chrono::steady_clock::now();
+            const Chess::PgnPassStats stats = games.pass_positions(visit, nb_workers);
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "  " << elapsed.count() << "s, " << u64(total / std::max(elapsed.count(), 1e-9)) << " positions/sec" << std::endl;
+
+            if (stats.truncated_games)
+                std::cout << "  " << stats.truncated_games << " games stop at an illegal move or a bad FEN, "
+                          << stats.skipped_rows << " positions left out" << std::endl;
+            return stats.read;
+        };
+
+        // An oriented ply is flipped back before the game goes on
+        auto oriented = [color_canonical](auto &&visit) {
+            return [color_canonical, &visit](Chess::Position &p, u64 row, size_t batch) {
+                if (!color_canonical || p.side_to_move() == Chess::White) {
+                    visit(p, row, batch);
+                    return;
+                }
+                p.flip();
+                visit(p, row, batch);
+                p.flip();
+            };
+        };
+
+        auto first_pass = [&res](const Chess::Position &p, u64 row, size_t) {
+            res.push_position_first_pass(p, row);
+        };
+
+        res.begin_first_pass(total);
+        timed_pass("First Pass", oriented(first_pass));
+        res.end_first_pass();
+
+        auto second_pass = [&res](const Chess::Position &p, u64 row, size_t batch) {
+            if (res.is_canonical(row))
+                res.process_position_second_pass(p, row, batch);
+        };
+
+        // One shard per batch keeps the relation edges in row order
+        res.begin_second_pass(games.batch_count());
+        timed_pass("Second Pass", oriented(second_pass));
+        res.end_second_pass();
+
+        std::vector<u64> matches;
+        res.full_query([&matches](u64 row) { matches.push_back(row); });
+
+        // The games are replayed once more to search the matched plies,
+        // material is the same from either side so they are not oriented
+        if (verify) {
+            std::vector<u8> wins(matches.size(), 0);
+
+            timed_pass("Verify Pass", [&](Chess::Position &p, u64 row, size_t) {
+                const auto match = std::lower_bound(matches.begin(), matches.end(), row);
+                if (match == matches.end() || *match != row)
+                    return;
+
+                // The table is kept across the plies a thread gets
+                thread_local Chess::TacticalSearch search;
+                wins[match - matches.begin()] = search.wins_material(p);
+            });
+
+            const size_t checked = matches.size();
+            size_t kept = 0;
+            for (size_t k = 0; k < checked; k++) {
+                if (wins[k])
+                    matches[kept++] = matches[k];
+            }
+            matches.resize(kept);
+
+            std::cout << "Verified: [" << kept << "/" << checked << "]" << std::endl;
+        }
+
+        for (size_t k = 0; k < std::min<size_t>(matches.size(), 16); k++) {
+            const Chess::PgnRow row = games.row(matches[k]);
+            std::cout << matches[k] << ":> game " << row.game << " ply " << row.ply << std::endl;
+        }
+
+        std::cout << "Total found: [" << matches.size() << "/" << total << "] Done.\n";
+        return 0;
+    }
+
     Test::LichessDbPuzzle db;
 
+    const std::string db_path = "../data/lichess_db_puzzle.csv";
+
     //db.open_and_build_index("../data/single_out.csv");
     //db.open_and_build_index("../data/athousand_sorted.csv");
-    db.open_and_build_index("../data/lichess_db_puzzle.csv");
+    db.open_and_build_index(db_path);
     //db.open_and_build_index("../data/test.log");
 
-    std::cout << "First Pass" << std::endl;
+    // Positions packed by pack_positions skip FEN/UCI parsing altogether,
+    // the CSV is then only read back for the matched rows
+    Chess::PositionStore store;
+    bool packed = store.open("../data/lichess_db_puzzle.pos", db_path);
 
-    res.begin_first_pass();
+    if (packed) {
+        std::cout << "Using packed positions" << std::endl;
+    }
 
-    std::string buffer;
-    buffer.reserve(256);
-    Chess::Position p;
+    // One Position per shard, rows of a shard never run concurrently
+    const size_t nb_shards = Test::default_shard_count();
+    std::vector<Chess::Position> positions(nb_shards);
+
+    // Rows that cannot match full_query are skipped before the FEN is parsed
+    const Chess::FenPrefilter prefilter = Chess::BitsetManager::full_query_prefilter();
+
+    auto orient = [color_canonical](Chess::Position &p) {
+        if (color_canonical && p.side_to_move() == Chess::Black)
+            p.flip();
+    };
+
+    // wanted(index) is asked before the position is set up. Rows appended
+    // to the CSV after the store was packed are read from the CSV.
+    auto for_each_position = [&](auto &&wanted, auto &&process, size_t first_row = 0) {
+        if (packed && first_row < store.size()) {
+            Test::run_sharded(first_row, store.size(), nb_shards, [&](size_t shard, size_t first, size_t last) {
+                for (size_t index = first; index < last; index++) {
+                    if (!wanted(index))
+                        continue;
+
+                    store.get(index, positions[shard]);
+                    orient(positions[shard]);
+                    process(positions[shard], index, shard);
+                }
+            });
+            return;
+        }
+
+        db.pass_FEN_and_first_UCI_sharded([&](const std::string_view FEN, const std::string_view UCI, const u64 index, const size_t shard) {
+            if (!prefilter.accepts(FEN) || !wanted(index))
+                return;
+
+            positions[shard].set_and_move(FEN, UCI);
+            orient(positions[shard]);
+            process(positions[shard], index, shard);
+        }, nb_shards, first_row);
+    };
+
+    // Unknown for a compressed stream until it was read once, that pass is
+    // serial and lets the counts grow
+    auto row_count = [&]() { return packed ? store.size() : db.row_count(); };
+
+    if (argc > 2 && std::string_view(argv[1]) == "--line") {
+        std::vector<Chess::WitnessLineIndex::Condition> conditions;
+        size_t nb_plies = 0;
+
+        for (int i = 2; i < argc; i++) {
+            const std::string_view arg = argv[i];
+            const size_t colon = arg.find(':');
+            const Chess::FeatureInfo *info = colon == std::string_view::npos ? nullptr : Chess::find_feature(arg.substr(colon + 1));
+
+            if (!info) {
+                std::cout << "Expected <ply>:<feature>, got " << arg << std::endl;
+                return 1;
+            }
+
+            const size_t ply = std::stoul(std::string(arg.substr(0, colon)));
+            conditions.push_back({ply, info->id});
+            nb_plies = std::max(nb_plies, ply + 1);
+        }
+
+        // Links are made from the move as played, a flipped ply would not
+        // hold its squares
+        if (track && color_canonical) {
+            std::cout << "--track cannot be combined with --us" << std::endl;
+            return 1;
+        }
+
+        Chess::WitnessLineIndex lines(nb_plies, track);
+
+        // visit(ply, p, m, index, shard) on each ply of every row, replayed on
+        // the shard's Position. An oriented ply is flipped back before the
+        // next move is played.
+        auto for_each_line = [&](auto &&line_visit) {
+            auto visit = [&](size_t ply, Chess::Position &p, Chess::Move m, u64 index, size_t shard) {
+                if (!color_canonical || p.side_to_move() == Chess::White) {
+                    line_visit(ply, p, m, index, shard);
+                    return;
+                }
+                p.flip();
+                line_visit(ply, p, m, index, shard);
+                p.flip();
+            };
+
+            if (packed) {
+                Test::run_sharded(0, store.size(), nb_shards, [&](size_t shard, size_t first, size_t last) {
+                    for (size_t index = first; index < last; index++) {
+                        store.get(index, positions[shard]);
+                        Chess::WitnessLineIndex::replay(positions[shard], store.moves(index), nb_plies, [&](size_t ply, const Chess::Position &, Chess::Move m) {
+                            visit(ply, positions[shard], m, index, shard);
+                        });
+                    }
+                });
+                return;
+            }
+
+            db.pass_FEN_and_moves_sharded([&](const std::string_view FEN, const std::string_view moves, const u64 index, const size_t shard) {
+                const size_t space = moves.find(' ');
+                const std::string_view rest = space == std::string_view::npos ? std::string_view() : moves.substr(space + 1);
+
+                positions[shard].set_and_move(FEN, moves.substr(0, space));
+                Chess::WitnessLineIndex::replay(positions[shard], rest, nb_plies, [&](size_t ply, const Chess::Position &, Chess::Move m) {
+                    visit(ply, positions[shard], m, index, shard);
+                });
+            }, nb_shards);
+        };
+
+        std::cout << "First Pass" << std::endl;
+
+        lines.begin_first_pass(row_count());
+        for_each_line([&lines](size_t ply, const Chess::Position &p, Chess::Move, u64 index, size_t) {
+            lines.push_position_first_pass(ply, p, index);
+        });
+        lines.end_first_pass();
+
+        std::cout << "Second Pass" << std::endl;
+
+        lines.begin_second_pass(nb_shards);
+        for_each_line([&lines](size_t ply, const Chess::Position &p, Chess::Move m, u64 index, size_t shard) {
+            lines.process_position_second_pass(ply, p, m, index, shard);
+        });
+        lines.end_second_pass();
+
+        for (size_t k = 0; track && k + 1 < nb_plies; k++) {
+            const Chess::TemporalRelations &t = lines.transition(k);
+            std::cout << "Ply " << k << " -> " << k + 1 << ": " << t.same_piece.size() << " pieces kept, "
+                      << t.moved.size() << " moved, " << t.captured.size() << " captures, "
+                      << t.recaptured_by.size() << " recaptures" << std::endl;
+        }
+
+        const Chess::Bitset rows = lines.rows_where(conditions);
+
+        std::vector<size_t> matches;
+        for (size_t row = 0; row < rows.size(); row++) {
+            if (rows.test(row))
+                matches.push_back(row);
+        }
+
+        size_t shown = 0;
+        db.pass_rows(matches, [&shown](size_t position_id, const Test::LichessPuzzleView &puzzle) {
+            if (shown++ < 16)
+                std::cout << position_id << ":> " << puzzle.link() << std::endl;
+        });
+
+        std::cout << "Total found: [" << matches.size() << "/" << row_count() << "] Done.\n";
+        return 0;
+    }
 
-    int total = 0;
+    std::cout << "First Pass" << std::endl;
 
-    db.pass_FEN_and_first_UCI([&p, &res, &buffer, &total](const std::string_view FEN, const std::string_view UCI, const u64 index) {
-        total++;
-        buffer.assign(FEN);
-        p.set(buffer);
-        buffer.assign(UCI);
+    res.begin_first_pass(row_count());
 
-        p.make_move(Chess::Move::parse_uci(buffer));
+    for_each_position([](u64) { return true; }, [&res](const Chess::Position &p, const u64 index, size_t) {
         res.push_position_first_pass(p, index);
     });
 
     res.end_first_pass();
 
+    const size_t total = row_count();
+
     std::cout << "Second Pass" << std::endl;
-    db.pass_FEN_and_first_UCI([&res, &p, &buffer](const std::string_view FEN, const std::string_view UCI, const u64 index) {
-        buffer.assign(FEN);
-        p.set(buffer);
-        buffer.assign(UCI);
-        p.make_move(Chess::Move::parse_uci(buffer));
-        res.process_position_second_pass(p, index);
+
+    res.begin_second_pass(nb_shards);
+
+    // Repeated positions share the features of their first row
+    auto canonical = [&res](u64 index) { return res.is_canonical(index); };
+
+    for_each_position(canonical, [&res](const Chess::Position &p, const u64 index, size_t shard) {
+        res.process_position_second_pass(p, index, shard);
     });
 
+    res.end_second_pass();
+
 
     //Util::FileAppender logger("../data/test.log", true);
     Util::FileAppender logger("../data/test2.log", true);
@@ -93,9 +399,65 @@ int main() {
     int yes = 0;
     int no = 0;
     int i = 0;
-    res.full_query([&i, &db, &no, &yes, &logger](u64 position_id)
+    // Matches come out in row order, which lets a compressed dump be
+    // materialized in one more streaming pass
+    std::vector<size_t> matches;
+    res.full_query([&matches](u64 position_id)
+                   { matches.push_back(position_id); });
+
+    // Keeps the matches where a bounded tactical search confirms the side
+    // to move wins material
+    auto keep_verified = [&](std::vector<size_t> &matches) {
+        // The search needs the position after the first move of each match,
+        // rows past the packed store are read from the CSV
+        const auto in_store = std::partition_point(matches.begin(), matches.end(), [&](size_t row) {
+            return packed && row < store.size();
+        }) - matches.begin();
+
+        std::vector<std::string> FENs, first_moves;
+        db.pass_rows(std::vector<size_t>(matches.begin() + in_store, matches.end()), [&](size_t, const Test::LichessPuzzleView &puzzle) {
+            FENs.emplace_back(puzzle.FEN);
+            first_moves.emplace_back(puzzle.moves.substr(0, puzzle.moves.find(' ')));
+        });
+
+        std::vector<u8> wins(matches.size(), 0);
+
+        const auto start = std::chrono::steady_clock::now();
+
+        Test::run_sharded(0, matches.size(), nb_shards, [&](size_t shard, size_t first, size_t last) {
+            // The table is kept across the rows a thread gets
+            thread_local Chess::TacticalSearch search;
+
+            Chess::Position &p = positions[shard];
+            for (size_t k = first; k < last; k++) {
+                if (k < size_t(in_store))
+                    store.get(matches[k], p);
+                else
+                    p.set_and_move(FENs[k - in_store], first_moves[k - in_store]);
+
+                wins[k] = search.wins_material(p);
+            }
+        });
+
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        const size_t checked = matches.size();
+        size_t kept = 0;
+        for (size_t k = 0; k < checked; k++) {
+            if (wins[k])
+                matches[kept++] = matches[k];
+        }
+        matches.resize(kept);
+
+        std::cout << "Verified: [" << kept << "/" << checked << "] in " << elapsed.count() << "s, "
+                  << u64(checked / std::max(elapsed.count(), 1e-9)) << " positions/sec" << std::endl;
+    };
+
+    if (verify)
+        keep_verified(matches);
+
+    db.pass_rows(matches, [&i, &no, &yes, &logger](size_t position_id, const Test::LichessPuzzleView &puzzle)
                    {
-                       Test::LichessPuzzle puzzle = db.get_full(position_id);
                        logger.writeLine(puzzle.full);
 
                        int result = 0;//adhoc_validate_puzzle_solution(puzzle);
@@ -116,7 +478,7 @@ int main() {
                            {
                                return;
                            }
-                           std::cout << position_id << ":> " << puzzle.link << std::endl;
+                           std::cout << position_id << ":> " << puzzle.link() << std::endl;
                        }
                    });
 
@@ -124,5 +486,59 @@ int main() {
     std::cout << "Total found: %" << percent << "[" << i << "/" << total << "] Done.\n";
     std::cout << "No Yes:> " << no << "/" << yes << " Done.\n";
 
+    // Only the new rows are read, the bitsets, pieces and relation edges
+    // of the earlier ones are grown in place. Earlier rows keep their
+    // answer, the new matches are all past first_new. A CSV rewritten
+    // under us is indexed again from row 0 and built from scratch.
+    size_t found = matches.size();
+
+    for (std::string line; append && std::getline(std::cin, line);) {
+        const size_t first_new = db.refresh();
+        const size_t nb_rows = db.row_count();
+
+        if (first_new >= nb_rows)
+            continue;
+
+        const bool rebuilt = first_new == 0;
+        if (rebuilt) {
+            // The store was packed from the file as it was
+            if (packed)
+                store.close();
+            packed = false;
+            found = 0;
+            res.begin_first_pass(nb_rows);
+        } else {
+            res.begin_append_pass(nb_rows);
+        }
+
+        for_each_position([](u64) { return true; }, [&res](const Chess::Position &p, const u64 index, size_t) {
+            res.push_position_first_pass(p, index);
+        }, first_new);
+
+        if (rebuilt)
+            res.end_first_pass();
+        else
+            res.end_append_pass();
+
+        res.begin_second_pass(nb_shards);
+        for_each_position(canonical, [&res](const Chess::Position &p, const u64 index, size_t shard) {
+            res.process_position_second_pass(p, index, shard);
+        }, first_new);
+        res.end_second_pass();
+
+        std::vector<size_t> new_matches;
+        res.full_query([&](u64 position_id) {
+            if (position_id >= first_new)
+                new_matches.push_back(position_id);
+        });
+
+        if (verify)
+            keep_verified(new_matches);
+        found += new_matches.size();
+
+        std::cout << (rebuilt ? "Rebuilt " : "Appended ") << nb_rows - first_new << " rows, " << new_matches.size() << " new matches. Total found: ["
+                  << found << "/" << nb_rows << "]" << std::endl;
+    }
+
     return 0;
 }
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <bit>
 #include <iostream>
 #include <array>
 
@@ -8,9 +10,75 @@
 namespace Chess
 {
 
+    FenPrefilter prefilter_for_domains(std::initializer_list<FeatureDomain> domains)
+    {
+        u8 needed[Piece_Type_NB] = {};
+        for (FeatureDomain domain : domains)
+            needed[domain_piece_type(domain)]++;
+
+        FenPrefilter filter;
+        for (PieceType pt : {Knight, Bishop, Rook, Queen})
+        {
+            if (needed[pt])
+                filter.clauses.push_back({pt, needed[pt]});
+        }
+        return filter;
+    }
+
+    const FeatureInfo *find_feature(FeatureID id)
+    {
+        for (const auto &info : FEATURE_REGISTRY)
+            if (info.id == id)
+                return &info;
+        return nullptr;
+    }
+
+    const FeatureInfo *find_feature(std::string_view name)
+    {
+        for (const auto &info : FEATURE_REGISTRY)
+            if (info.name == name)
+                return &info;
+        return nullptr;
+    }
+
+    bool FenPrefilter::accepts(std::string_view FEN) const
+    {
+        if (clauses.empty())
+            return true;
+
+        u8 counts[Piece_NB];
+        fen_piece_counts(FEN, counts);
+
+        bool promotion_left = counts[White_Pawn] + counts[Black_Pawn] > 0;
+
+        for (const Clause &clause : clauses)
+        {
+            const int have = counts[make_piece(White, clause.type)] + counts[make_piece(Black, clause.type)];
+
+            if (have >= clause.min_count)
+                continue;
+
+            if (promotion_left && have + 1 == clause.min_count)
+            {
+                promotion_left = false;
+                continue;
+            }
+
+            return false;
+        }
+        return true;
+    }
+
+    FenPrefilter BitsetManager::full_query_prefilter()
+    {
+        // The two ends of the relation are distinct pieces
+        const RelationInfo *relation = find_relation(FULL_QUERY.relation);
+        return prefilter_for_domains({relation->left, relation->right});
+    }
+
     void BitsetManager::full_query(std::function<void(u64)> materialize) {
 
-        Bitset queens_only_defended_by_rook = features.queen_features[FeatureID::QUEEN_ONLY_DEFENDED_BY_ROOK];
+        const Bitset &queens_only_defended_by_rook = piece_features(FULL_QUERY.feature);
 
         Bitset knight_can_be_captured_with_check = features.knight_features[FeatureID::KNIGHT_CAN_BE_CAPTURED_WITH_CHECK];
 
@@ -26,14 +94,14 @@ namespace Chess
         Bitset good_bishops = bishops_only_defended_by_knight & bishops_defended_by_those_knights;
 
         Bitset queens_attacked_by_queen = project_left(
-            relations.queen_attacks_queen,
+            relations.get<FULL_QUERY.relation>(),
             queens_only_defended_by_rook,
             nb_pieces
         );
 
         Bitset good_queens = queens_attacked_by_queen;
 
-        Bitset positions(nb_pieces);
+        Bitset positions(nb_positions);
         /*
         for (size_t k = 0; k < nb_pieces; ++k) {
             if (good_bishops.test(k)) {
@@ -52,13 +120,78 @@ namespace Chess
 
         Bitset final_positions = positions;// & features.position_features[FeatureID::SIDE_TO_MOVE_WHITE];
 
-        for (size_t k = 0; k < nb_pieces; k++) {
-            if (final_positions.test(k)) {
-                materialize(k);
+        // Duplicate rows follow their canonical row
+        for (u64 id = 0; id < nb_positions; id++) {
+            if (final_positions.test(canonical[id])) {
+                materialize(id);
             }
         }
     }
 
+    Bitset BitsetManager::flipped_rows() const
+    {
+        Bitset rows(nb_positions);
+        for (u64 row = 0; row < nb_positions; row++)
+        {
+            if (orientation[row])
+                rows.set(row);
+        }
+        return rows;
+    }
+
+    const Bitset &BitsetManager::piece_features(FeatureID id) const
+    {
+        const FeatureInfo *info = find_feature(id);
+        assert(info && info->domain != FeatureDomain::Position);
+
+        switch (info->domain)
+        {
+        case FeatureDomain::KnightInstance:
+            return features.knight_features.at(id);
+        case FeatureDomain::BishopInstance:
+            return features.bishop_features.at(id);
+        default:
+            return features.queen_features.at(id);
+        }
+    }
+
+    Bitset BitsetManager::rows_with(FeatureID id) const
+    {
+        const FeatureInfo *info = find_feature(id);
+        assert(info);
+
+        if (info->domain != FeatureDomain::Position)
+            return rows_of(piece_features(id));
+
+        const Bitset &positions = features.position_features.at(id);
+
+        Bitset rows(nb_positions);
+        for (u64 row = 0; row < nb_positions; row++)
+        {
+            if (positions.test(canonical[row]))
+                rows.set(row);
+        }
+        return rows;
+    }
+
+    Bitset BitsetManager::rows_of(const Bitset &bits) const
+    {
+        Bitset positions(nb_positions);
+        for (size_t k = 0; k < nb_pieces; ++k)
+        {
+            if (bits.test(k))
+                positions.set(pieces[k].position_id);
+        }
+
+        Bitset rows(nb_positions);
+        for (u64 row = 0; row < nb_positions; row++)
+        {
+            if (positions.test(canonical[row]))
+                rows.set(row);
+        }
+        return rows;
+    }
+
     void BitsetManager::process_position_features(
         const Position &p,
         uint64_t position_id)
@@ -72,7 +205,7 @@ namespace Chess
 
             if (fn(p))
             {
-                features.position_features[ext.id].set(position_id);
+                features.position_features.at(ext.id).set_atomic(position_id);
             }
         }
     }
@@ -80,6 +213,7 @@ namespace Chess
 
     void BitsetManager::process_bishop_features(
         const Position &p,
+        const AttackInfo &ai,
         u64 position_id,
         Square square,
         Color color,
@@ -91,15 +225,16 @@ namespace Chess
                 continue;
 
             auto fn = reinterpret_cast<PieceFeatureFn>(ext.fn);
-            if (fn(p, PieceInstance{position_id, square, color}))
+            if (fn(p, ai, PieceInstance{position_id, square, color, Bishop}))
             {
-                features.bishop_features[ext.id].set(bishop_index);
+                features.bishop_features.at(ext.id).set_atomic(bishop_index);
             }
         }
     }
 
     void BitsetManager::process_queen_features(
         const Position &p,
+        const AttackInfo &ai,
         u64 position_id,
         Square square,
         Color color,
@@ -111,9 +246,9 @@ namespace Chess
                 continue;
 
             auto fn = reinterpret_cast<PieceFeatureFn>(ext.fn);
-            if (fn(p, PieceInstance{position_id, square, color}))
+            if (fn(p, ai, PieceInstance{position_id, square, color, Queen}))
             {
-                features.queen_features[ext.id].set(queen_index);
+                features.queen_features.at(ext.id).set_atomic(queen_index);
             }
         }
     }
@@ -122,6 +257,7 @@ namespace Chess
 
     void BitsetManager::process_knight_features(
         const Position &p,
+        const AttackInfo &ai,
         u64 position_id,
         Square square,
         Color color,
@@ -133,9 +269,9 @@ namespace Chess
                 continue;
 
             auto fn = reinterpret_cast<PieceFeatureFn>(ext.fn);
-            if (fn(p, PieceInstance{position_id, square, color}))
+            if (fn(p, ai, PieceInstance{position_id, square, color, Knight}))
             {
-                features.knight_features[ext.id].set(knight_index);
+                features.knight_features.at(ext.id).set_atomic(knight_index);
             }
         }
     }
@@ -164,31 +300,168 @@ namespace Chess
         }
     }
 
-    void BitsetManager::begin_first_pass() {
+    void BitsetManager::grow_features()
+    {
+        for (auto &[id, bits] : features.position_features)
+            bits.resize(nb_positions);
+        for (auto &[id, bits] : features.knight_features)
+            bits.resize(nb_pieces);
+        for (auto &[id, bits] : features.bishop_features)
+            bits.resize(nb_pieces);
+        for (auto &[id, bits] : features.queen_features)
+            bits.resize(nb_pieces);
+    }
+
+    void BitsetManager::begin_first_pass(u64 nb_rows) {
         nb_positions = 0;
-        current_piece_index = 0;
         nb_pieces = 0;
+        piece_offsets.assign(nb_rows + 1, 0);
+        position_keys.assign(nb_rows, 0);
+        orientation.assign(nb_rows, 0);
+        canonical.clear();
+        key_slots.clear();
+        pieces.clear();
+        relations = RelationStorage();
     }
 
     void BitsetManager::push_position_first_pass(const Position &p, u64 position_id) {
-        Color opponent = ~p.side_to_move();
+        // Only grows when nb_rows was not given, i.e. on a serial pass
+        if (position_id + 1 >= piece_offsets.size())
+        {
+            piece_offsets.resize(position_id + 2, 0);
+            position_keys.resize(position_id + 1, 0);
+            orientation.resize(position_id + 1, 0);
+        }
+
+        piece_offsets[position_id + 1] = popcount(p.pieces());
+        position_keys[position_id] = p.key();
+        orientation[position_id] = p.flipped();
+    }
+
+    size_t BitsetManager::find_slot(Key key) const
+    {
+        const size_t mask = key_slots.size() - 1;
+
+        size_t i = key & mask;
+        while (key_slots[i] != NO_ROW && position_keys[key_slots[i]] != key)
+            i = (i + 1) & mask;
+
+        return i;
+    }
 
-        nb_pieces += popcount(p.pieces());
-        nb_positions++;
+    u64 BitsetManager::find_position(const Position &p) const
+    {
+        return key_slots.empty() ? NO_ROW : key_slots[find_slot(p.key())];
     }
+
+    void BitsetManager::dedup_positions(u64 first_position)
+    {
+        const u64 nb_rows = piece_offsets.size() - 1;
+
+        position_keys.resize(nb_rows, 0);
+        canonical.resize(nb_rows);
+
+        if (!dedup)
+        {
+            for (u64 id = first_position; id < nb_rows; id++)
+                canonical[id] = id;
+            return;
+        }
+
+        if (key_slots.size() < 2 * nb_rows)
+        {
+            key_slots.assign(std::bit_ceil(std::max<u64>(2 * nb_rows, 16)), NO_ROW);
+
+            // Rows before first_position already have offsets, not counts
+            for (u64 id = 0; id < first_position; id++)
+            {
+                if (canonical[id] == id && piece_offsets[id + 1] != piece_offsets[id])
+                    key_slots[find_slot(position_keys[id])] = id;
+            }
+        }
+
+        for (u64 id = first_position; id < nb_rows; id++)
+        {
+            canonical[id] = id;
+
+            // Rows without pieces were skipped or never were a position
+            if (piece_offsets[id + 1] == 0)
+                continue;
+
+            u64 &slot = key_slots[find_slot(position_keys[id])];
+            if (slot == NO_ROW)
+            {
+                slot = id;
+            }
+            else
+            {
+                canonical[id] = slot;
+                piece_offsets[id + 1] = 0;
+            }
+        }
+    }
+
+    void BitsetManager::assign_piece_ids(u64 first_position) {
+        // Prefix sum of the counts from first_position on
+        for (u64 i = first_position; i + 1 < piece_offsets.size(); i++)
+            piece_offsets[i + 1] += piece_offsets[i];
+
+        nb_positions = piece_offsets.size() - 1;
+        nb_pieces = piece_offsets.back();
+        pieces.resize(nb_pieces);
+    }
+
     void BitsetManager::end_first_pass() {
+        dedup_positions(0);
+        assign_piece_ids(0);
         allocate_features();
     }
-    void BitsetManager::process_position_second_pass(const Position &p, u64 position_id) {
+
+    void BitsetManager::begin_append_pass(u64 nb_rows) {
+        // Existing positions keep their offsets, new ones are counted after
+        assert(!features.position_features.empty());
+        if (nb_rows > nb_positions)
+        {
+            piece_offsets.resize(nb_rows + 1, 0);
+            position_keys.resize(nb_rows, 0);
+            orientation.resize(nb_rows, 0);
+        }
+    }
+
+    void BitsetManager::end_append_pass() {
+        // Counts before the previous end are already offsets
+        dedup_positions(nb_positions);
+        assign_piece_ids(nb_positions);
+        grow_features();
+    }
+
+    void BitsetManager::begin_second_pass(size_t nb_shards) {
+        shard_relations.assign(std::max<size_t>(nb_shards, 1), RelationStorage());
+    }
+
+    void BitsetManager::end_second_pass() {
+        for (const auto &shard : shard_relations)
+            relations.append(shard);
+        shard_relations.clear();
+    }
+
+    void BitsetManager::process_position_second_pass(const Position &p, u64 position_id, size_t shard) {
+        assert(position_id < nb_positions);
+        assert(shard < shard_relations.size());
+
+        if (!is_canonical(position_id))
+            return;
 
         process_position_features(p, position_id);
 
+        const AttackInfo ai(p);
 
         std::array<i64, 64> square_to_piece;
         square_to_piece.fill(-1LL);
 
         Bitboard occ = p.pieces();
 
+        u64 piece_id = piece_offsets[position_id];
 
         while (occ) {
             Square sq = pop_lsb(occ);
@@ -197,15 +470,15 @@ namespace Chess
             PieceType pt = typeof_piece(piece);
             Color c = color_of(piece);
 
-            u64 piece_id = pieces.size();
-            pieces.push_back({
+            assert(piece_id < piece_offsets[position_id + 1]);
+            pieces[piece_id] = {
                 position_id,
                 sq,
                 c,
                 pt
-            });
+            };
 
-            square_to_piece[sq] = piece_id;
+            square_to_piece[sq] = piece_id++;
         }
 
 
@@ -219,19 +492,21 @@ namespace Chess
             const auto& inst = pieces[pid];
 
             if (inst.type == Knight) {
-                process_knight_features(p, position_id, sq, inst.color, pid);
+                process_knight_features(p, ai, position_id, sq, inst.color, pid);
             } else if (inst.type == Bishop) {
-                process_bishop_features(p, position_id, sq, inst.color, pid);
+                process_bishop_features(p, ai, position_id, sq, inst.color, pid);
             } else if (inst.type == Queen) {
-                process_queen_features(p, position_id, sq, inst.color, pid);
+                process_queen_features(p, ai, position_id, sq, inst.color, pid);
             }
         }
 
-        populate_relations_for_position(p, square_to_piece);
+        populate_relations_for_position(p, ai, square_to_piece, shard_relations[shard]);
     }
 
     void BitsetManager::populate_relations_for_position(const Position &p,
-                                                        std::array<i64, 64> &square_to_piece)
+                                                        const AttackInfo &ai,
+                                                        std::array<i64, 64> &square_to_piece,
+                                                        RelationStorage &out)
     {
 
 
@@ -246,7 +521,7 @@ namespace Chess
             assert(queen_id != -1);
             assert(pieces[queen_id].type == Queen);
 
-            Bitboard queen_attacks = attacks_bb(Queen, q_sq, p.pieces()) & queens2;
+            Bitboard queen_attacks = ai.attacks_from[q_sq] & queens2;
 
             while (queen_attacks) {
                 Square q_sq2 = pop_lsb(queen_attacks);
@@ -255,7 +530,7 @@ namespace Chess
                 assert(pieces[queen_id2].type == Queen);
                 assert(queen_id2 < nb_pieces);
 
-                relations.queen_attacks_queen.add(queen_id, queen_id2);
+                out.queen_attacks_queen.add(queen_id, queen_id2);
             }
 
         }
@@ -273,7 +548,7 @@ namespace Chess
             assert(pieces[bishop_id].type == Bishop);
 
 
-            Bitboard attackers = attackers_to(p, b_sq, c);
+            Bitboard attackers = ai.attackers_to(b_sq, c);
 
             Bitboard knight_attackers =
                 attackers & p.pieces(Knight) & p.pieces(c);
@@ -286,7 +561,46 @@ namespace Chess
                 assert(knight_id < nb_pieces);
                 assert(bishop_id < nb_pieces);
 
-                relations.knight_defends_bishop.add(knight_id, bishop_id);
+                out.knight_defends_bishop.add(knight_id, bishop_id);
+            }
+        }
+
+
+        // Pieces one blocker behind each slider: remove the first blockers
+        // and look again, what comes into view is the x-rayed piece
+        const Bitboard occupied = p.pieces();
+        Bitboard sliders = p.pieces(Bishop) | p.pieces(Rook) | p.pieces(Queen);
+
+        while (sliders) {
+            Square s_sq = pop_lsb(sliders);
+            Color c = p.color_on(s_sq);
+            PieceType pt = typeof_piece(p.piece_on(s_sq));
+
+            const Bitboard blockers = ai.attacks_from[s_sq] & occupied;
+            Bitboard targets = attacks_bb(pt, s_sq, occupied ^ blockers) & ~ai.attacks_from[s_sq] & p.pieces(~c);
+
+            i64 slider_id = square_to_piece[s_sq];
+            assert(slider_id != -1);
+
+            while (targets) {
+                Square t_sq = pop_lsb(targets);
+                Square b_sq = lsb(between_bb(s_sq, t_sq) & blockers);
+
+                u64 target_id = square_to_piece[t_sq];
+                u64 blocker_id = square_to_piece[b_sq];
+                assert(target_id < nb_pieces && blocker_id < nb_pieces);
+
+                out.xrays_through.add(slider_id, target_id);
+
+                if (p.color_on(b_sq) == c) {
+                    out.discovered_attack_on.add(blocker_id, target_id);
+                    continue;
+                }
+
+                // A king in front is in check, not pinned
+                PieceType target = typeof_piece(p.piece_on(t_sq));
+                if (typeof_piece(p.piece_on(b_sq)) != King && (target == King || (target == Queen && pt != Queen)))
+                    out.pinned_to.add(blocker_id, target_id);
             }
         }
     }
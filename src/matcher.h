@@ -2,11 +2,15 @@
 
 #include <unordered_map>
 #include <functional>
+#include <initializer_list>
+#include <string_view>
+#include <vector>
 
 #include "types.h"
 #include "position.h"
 #include "bitset.h"
 #include "bitboard_extra.h"
+#include "attack_info.h"
 #include "relation.h"
 
 namespace Chess {
@@ -33,14 +37,23 @@ namespace Chess {
         KNIGHT_ONLY_DEFENDED_BY_BISHOP,
         KNIGHT_ATTACKED_BY_PAWN,
         KNIGHT_ON_OUTPOST,
+        KNIGHT_HANGING,
+        KNIGHT_ADEQUATELY_DEFENDED,
+        KNIGHT_ONLY_LOSING_CAPTURES,
 
         // ---------- Bishop-instance ----------
         BISHOP_ONLY_DEFENDED_BY_KNIGHT,
         BISHOP_ATTACKS_QUEEN,
         BISHOP_PINNED_TO_KING,
+        BISHOP_HANGING,
+        BISHOP_ADEQUATELY_DEFENDED,
+        BISHOP_ONLY_LOSING_CAPTURES,
 
         // ---- Queen ----
         QUEEN_ONLY_DEFENDED_BY_ROOK,
+        QUEEN_HANGING,
+        QUEEN_ADEQUATELY_DEFENDED,
+        QUEEN_ONLY_LOSING_CAPTURES,
 
 
         FEATURE_COUNT
@@ -78,6 +91,15 @@ namespace Chess {
         {FeatureID::KNIGHT_ATTACKED_BY_PAWN,
          FeatureDomain::KnightInstance,
          "knight_attacked_by_pawn"},
+        {FeatureID::KNIGHT_HANGING,
+         FeatureDomain::KnightInstance,
+         "knight_hanging"},
+        {FeatureID::KNIGHT_ADEQUATELY_DEFENDED,
+         FeatureDomain::KnightInstance,
+         "knight_adequately_defended"},
+        {FeatureID::KNIGHT_ONLY_LOSING_CAPTURES,
+         FeatureDomain::KnightInstance,
+         "knight_only_losing_captures"},
 
         {FeatureID::BISHOP_ONLY_DEFENDED_BY_KNIGHT,
          FeatureDomain::BishopInstance,
@@ -85,14 +107,60 @@ namespace Chess {
         {FeatureID::BISHOP_ATTACKS_QUEEN,
          FeatureDomain::BishopInstance,
          "bishop_attacks_queen"},
+        {FeatureID::BISHOP_HANGING,
+         FeatureDomain::BishopInstance,
+         "bishop_hanging"},
+        {FeatureID::BISHOP_ADEQUATELY_DEFENDED,
+         FeatureDomain::BishopInstance,
+         "bishop_adequately_defended"},
+        {FeatureID::BISHOP_ONLY_LOSING_CAPTURES,
+         FeatureDomain::BishopInstance,
+         "bishop_only_losing_captures"},
 
         {FeatureID::QUEEN_ONLY_DEFENDED_BY_ROOK,
          FeatureDomain::QueenInstance,
-         "bishop_only_defended_by_knight"},
+         "queen_only_defended_by_rook"},
+        {FeatureID::QUEEN_HANGING,
+         FeatureDomain::QueenInstance,
+         "queen_hanging"},
+        {FeatureID::QUEEN_ADEQUATELY_DEFENDED,
+         FeatureDomain::QueenInstance,
+         "queen_adequately_defended"},
+        {FeatureID::QUEEN_ONLY_LOSING_CAPTURES,
+         FeatureDomain::QueenInstance,
+         "queen_only_losing_captures"},
+
+
+    };
 
+    // Registry entry by id or by name, nullptr if there is none
+    const FeatureInfo *find_feature(FeatureID id);
+    const FeatureInfo *find_feature(std::string_view name);
 
+    constexpr FeatureDomain feature_domain(FeatureID id)
+    {
+        for (const auto &info : FEATURE_REGISTRY)
+            if (info.id == id)
+                return info.domain;
+        return FeatureDomain::Position;
+    }
+
+    // What full_query looks for: a piece with feature that is the left end
+    // of a relation edge. The query and its FEN prefilter are both built
+    // from it, so they cannot drift apart.
+    struct PieceRelationQuery
+    {
+        FeatureID feature;
+        RelationID relation;
     };
 
+    // A queen only defended by a rook, attacking another queen
+    constexpr PieceRelationQuery FULL_QUERY = {FeatureID::QUEEN_ONLY_DEFENDED_BY_ROOK, RelationID::Queen_Attacks_Queen};
+
+    static_assert(is_registered(FULL_QUERY.relation), "full_query relation is not registered");
+    static_assert(domain_holds(find_relation(FULL_QUERY.relation)->left, feature_domain(FULL_QUERY.feature)),
+                  "full_query feature must hold on the relation's left piece");
+
     struct FeatureStorage
     {
         // Position-level
@@ -107,7 +175,9 @@ namespace Chess {
     };
 
     using PositionFeatureFn = bool (*)(const Position&);
-    using PieceFeatureFn = bool (*)(const Position&, const PieceInstance&);
+    // Piece features read attack sets from the position's AttackInfo instead
+    // of recomputing them per piece and per feature
+    using PieceFeatureFn = bool (*)(const Position&, const AttackInfo&, const PieceInstance&);
 
     struct FeatureExtractor
     {
@@ -116,9 +186,9 @@ namespace Chess {
         void *fn;
     };
 
-    constexpr PieceFeatureFn bishop_attacks_queen = [](const Position &p, const PieceInstance &k)
+    constexpr PieceFeatureFn bishop_attacks_queen = [](const Position &p, const AttackInfo &ai, const PieceInstance &k)
     {
-        Bitboard attacks = bishop_attacks(k.square, p.pieces());
+        Bitboard attacks = ai.attacks_from[k.square];
 
         Bitboard qq = p.pieces(Queen) & p.pieces(~k.color);
 
@@ -131,8 +201,8 @@ namespace Chess {
         return false;
     };
 
-    constexpr PieceFeatureFn bishop_only_defended_by_knight = [](const Position &p, const PieceInstance &k) {
-        Bitboard defenders = attackers_to(p, k.square, k.color);
+    constexpr PieceFeatureFn bishop_only_defended_by_knight = [](const Position &p, const AttackInfo &ai, const PieceInstance &k) {
+        Bitboard defenders = ai.attackers_to(k.square, k.color);
 
         if (!defenders) {
             return false;
@@ -147,8 +217,8 @@ namespace Chess {
         return false;
     };
 
-    constexpr PieceFeatureFn queen_only_defended_by_rook = [](const Position &p, const PieceInstance &k) {
-        Bitboard defenders = attackers_to(p, k.square, k.color);
+    constexpr PieceFeatureFn queen_only_defended_by_rook = [](const Position &p, const AttackInfo &ai, const PieceInstance &k) {
+        Bitboard defenders = ai.attackers_to(k.square, k.color);
 
         if (!defenders) {
             return false;
@@ -165,14 +235,18 @@ namespace Chess {
 
 
 
-    constexpr PieceFeatureFn knight_occupies = [](const Position &p, const PieceInstance &k) {
+    constexpr PieceFeatureFn knight_occupies = [](const Position &, const AttackInfo &, const PieceInstance &) {
         return true;
     };
 
 
 
-    constexpr PieceFeatureFn knight_only_defended_by_bishop = [](const Position &p, const PieceInstance &k) {
-        Bitboard defenders = attackers_to(p, k.square, k.color);
+    constexpr PieceFeatureFn knight_only_defended_by_bishop = [](const Position &p, const AttackInfo &ai, const PieceInstance &k) {
+        Bitboard defenders = ai.attackers_to(k.square, k.color);
+
+        if (!defenders) {
+            return false;
+        }
 
         Square only = pop_lsb(defenders);
 
@@ -183,17 +257,17 @@ namespace Chess {
         return false;
     };
 
-    constexpr PieceFeatureFn knight_attacked_by_pawn = [](const Position &p, const PieceInstance &k) {
+    constexpr PieceFeatureFn knight_attacked_by_pawn = [](const Position &, const AttackInfo &, const PieceInstance &) {
         return false;
     };
 
-    constexpr PieceFeatureFn knight_takes_knight_with_check = [](const Position &p, const PieceInstance &k) {
-        Bitboard takes_knight = attacks_bb(Knight, k.square, p.pieces()) & p.pieces(Knight) & p.pieces(~k.color);
+    constexpr PieceFeatureFn knight_takes_knight_with_check = [](const Position &p, const AttackInfo &ai, const PieceInstance &k) {
+        Bitboard takes_knight = ai.attacks_from[k.square] & p.pieces(Knight) & p.pieces(~k.color);
 
         while (takes_knight) {
             Square sq = pop_lsb(takes_knight);
 
-            Bitboard with_check = attacks_bb(Knight, sq, p.pieces()) & p.pieces(~k.color) & p.pieces(King);
+            Bitboard with_check = ai.attacks_from[sq] & p.pieces(~k.color) & p.pieces(King);
 
             return with_check != 0;
         }
@@ -201,8 +275,8 @@ namespace Chess {
         return false;
     };
 
-    constexpr PieceFeatureFn knight_can_be_captured_with_check = [](const Position &p, const PieceInstance &k) {
-        Bitboard takes_knight = attackers_to(p, k.square, ~k.color);
+    constexpr PieceFeatureFn knight_can_be_captured_with_check = [](const Position &p, const AttackInfo &ai, const PieceInstance &k) {
+        Bitboard takes_knight = ai.attackers_to(k.square, ~k.color);
 
         while (takes_knight) {
             Square sq = pop_lsb(takes_knight);
@@ -218,7 +292,53 @@ namespace Chess {
 
 
 
-    constexpr FeatureExtractor EXTRACTORS[] = {
+    // How the other side fares taking the piece, each capture judged by
+    // static exchange on the piece's square
+    struct CaptureOutcome
+    {
+        bool attacked = false;
+        bool defended = false;
+
+        // Some capture comes out ahead
+        bool winning = false;
+
+        // Every capture comes out behind
+        bool all_losing = true;
+    };
+
+    inline CaptureOutcome capture_outcome(const Position &p, const AttackInfo &ai, const PieceInstance &k)
+    {
+        CaptureOutcome out;
+        Bitboard takers = ai.attackers_to(k.square, ~k.color);
+
+        out.attacked = takers != 0;
+        out.defended = ai.attackers_to(k.square, k.color) != 0;
+
+        while (takers && !out.winning) {
+            Move capture(pop_lsb(takers), k.square);
+
+            out.winning = p.see_ge(capture, 1);
+            out.all_losing &= !p.see_ge(capture, 0);
+        }
+
+        out.all_losing &= out.attacked;
+        return out;
+    }
+
+    constexpr PieceFeatureFn piece_hanging = [](const Position &p, const AttackInfo &ai, const PieceInstance &k) {
+        return capture_outcome(p, ai, k).winning;
+    };
+
+    constexpr PieceFeatureFn piece_adequately_defended = [](const Position &p, const AttackInfo &ai, const PieceInstance &k) {
+        CaptureOutcome out = capture_outcome(p, ai, k);
+        return out.attacked && out.defended && !out.winning;
+    };
+
+    constexpr PieceFeatureFn piece_only_losing_captures = [](const Position &p, const AttackInfo &ai, const PieceInstance &k) {
+        return capture_outcome(p, ai, k).all_losing;
+    };
+
+    inline const FeatureExtractor EXTRACTORS[] = {
         {FeatureID::SIDE_TO_MOVE_WHITE,
          FeatureDomain::Position,
          (void *)+[](const Position &p)
@@ -241,42 +361,213 @@ namespace Chess {
         {FeatureID::KNIGHT_ATTACKED_BY_PAWN,
          FeatureDomain::KnightInstance,
          (void *)knight_attacked_by_pawn},
+        {FeatureID::KNIGHT_HANGING,
+         FeatureDomain::KnightInstance,
+         (void *)piece_hanging},
+        {FeatureID::KNIGHT_ADEQUATELY_DEFENDED,
+         FeatureDomain::KnightInstance,
+         (void *)piece_adequately_defended},
+        {FeatureID::KNIGHT_ONLY_LOSING_CAPTURES,
+         FeatureDomain::KnightInstance,
+         (void *)piece_only_losing_captures},
         {FeatureID::BISHOP_ONLY_DEFENDED_BY_KNIGHT,
          FeatureDomain::BishopInstance,
          (void *)bishop_only_defended_by_knight},
         {FeatureID::BISHOP_ATTACKS_QUEEN,
          FeatureDomain::BishopInstance,
          (void *)bishop_attacks_queen},
+        {FeatureID::BISHOP_HANGING,
+         FeatureDomain::BishopInstance,
+         (void *)piece_hanging},
+        {FeatureID::BISHOP_ADEQUATELY_DEFENDED,
+         FeatureDomain::BishopInstance,
+         (void *)piece_adequately_defended},
+        {FeatureID::BISHOP_ONLY_LOSING_CAPTURES,
+         FeatureDomain::BishopInstance,
+         (void *)piece_only_losing_captures},
         {FeatureID::QUEEN_ONLY_DEFENDED_BY_ROOK,
          FeatureDomain::QueenInstance,
          (void *)queen_only_defended_by_rook},
+        {FeatureID::QUEEN_HANGING,
+         FeatureDomain::QueenInstance,
+         (void *)piece_hanging},
+        {FeatureID::QUEEN_ADEQUATELY_DEFENDED,
+         FeatureDomain::QueenInstance,
+         (void *)piece_adequately_defended},
+        {FeatureID::QUEEN_ONLY_LOSING_CAPTURES,
+         FeatureDomain::QueenInstance,
+         (void *)piece_only_losing_captures},
     };
 
+    constexpr PieceType domain_piece_type(FeatureDomain domain)
+    {
+        switch (domain)
+        {
+        case FeatureDomain::KnightInstance:
+            return Knight;
+        case FeatureDomain::BishopInstance:
+            return Bishop;
+        case FeatureDomain::RookInstance:
+            return Rook;
+        case FeatureDomain::QueenInstance:
+            return Queen;
+        default:
+            return No_Piece_Type;
+        }
+    }
+
+    // Necessary condition on piece counts, checked on the FEN text before the
+    // position is parsed. Rows it rejects cannot match the query it was made
+    // for, so both build passes may skip them (they get no pieces).
+    struct FenPrefilter
+    {
+        // At least min_count pieces of type, either colour
+        struct Clause
+        {
+            PieceType type;
+            u8 min_count;
+        };
+
+        std::vector<Clause> clauses;
+
+        bool accepts(std::string_view FEN) const;
+    };
+
+    // Prefilter for a query binding one distinct piece per listed domain.
+    // The FEN is the position before the first move, which can only remove
+    // pieces except for a promotion, so one pawn may stand in for one missing
+    // knight, bishop, rook or queen.
+    FenPrefilter prefilter_for_domains(std::initializer_list<FeatureDomain> domains);
+
     class BitsetManager {
 
         public:
-            void begin_first_pass();
+            // Both passes may be fed from several threads. The first pass only
+            // records each position's piece count; end_first_pass turns those
+            // into fixed piece id ranges, so the second pass can fill any
+            // position in any order and still produce the ids of a serial run.
+            // nb_rows pre-sizes the counts, which is required when
+            // push_position_first_pass is called concurrently.
+            void begin_first_pass(u64 nb_rows = 0);
             void push_position_first_pass(const Position &p, u64 position_id);
             void end_first_pass();
-            void process_position_second_pass(const Position &p, u64 position_id);
+
+            // Relation edges go to one buffer per shard, concatenated in
+            // shard order by end_second_pass. Calls for the same shard must
+            // not overlap.
+            void begin_second_pass(size_t nb_shards = 1);
+            void process_position_second_pass(const Position &p, u64 position_id, size_t shard = 0);
+            void end_second_pass();
+
+            // Append mode: rows added after a full build go through the same
+            // push_position_first_pass calls framed by these instead of
+            // begin/end_first_pass, then through a regular second pass.
+            // Existing bitsets, pieces and relation edges are kept and only
+            // grown.
+            void begin_append_pass(u64 nb_rows = 0);
+            void end_append_pass();
 
             void full_query(std::function<void(u64)> materialize);
 
+            // Derived from the domains of FULL_QUERY's relation
+            static FenPrefilter full_query_prefilter();
+
+            static constexpr u64 NO_ROW = ~u64(0);
+
+            // Rows holding the same position (by Zobrist key) as an earlier
+            // row are folded into that first, canonical row at the end of the
+            // first pass: they get no pieces, need no second pass and match
+            // whenever their canonical row does.
+            bool is_canonical(u64 position_id) const { return canonical[position_id] == position_id; }
+            u64 canonical_row(u64 position_id) const { return canonical[position_id]; }
+
+            // Canonical row holding p (after its first move), NO_ROW if none
+            u64 find_position(const Position &p) const;
+
+            // Off, every row keeps its own pieces even when it repeats an
+            // earlier position. Piece ids can then be derived from the row
+            // and square alone (see piece_id). Set before end_first_pass.
+            void set_dedup(bool enabled) { dedup = enabled; }
+
+            u64 row_count() const { return nb_positions; }
+            u64 piece_count() const { return nb_pieces; }
+
+            // Pieces of a canonical row are numbered in ascending square
+            // order from first_piece(row)
+            u64 first_piece(u64 row) const { return piece_offsets[row]; }
+            u64 piece_id(u64 row, Bitboard occupied, Square s) const
+            {
+                return piece_offsets[row] + popcount(occupied & (square_bb(s) - 1));
+            }
+
+            // Instance feature bitset over all pieces of the manager
+            const Bitset &piece_features(FeatureID id) const;
+
+            // Rows, duplicates included, where the position has the feature
+            // or holds a piece that has it
+            Bitset rows_with(FeatureID id) const;
+
+            // Rows, duplicates included, holding one of pieces
+            Bitset rows_of(const Bitset &pieces) const;
+
+            // Rows, duplicates included, where a piece with the query's
+            // feature is the left end of an edge of its relation, e.g.
+            // {KNIGHT_HANGING, Pinned_To} for a loose knight pinned to its
+            // king or queen. Any registered relation whose left end the
+            // feature holds on can be joined.
+            template <PieceRelationQuery query>
+            Bitset rows_where() const
+            {
+                static_assert(is_registered(query.relation), "relation is not registered");
+                static_assert(domain_holds(find_relation(query.relation)->left, feature_domain(query.feature)),
+                              "feature must hold on the relation's left piece");
+
+                return rows_of(project_left(relations.get<query.relation>(), piece_features(query.feature), nb_pieces));
+            }
+
+            // Whether the row's position was flipped at ingest (see
+            // Position::flip), which features and dedup do not see. Kept per
+            // row so mirrored duplicates can still share a canonical row.
+            bool flipped(u64 row) const { return orientation[row]; }
+            Bitset flipped_rows() const;
+
+            // Relation edges between the pieces of the manager
+            const RelationStorage &relation_storage() const { return relations; }
+
             private:
 
-                void populate_relations_for_position(const Position &p, std::array<int64_t, 64> &square_to_piece);
+                void populate_relations_for_position(const Position &p, const AttackInfo &ai, std::array<int64_t, 64> &square_to_piece, RelationStorage &out);
 
                 void process_position_features(const Position &p, uint64_t position_id);
-                void process_knight_features(const Position &p, u64 position_id, Square sq, Color c, size_t knight_index);
-                void process_bishop_features(const Position &p, u64 position_id, Square sq, Color c, size_t bishop_index);
-                void process_queen_features(const Position &p, u64 position_id, Square sq, Color c, size_t queen_index);
+                void process_knight_features(const Position &p, const AttackInfo &ai, u64 position_id, Square sq, Color c, size_t knight_index);
+                void process_bishop_features(const Position &p, const AttackInfo &ai, u64 position_id, Square sq, Color c, size_t bishop_index);
+                void process_queen_features(const Position &p, const AttackInfo &ai, u64 position_id, Square sq, Color c, size_t queen_index);
                 void allocate_features();
+                void grow_features();
+                void assign_piece_ids(u64 first_position);
+                void dedup_positions(u64 first_position);
+                size_t find_slot(Key key) const;
                 FeatureStorage features;
                 RelationStorage relations;
+                std::vector<RelationStorage> shard_relations;
 
-                u64 nb_positions;
-                u64 nb_pieces;
-                u64 current_piece_index;
+                u64 nb_positions = 0;
+                u64 nb_pieces = 0;
+                bool dedup = true;
+
+                // piece_offsets[i] is the first piece id of position i. During
+                // the first pass piece_offsets[i + 1] holds its piece count.
+                std::vector<u64> piece_offsets;
                 std::vector<PieceInstance> pieces;
+
+                // Open addressing table of canonical rows by position key,
+                // NO_ROW in empty slots, kept at most half full
+                std::vector<Key> position_keys;
+                std::vector<u64> canonical;
+
+                // One byte per row so concurrent first pass pushes do not
+                // share a word
+                std::vector<u8> orientation;
+                std::vector<u64> key_slots;
             };
 }
\ No newline at end of file
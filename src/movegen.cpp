@@ -0,0 +1,225 @@
+#include "movegen.h"
+
+namespace Chess
+{
+
+    namespace {
+
+        // Pieces of color c attacking sq, with sliders seeing through
+        // everything not in occupied
+        Bitboard color_attackers_to(const Position &p, Square sq, Color c, Bitboard occupied)
+        {
+            return (pawn_attacks_bb(~c, sq) & p.pieces(c, Pawn))
+                 | (attacks_bb<Knight>(sq) & p.pieces(c, Knight))
+                 | (attacks_bb<Bishop>(sq, occupied) & (p.pieces(c, Bishop) | p.pieces(c, Queen)))
+                 | (attacks_bb<Rook>(sq, occupied) & (p.pieces(c, Rook) | p.pieces(c, Queen)))
+                 | (attacks_bb<King>(sq) & p.pieces(c, King));
+        }
+
+        template <Direction D>
+        Move *push_pawn_moves(Bitboard to_bb, Bitboard pinned, Square king, Move *list)
+        {
+            while (to_bb)
+            {
+                Square to = pop_lsb(to_bb);
+                Square from = to - D;
+
+                if (!(pinned & from) || (line_bb(king, from) & to))
+                    *list++ = Move(from, to);
+            }
+            return list;
+        }
+
+        template <Direction D>
+        Move *push_promotions(Bitboard to_bb, Bitboard pinned, Square king, Move *list)
+        {
+            while (to_bb)
+            {
+                Square to = pop_lsb(to_bb);
+                Square from = to - D;
+
+                if (!(pinned & from) || (line_bb(king, from) & to))
+                    for (PieceType pt : {Queen, Rook, Bishop, Knight})
+                        *list++ = Move::make<PROMOTION>(from, to, pt);
+            }
+            return list;
+        }
+
+        template <Color Us>
+        Move *generate_pawn_moves(const Position &p, const CheckInfo &ci, Move *list)
+        {
+            constexpr Direction Up_ = pawn_push(Us);
+            constexpr Direction UpLeft_ = Us == White ? UpLeft : DownRight;
+            constexpr Direction UpRight_ = Us == White ? UpRight : DownLeft;
+            constexpr Bitboard Rank3 = Us == White ? Bb_Rank_3 : Bb_Rank_6;
+            constexpr Bitboard Rank7 = Us == White ? Bb_Rank_7 : Bb_Rank_2;
+
+            const Bitboard pawns = p.pieces(Us, Pawn) & ~Rank7;
+            const Bitboard promoting = p.pieces(Us, Pawn) & Rank7;
+            const Bitboard empty = ~p.pieces();
+            const Bitboard enemies = p.pieces(~Us);
+
+            const Bitboard single = shift<Up_>(pawns) & empty;
+            const Bitboard twice = shift<Up_>(single & Rank3) & empty;
+
+            list = push_pawn_moves<Up_>(single & ci.target, ci.pinned, ci.king, list);
+            list = push_pawn_moves<Direction(Up_ + Up_)>(twice & ci.target, ci.pinned, ci.king, list);
+            list = push_pawn_moves<UpLeft_>(shift<UpLeft_>(pawns) & enemies & ci.target, ci.pinned, ci.king, list);
+            list = push_pawn_moves<UpRight_>(shift<UpRight_>(pawns) & enemies & ci.target, ci.pinned, ci.king, list);
+
+            if (promoting)
+            {
+                list = push_promotions<Up_>(shift<Up_>(promoting) & empty & ci.target, ci.pinned, ci.king, list);
+                list = push_promotions<UpLeft_>(shift<UpLeft_>(promoting) & enemies & ci.target, ci.pinned, ci.king, list);
+                list = push_promotions<UpRight_>(shift<UpRight_>(promoting) & enemies & ci.target, ci.pinned, ci.king, list);
+            }
+
+            // The capture takes two pieces off the board at once, so pins and
+            // checks are settled by looking at the king once both are gone
+            if (p.ep_square() != Sq_None)
+            {
+                const Square to = p.ep_square();
+                const Square captured = to - Up_;
+                Bitboard takers = pawn_attacks_bb(~Us, to) & pawns;
+
+                while (takers)
+                {
+                    const Square from = pop_lsb(takers);
+                    const Bitboard occupied = (p.pieces() ^ from ^ captured) | to;
+
+                    if (!(color_attackers_to(p, ci.king, ~Us, occupied) & ~square_bb(captured)))
+                        *list++ = Move::make<EN_PASSANT>(from, to);
+                }
+            }
+
+            return list;
+        }
+
+        Move *generate_castling(const Position &p, const CheckInfo &ci, Move *list)
+        {
+            const Color us = p.side_to_move();
+            const Rank rank = us == White ? Rank_1 : Rank_8;
+
+            for (bool king_side : {true, false})
+            {
+                const CastlingRights cr = CastlingRights(us == White ? (king_side ? White_OO : White_OOO)
+                                                                     : (king_side ? Black_OO : Black_OOO));
+                if (!p.can_castle(cr))
+                    continue;
+
+                const Square rook = make_square(king_side ? File_H : File_A, rank);
+                const Square to = make_square(king_side ? File_G : File_C, rank);
+
+                if (p.piece_on(rook) != make_piece(us, Rook) || (between_bb(ci.king, rook) ^ rook) & p.pieces())
+                    continue;
+
+                // Squares the king crosses, its destination included
+                Bitboard path = between_bb(ci.king, to);
+                bool attacked = false;
+                while (path && !attacked)
+                    attacked = color_attackers_to(p, pop_lsb(path), ~us, p.pieces());
+
+                if (!attacked)
+                    *list++ = Move::make<CASTLING>(ci.king, to);
+            }
+
+            return list;
+        }
+    }
+
+    CheckInfo::CheckInfo(const Position &p)
+    {
+        const Color us = p.side_to_move();
+        const Color them = ~us;
+
+        king = p.king_square(us);
+        checkers = color_attackers_to(p, king, them, p.pieces());
+
+        // Enemy sliders lined up with our king, pinning a lone piece of ours
+        // in between
+        Bitboard snipers = ((attacks_bb<Rook>(king) & (p.pieces(Rook) | p.pieces(Queen)))
+                          | (attacks_bb<Bishop>(king) & (p.pieces(Bishop) | p.pieces(Queen)))) & p.pieces(them);
+        const Bitboard occupancy = p.pieces() ^ snipers;
+
+        pinned = 0;
+        while (snipers)
+        {
+            Square sniper = pop_lsb(snipers);
+            Bitboard blockers = between_bb(king, sniper) & occupancy;
+
+            if (blockers && !more_than_one(blockers))
+                pinned |= blockers & p.pieces(us);
+        }
+
+        if (!checkers)
+            target = ~p.pieces(us);
+        else if (!more_than_one(checkers))
+            target = between_bb(king, lsb(checkers));
+        else
+            target = 0;
+    }
+
+    Move *generate_legal(const Position &p, Move *list)
+    {
+        const Color us = p.side_to_move();
+        const CheckInfo ci(p);
+        const Bitboard occupied = p.pieces();
+
+        // The king must not stay on a line it is checked along, so sliders
+        // look through its current square
+        Bitboard king_moves = attacks_bb<King>(ci.king) & ~p.pieces(us);
+        while (king_moves)
+        {
+            Square to = pop_lsb(king_moves);
+            if (!color_attackers_to(p, to, ~us, occupied ^ ci.king))
+                *list++ = Move(ci.king, to);
+        }
+
+        // Double check, only the king can move
+        if (more_than_one(ci.checkers))
+            return list;
+
+        if (!ci.checkers && p.can_castle(us == White ? White_Castling : Black_Castling))
+            list = generate_castling(p, ci, list);
+
+        list = us == White ? generate_pawn_moves<White>(p, ci, list)
+                           : generate_pawn_moves<Black>(p, ci, list);
+
+        for (PieceType pt : {Knight, Bishop, Rook, Queen})
+        {
+            Bitboard pieces = p.pieces(us, pt);
+            while (pieces)
+            {
+                Square from = pop_lsb(pieces);
+                Bitboard to_bb = attacks_bb(pt, from, occupied) & ci.target;
+
+                if (ci.pinned & from)
+                    to_bb &= line_bb(ci.king, from);
+
+                while (to_bb)
+                    *list++ = Move(from, pop_lsb(to_bb));
+            }
+        }
+
+        return list;
+    }
+
+    u64 perft(Position &p, int depth)
+    {
+        MoveList moves(p);
+
+        // Leaves are counted, not visited
+        if (depth <= 1)
+            return depth == 1 ? moves.size() : 1;
+
+        StateInfo st;
+        u64 nodes = 0;
+        for (Move m : moves)
+        {
+            p.do_move(m, st);
+            nodes += perft(p, depth - 1);
+            p.undo_move(m);
+        }
+        return nodes;
+    }
+}
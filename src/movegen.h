@@ -0,0 +1,56 @@
+#pragma once
+
+#include "types.h"
+#include "moves.h"
+#include "position.h"
+
+namespace Chess {
+
+    constexpr int MAX_MOVES = 256;
+
+    // Check and pin state of the side to move, shared by the generator and
+    // the legality aware features
+    struct CheckInfo
+    {
+        Square king;
+
+        // Enemy pieces giving check
+        Bitboard checkers;
+
+        // Our pieces that may only move along the line to our king
+        Bitboard pinned;
+
+        // Squares a non king move must land on: anywhere but our own
+        // pieces, or the checker and the squares between it and our king
+        Bitboard target;
+
+        explicit CheckInfo(const Position &p);
+    };
+
+    // Writes the legal moves of the side to move to list, returns the end
+    Move *generate_legal(const Position &p, Move *list);
+
+    struct MoveList
+    {
+        explicit MoveList(const Position &p) : last(generate_legal(p, moves)) {}
+
+        const Move *begin() const { return moves; }
+        const Move *end() const { return last; }
+        size_t size() const { return last - moves; }
+
+        bool contains(Move m) const
+        {
+            for (const Move *it = begin(); it != end(); ++it)
+                if (it->raw() == m.raw())
+                    return true;
+            return false;
+        }
+
+    private:
+        Move moves[MAX_MOVES];
+        Move *last;
+    };
+
+    // Number of leaf nodes depth plies below p
+    u64 perft(Position &p, int depth);
+}
@@ -5,10 +5,10 @@
 namespace Chess {
 
 
-    Move Move::parse_uci(std::string &uci)
+    Move Move::parse_uci(std::string_view uci)
     {
-        assert(uci.size() == 4 || uci.size() == 5);
-
+        if (uci.size() != 4 && uci.size() != 5)
+            return Move::none();
 
         const char *ptr = uci.data();
 
@@ -17,21 +17,51 @@ namespace Chess {
         const char c_to_file = *ptr++;
         const char c_to_rank = *ptr++;
 
-        assert(c_from_rank >= '1' && c_from_rank <= '8');
-        assert(c_to_rank >= '1' && c_to_rank <= '8');
+        if (c_from_rank < '1' || c_from_rank > '8' || c_to_rank < '1' || c_to_rank > '8' ||
+            c_from_file < 'a' || c_from_file > 'h' || c_to_file < 'a' || c_to_file > 'h')
+            return Move::none();
 
         Rank from_rank = (Rank)(c_from_rank - '1');
         Rank to_rank = (Rank)(c_to_rank - '1');
 
-        assert(c_from_file >= 'a' && c_from_file <= 'h');
-        assert(c_to_file >= 'a' && c_to_file <= 'h');
-
         File from_file = (File)(c_from_file - 'a');
         File to_file = (File)(c_to_file - 'a');
 
         Square from = make_square(from_file, from_rank);
         Square to = make_square(to_file, to_rank);
 
+        if (uci.size() == 5)
+        {
+            switch (*ptr)
+            {
+            case 'n':
+                return Move::make<PROMOTION>(from, to, Knight);
+            case 'b':
+                return Move::make<PROMOTION>(from, to, Bishop);
+            case 'r':
+                return Move::make<PROMOTION>(from, to, Rook);
+            case 'q':
+                return Move::make<PROMOTION>(from, to, Queen);
+            default:
+                return Move::none();
+            }
+        }
+
         return Move(from, to);
     }
+
+    std::string Move::uci() const
+    {
+        if (!is_ok())
+            return data == 0 ? "(none)" : "0000";
+
+        std::string s = {
+            char('a' + file_of(from_sq())), char('1' + rank_of(from_sq())),
+            char('a' + file_of(to_sq())), char('1' + rank_of(to_sq()))};
+
+        if (type_of() == PROMOTION)
+            s += "  nbrq"[promotion_type()];
+
+        return s;
+    }
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include <cassert>
 #include <string>
+#include <string_view>
 
 #include "types.h"
 
@@ -9,8 +10,13 @@
 namespace Chess {
 
     
+    // Bits 0-5 destination, 6-11 origin, 12-13 promotion piece type minus
+    // Knight, 14-15 the move type. Castling is encoded as the king's move.
     enum MoveType: u16 {
-        NORMAL
+        NORMAL,
+        PROMOTION = 1 << 14,
+        EN_PASSANT = 2 << 14,
+        CASTLING = 3 << 14
     };
 
     class Move
@@ -22,6 +28,12 @@ namespace Chess {
 
         constexpr Move(Square from, Square to) : data((from << 6) + to) {}
 
+        template <MoveType T>
+        static constexpr Move make(Square from, Square to, PieceType pt = Knight)
+        {
+            return Move(u16(T + ((pt - Knight) << 12) + (from << 6) + to));
+        }
+
         constexpr Square from_sq() const
         {
             assert(is_ok());
@@ -38,12 +50,18 @@ namespace Chess {
 
         constexpr MoveType type_of() const { return MoveType(data & (3 << 14)); }
 
+        constexpr PieceType promotion_type() const { return PieceType(((data >> 12) & 3) + Knight); }
+
         constexpr bool is_ok() const { return none().data != data && null().data != data; }
 
         static constexpr Move null() { return Move(65); }
         static constexpr Move none() { return Move(0); }
 
-        static Move parse_uci(std::string& uci);
+        // From, to and promotion piece only, Position::parse_uci also tells
+        // castling and en passant apart. Move::none() if uci is malformed.
+        static Move parse_uci(std::string_view uci);
+
+        std::string uci() const;
 
         constexpr u16 raw() const { return data; }
 
@@ -0,0 +1,29 @@
+#include <iostream>
+#include <string>
+
+#include "bitboard.h"
+#include "position_store.h"
+#include "test.h"
+
+
+// Usage: pack_positions [puzzles.csv] [positions.pos]
+int main(int argc, char **argv) {
+
+    Chess::Bitboards::pick_slider_layout();
+
+    const std::string csv_path = argc > 1 ? argv[1] : "../data/lichess_db_puzzle.csv";
+    const std::string store_path = argc > 2 ? argv[2] : "../data/lichess_db_puzzle.pos";
+
+    Test::LichessDbPuzzle db;
+
+    if (db.open_and_build_index(csv_path) != 0) {
+        return 1;
+    }
+
+    if (!Chess::write_position_store(db, store_path, csv_path)) {
+        std::cerr << "Failed to write " << store_path << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,241 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "bitboard.h"
+#include "movegen.h"
+#include "position.h"
+
+
+namespace {
+
+    struct PerftCase {
+        const char *name;
+        const char *FEN;
+        int depth;
+        u64 nodes;
+    };
+
+    constexpr const char *STARTPOS = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+    constexpr const char *KIWIPETE = "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1";
+    constexpr const char *POSITION3 = "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1";
+    constexpr const char *POSITION4 = "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1";
+    constexpr const char *POSITION5 = "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8";
+    constexpr const char *POSITION6 = "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10";
+
+    // Reference counts from the Chess Programming Wiki perft results page
+    constexpr PerftCase PERFT_SUITE[] = {
+        {"startpos", STARTPOS, 1, 20},
+        {"startpos", STARTPOS, 2, 400},
+        {"startpos", STARTPOS, 3, 8902},
+        {"startpos", STARTPOS, 4, 197281},
+        {"startpos", STARTPOS, 5, 4865609},
+        {"kiwipete", KIWIPETE, 1, 48},
+        {"kiwipete", KIWIPETE, 2, 2039},
+        {"kiwipete", KIWIPETE, 3, 97862},
+        {"kiwipete", KIWIPETE, 4, 4085603},
+        {"position3", POSITION3, 1, 14},
+        {"position3", POSITION3, 2, 191},
+        {"position3", POSITION3, 3, 2812},
+        {"position3", POSITION3, 4, 43238},
+        {"position3", POSITION3, 5, 674624},
+        {"position4", POSITION4, 1, 6},
+        {"position4", POSITION4, 2, 264},
+        {"position4", POSITION4, 3, 9467},
+        {"position4", POSITION4, 4, 422333},
+        {"position5", POSITION5, 1, 44},
+        {"position5", POSITION5, 2, 1486},
+        {"position5", POSITION5, 3, 62379},
+        {"position5", POSITION5, 4, 2103487},
+        {"position6", POSITION6, 1, 46},
+        {"position6", POSITION6, 2, 2079},
+        {"position6", POSITION6, 3, 89890},
+        {"position6", POSITION6, 4, 3894594},
+    };
+
+    u64 timed_perft(Chess::Position &p, int depth, double &seconds)
+    {
+        auto start = std::chrono::steady_clock::now();
+        u64 nodes = Chess::perft(p, depth);
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return nodes;
+    }
+
+    // What the slider lookups of one position need
+    struct SliderSample {
+        Chess::Bitboard occupied;
+
+        // Bishops and queens, rooks and queens
+        Chess::Bitboard diagonal[Chess::Color_NB];
+        Chess::Bitboard orthogonal[Chess::Color_NB];
+    };
+
+    // Every position up to depth plies from p
+    void collect_samples(Chess::Position &p, int depth, std::vector<SliderSample> &samples)
+    {
+        using namespace Chess;
+
+        SliderSample &s = samples.emplace_back();
+        s.occupied = p.pieces();
+        for (Color c : {White, Black})
+        {
+            s.diagonal[c] = p.pieces(c, Bishop) | p.pieces(c, Queen);
+            s.orthogonal[c] = p.pieces(c, Rook) | p.pieces(c, Queen);
+        }
+
+        if (depth == 0)
+            return;
+
+        StateInfo st;
+        for (Move m : MoveList(p))
+        {
+            p.do_move(m, st);
+            collect_samples(p, depth - 1, samples);
+            p.undo_move(m);
+        }
+    }
+
+    constexpr int BENCH_ROUNDS = 20;
+
+    std::vector<SliderSample> bench_positions(Chess::Position &p)
+    {
+        std::vector<SliderSample> samples;
+        for (const char *FEN : {STARTPOS, KIWIPETE, POSITION3, POSITION4, POSITION5, POSITION6})
+        {
+            p.set(FEN);
+            collect_samples(p, 3, samples);
+        }
+        return samples;
+    }
+
+    // Slider attacks of both colours, one square at a time through the
+    // magics, BENCH_ROUNDS times over. Returns the seconds taken.
+    double magic_slider_attacks(const std::vector<SliderSample> &samples, std::vector<Chess::Bitboard> &attacks)
+    {
+        using namespace Chess;
+
+        auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < BENCH_ROUNDS; round++)
+        {
+            Bitboard *out = attacks.data();
+            for (const auto &s : samples)
+                for (Color c : {White, Black})
+                {
+                    Bitboard a = 0;
+                    Bitboard b = s.diagonal[c];
+                    while (b)
+                        a |= attacks_bb<Bishop>(pop_lsb(b), s.occupied);
+                    b = s.orthogonal[c];
+                    while (b)
+                        a |= attacks_bb<Rook>(pop_lsb(b), s.occupied);
+                    *out++ = a;
+                }
+        }
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // The same magic lookups with each slider table layout in turn, then
+    // the suite's perft with each. Returns false if the layouts disagree.
+    bool bench_magics(Chess::Position &p)
+    {
+        using namespace Chess;
+
+        const SliderLayout picked = Bitboards::slider_layout();
+
+        const auto samples = bench_positions(p);
+        const size_t nb_positions = samples.size();
+
+        std::vector<Bitboard> reference;
+        bool ok = true;
+
+        std::cout << "Host picks " << (picked == SliderLayout::Pext ? "PEXT" : "multiply") << std::endl;
+
+        for (SliderLayout layout : {SliderLayout::Pext, SliderLayout::Multiply})
+        {
+            Bitboards::set_slider_layout(layout);
+
+            std::vector<Bitboard> attacks(nb_positions * Color_NB);
+            const double seconds = magic_slider_attacks(samples, attacks);
+
+            if (reference.empty())
+                reference = attacks;
+            ok &= attacks == reference;
+
+            double perft_seconds = 0;
+            u64 nodes = 0;
+            for (const auto &c : PERFT_SUITE)
+            {
+                double s;
+                p.set(c.FEN);
+                nodes += timed_perft(p, c.depth, s);
+                perft_seconds += s;
+            }
+
+            std::cout << (layout == SliderLayout::Pext ? "PEXT:     " : "Multiply: ")
+                      << u64(double(nb_positions) * BENCH_ROUNDS / std::max(seconds, 1e-9)) << " positions/sec, perft "
+                      << u64(nodes / std::max(perft_seconds, 1e-9)) << " nodes/sec" << std::endl;
+        }
+
+        Bitboards::set_slider_layout(picked);
+
+        std::cout << (ok ? "ok" : "FAIL layouts disagree") << std::endl;
+        return ok;
+    }
+}
+
+
+// Usage: perft                 runs the reference suite
+//        perft <depth> <FEN>   counts a single position
+//        perft magics          times both slider table layouts on this host
+int main(int argc, char **argv) {
+
+    Chess::Bitboards::pick_slider_layout();
+
+    Chess::Position p;
+    double seconds;
+
+    if (argc == 2 && std::string(argv[1]) == "magics")
+        return bench_magics(p) ? 0 : 1;
+
+    if (argc > 2) {
+        const int depth = std::atoi(argv[1]);
+
+        std::string FEN = argv[2];
+        for (int i = 3; i < argc; i++)
+            FEN += std::string(" ") + argv[i];
+
+        p.set(FEN);
+        u64 nodes = timed_perft(p, depth, seconds);
+
+        std::cout << "Nodes: " << nodes << " in " << seconds << "s, "
+                  << u64(nodes / std::max(seconds, 1e-9)) << " nodes/sec" << std::endl;
+        return 0;
+    }
+
+    u64 total_nodes = 0;
+    double total_seconds = 0;
+    int failures = 0;
+
+    for (const auto &c : PERFT_SUITE) {
+        p.set(c.FEN);
+        u64 nodes = timed_perft(p, c.depth, seconds);
+
+        total_nodes += nodes;
+        total_seconds += seconds;
+
+        const bool ok = nodes == c.nodes;
+        failures += !ok;
+
+        std::cout << (ok ? "ok   " : "FAIL ") << c.name << " depth " << c.depth << ": " << nodes;
+        if (!ok)
+            std::cout << " (expected " << c.nodes << ")";
+        std::cout << std::endl;
+    }
+
+    std::cout << "Total: " << total_nodes << " nodes in " << total_seconds << "s, "
+              << u64(total_nodes / std::max(total_seconds, 1e-9)) << " nodes/sec" << std::endl;
+
+    return failures ? 1 : 0;
+}
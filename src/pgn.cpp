@@ -0,0 +1,464 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "pgn.h"
+#include "stream.h"
+
+namespace Chess
+{
+
+    namespace {
+
+        constexpr std::string_view STARTPOS = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+
+        bool is_space(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+
+        // The board field of a [FEN] tag has 8 ranks of 8 squares and one
+        // king a side. Position::set trusts its input and the tag comes from
+        // the file, so games whose tag does not are left out.
+        bool board_ok(std::string_view FEN)
+        {
+            constexpr std::string_view PIECES = "PNBRQKpnbrqk";
+
+            int ranks = 1, files = 0;
+            int kings[Color_NB] = {0, 0};
+
+            for (const char c : FEN.substr(0, FEN.find(' ')))
+            {
+                if (c == '/')
+                {
+                    if (files != 8)
+                        return false;
+                    ranks++;
+                    files = 0;
+                }
+                else if (c >= '1' && c <= '8')
+                    files += c - '0';
+                else if (PIECES.find(c) != std::string_view::npos)
+                {
+                    files++;
+                    if (c == 'K' || c == 'k')
+                        kings[c == 'K' ? White : Black]++;
+                }
+                else
+                    return false;
+
+                if (files > 8)
+                    return false;
+            }
+
+            return ranks == 8 && files == 8 && kings[White] == 1 && kings[Black] == 1;
+        }
+
+        // Cuts PGN text, fed in blocks of whole lines, into games and calls
+        // emit(FEN, movetext) for each. A game ends at the blank line after
+        // its movetext or at the next tag. Lines are joined with spaces.
+        template <typename Emit>
+        class GameSplitter
+        {
+        public:
+            explicit GameSplitter(Emit emit) : emit(std::move(emit)) {}
+
+            void feed(const char *first, const char *last)
+            {
+                while (first < last)
+                {
+                    const char *eol = std::find(first, last, '\n');
+                    std::string_view line(first, eol - first);
+                    if (!line.empty() && line.back() == '\r')
+                        line.remove_suffix(1);
+
+                    take_line(line);
+                    first = eol + 1;
+                }
+            }
+
+            void finish() { flush(); }
+
+        private:
+            void take_line(std::string_view line)
+            {
+                while (!line.empty() && is_space(line.front()))
+                    line.remove_prefix(1);
+
+                if (line.empty())
+                {
+                    if (!movetext.empty())
+                        flush();
+                    else if (in_tags)
+                        tags_closed = true;
+                    return;
+                }
+
+                if (line[0] == '%')
+                    return;
+
+                if (line[0] == '[')
+                {
+                    // A tag section without movetext is a game with no moves
+                    if (!movetext.empty() || tags_closed)
+                        flush();
+                    in_tags = true;
+                    take_tag(line);
+                    return;
+                }
+
+                // Rest of line comment
+                line = line.substr(0, line.find(';'));
+
+                movetext.append(line);
+                movetext.push_back(' ');
+            }
+
+            void take_tag(std::string_view line)
+            {
+                const size_t space = line.find(' ');
+                const size_t open = line.find('"');
+                const size_t close = line.rfind('"');
+                if (space == std::string_view::npos || open == std::string_view::npos || close <= open)
+                    return;
+
+                const std::string_view name = line.substr(1, space - 1);
+                const std::string_view value = line.substr(open + 1, close - open - 1);
+
+                if (name == "FEN")
+                    FEN.assign(value);
+                else if (name == "Variant")
+                    skip = value != "Standard" && value != "From Position";
+            }
+
+            void flush()
+            {
+                if ((in_tags || !movetext.empty()) && !skip)
+                    emit(std::string_view(FEN), std::string_view(movetext));
+
+                FEN.clear();
+                movetext.clear();
+                skip = in_tags = tags_closed = false;
+            }
+
+            Emit emit;
+            std::string FEN;
+            std::string movetext;
+            bool skip = false;
+            bool in_tags = false;
+            bool tags_closed = false;
+        };
+
+        template <typename Emit>
+        bool split_games(const std::string &path, Emit emit)
+        {
+            std::unique_ptr<Test::ByteSource> src = Test::open_byte_source(path);
+            if (!src)
+                return false;
+
+            GameSplitter<Emit> splitter(std::move(emit));
+            const bool ok = Test::stream_line_blocks(*src, [&splitter](const char *first, const char *last) {
+                splitter.feed(first, last);
+            });
+            splitter.finish();
+            return ok;
+        }
+
+        // Games cut from the stream, one worker replays the whole batch
+        struct GameBatch
+        {
+            struct Game
+            {
+                size_t FEN_begin, FEN_size;
+                size_t moves_begin, moves_size;
+            };
+
+            std::string text;
+            std::vector<Game> games;
+            u64 first_game = 0;
+            size_t index = 0;
+
+            void clear()
+            {
+                text.clear();
+                games.clear();
+            }
+        };
+
+        // Bounded hand-off between the splitting thread and the workers
+        class BatchQueue
+        {
+            std::mutex m;
+            std::condition_variable cv;
+            std::deque<GameBatch *> batches;
+            bool closed = false;
+
+        public:
+            void push(GameBatch *b)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m);
+                    batches.push_back(b);
+                }
+                cv.notify_one();
+            }
+
+            // nullptr once closed and drained
+            GameBatch *pop()
+            {
+                std::unique_lock<std::mutex> lock(m);
+                cv.wait(lock, [this] { return closed || !batches.empty(); });
+                if (batches.empty())
+                    return nullptr;
+                GameBatch *b = batches.front();
+                batches.pop_front();
+                return b;
+            }
+
+            void close()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m);
+                    closed = true;
+                }
+                cv.notify_all();
+            }
+        };
+    }
+
+    bool next_san(std::string_view &movetext, std::string_view &san)
+    {
+        for (;;)
+        {
+            while (!movetext.empty() && is_space(movetext.front()))
+                movetext.remove_prefix(1);
+
+            if (movetext.empty())
+                return false;
+
+            const char c = movetext.front();
+
+            if (c == '{')
+            {
+                const size_t close = movetext.find('}');
+                movetext.remove_prefix(close == std::string_view::npos ? movetext.size() : close + 1);
+                continue;
+            }
+
+            // Variations nest, and their comments may hold parentheses
+            if (c == '(')
+            {
+                int depth = 0;
+                size_t i = 0;
+                for (; i < movetext.size(); i++)
+                {
+                    if (movetext[i] == '{')
+                    {
+                        const size_t close = movetext.find('}', i);
+                        i = close == std::string_view::npos ? movetext.size() - 1 : close;
+                    }
+                    else if (movetext[i] == '(')
+                        depth++;
+                    else if (movetext[i] == ')' && --depth == 0)
+                        break;
+                }
+                movetext.remove_prefix(std::min(i + 1, movetext.size()));
+                continue;
+            }
+
+            if (c == ')')
+            {
+                movetext.remove_prefix(1);
+                continue;
+            }
+
+            size_t end = 0;
+            while (end < movetext.size() && !is_space(movetext[end]) && movetext[end] != '{' && movetext[end] != '(' && movetext[end] != ')')
+                end++;
+
+            std::string_view token = movetext.substr(0, end);
+            movetext.remove_prefix(end);
+
+            if (c == '$' || token == "1-0" || token == "0-1" || token == "1/2-1/2" || token == "*")
+                continue;
+
+            // Move numbers, 12. or 12... and sometimes glued to the move.
+            // Digits not followed by a dot are 0-0 castling.
+            size_t number = 0;
+            while (number < token.size() && token[number] >= '0' && token[number] <= '9')
+                number++;
+
+            if (number == token.size() || token[number] == '.')
+            {
+                while (number < token.size() && token[number] == '.')
+                    number++;
+
+                token.remove_prefix(number);
+                if (token.empty())
+                    continue;
+            }
+
+            san = token;
+            return true;
+        }
+    }
+
+    bool PgnDatabase::open_and_build_index(const std::string &file_path, size_t batch_size)
+    {
+        path = file_path;
+        first_rows.assign(1, 0);
+        first_games.assign(1, 0);
+
+        size_t batch_bytes = 0;
+
+        const bool ok = split_games(path, [&](std::string_view FEN, std::string_view movetext) {
+            batch_bytes += FEN.size() + movetext.size();
+
+            u64 nb_plies = 0;
+            std::string_view san;
+            while (next_san(movetext, san))
+                nb_plies++;
+
+            first_rows.push_back(first_rows.back() + nb_plies + 1);
+
+            if (batch_bytes >= batch_size)
+            {
+                first_games.push_back(game_count());
+                batch_bytes = 0;
+            }
+        });
+
+        if (first_games.back() != game_count())
+            first_games.push_back(game_count());
+        return ok;
+    }
+
+    PgnRow PgnDatabase::row(u64 row) const
+    {
+        assert(row < row_count());
+        const u64 game = std::upper_bound(first_rows.begin(), first_rows.end(), row) - first_rows.begin() - 1;
+        return {game, u32(row - first_rows[game])};
+    }
+
+    PgnPassStats PgnDatabase::pass_positions(const std::function<void(Position &, u64, size_t)> &visit,
+                                             size_t nb_workers) const
+    {
+        nb_workers = std::max<size_t>(nb_workers, 1);
+
+        std::vector<GameBatch> pool(2 * nb_workers);
+        BatchQueue free_batches;
+        BatchQueue full_batches;
+
+        for (auto &b : pool)
+            free_batches.push(&b);
+
+        std::atomic<u64> truncated_games = 0;
+        std::atomic<u64> skipped_rows = 0;
+
+        auto replay = [&](const GameBatch &batch, Position &p) {
+            for (size_t k = 0; k < batch.games.size(); k++)
+            {
+                const GameBatch::Game &g = batch.games[k];
+                const u64 game = batch.first_game + k;
+
+                // The index was built from the same file, a changed file
+                // only gets the games it had
+                if (game >= game_count())
+                    return;
+
+                const u64 first = first_rows[game];
+                const u64 last = first_rows[game + 1];
+
+                const std::string_view FEN(batch.text.data() + g.FEN_begin, g.FEN_size);
+                std::string_view movetext(batch.text.data() + g.moves_begin, g.moves_size);
+
+                if (!FEN.empty() && !board_ok(FEN))
+                {
+                    truncated_games.fetch_add(1, std::memory_order_relaxed);
+                    skipped_rows.fetch_add(last - first, std::memory_order_relaxed);
+                    continue;
+                }
+
+                p.set(FEN.empty() ? STARTPOS : FEN);
+                visit(p, first, batch.index);
+
+                u64 row = first + 1;
+                std::string_view san;
+                for (; row < last && next_san(movetext, san); row++)
+                {
+                    const Move m = p.parse_san(san);
+                    if (!m.is_ok())
+                        break;
+
+                    p.make_move(m);
+                    visit(p, row, batch.index);
+                }
+
+                if (row < last)
+                {
+                    truncated_games.fetch_add(1, std::memory_order_relaxed);
+                    skipped_rows.fetch_add(last - row, std::memory_order_relaxed);
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t worker = 0; worker < nb_workers; worker++)
+        {
+            workers.emplace_back([&]() {
+                Position p;
+                while (GameBatch *b = full_batches.pop())
+                {
+                    replay(*b, p);
+                    b->clear();
+                    free_batches.push(b);
+                }
+            });
+        }
+
+        GameBatch *current = nullptr;
+        u64 nb_games = 0;
+        size_t nb_batches = 0;
+
+        // Batches are cut where the index cut them, the games past the
+        // index all go to the last one
+        PgnPassStats stats;
+        stats.read = split_games(path, [&](std::string_view FEN, std::string_view movetext) {
+            if (!current)
+            {
+                current = free_batches.pop();
+                current->first_game = nb_games;
+                current->index = nb_batches++;
+            }
+
+            GameBatch::Game g;
+            g.FEN_begin = current->text.size();
+            g.FEN_size = FEN.size();
+            current->text.append(FEN);
+            g.moves_begin = current->text.size();
+            g.moves_size = movetext.size();
+            current->text.append(movetext);
+
+            current->games.push_back(g);
+            nb_games++;
+
+            if (nb_batches < batch_count() && nb_games == first_games[nb_batches])
+            {
+                full_batches.push(current);
+                current = nullptr;
+            }
+        });
+
+        if (current)
+            full_batches.push(current);
+        full_batches.close();
+
+        for (auto &t : workers)
+            t.join();
+
+        stats.truncated_games = truncated_games;
+        stats.skipped_rows = skipped_rows;
+        return stats;
+    }
+}
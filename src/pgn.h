@@ -0,0 +1,75 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "types.h"
+#include "position.h"
+
+namespace Chess {
+
+    // Next SAN token of PGN movetext, consumed from the front. Move numbers,
+    // comments, variations, NAGs and the result are skipped. False once the
+    // movetext is used up.
+    bool next_san(std::string_view &movetext, std::string_view &san);
+
+    // Every position of every game is a row: ply 0 is the start position,
+    // ply k the position after k half moves. Rows are numbered game after
+    // game in file order.
+    struct PgnRow
+    {
+        u64 game;
+        u32 ply;
+    };
+
+    // What a pass over the games saw. A game is truncated at its first SAN
+    // that is not a legal move, the rows after it are not visited. A game
+    // whose [FEN] tag is not a board counts too, with all of its rows.
+    struct PgnPassStats
+    {
+        bool read = false;
+        u64 truncated_games = 0;
+        u64 skipped_rows = 0;
+    };
+
+    // Game database in PGN, plain or compressed, read as a stream. Only the
+    // first row of each game is kept in memory, positions are replayed from
+    // the SAN on every pass. Games of a variant other than standard chess are
+    // left out.
+    class PgnDatabase
+    {
+    public:
+        // Counts games and plies in one read without decoding SAN, and cuts
+        // the games into batches of about batch_size bytes of PGN. False if
+        // the file cannot be opened or read.
+        bool open_and_build_index(const std::string &path, size_t batch_size = 1 << 20);
+
+        u64 game_count() const { return first_rows.size() - 1; }
+        u64 row_count() const { return first_rows.back(); }
+        u64 first_row(u64 game) const { return first_rows[game]; }
+        PgnRow row(u64 row) const;
+
+        // Batch b holds the games [first_games[b], first_games[b + 1]), so
+        // a contiguous range of rows
+        size_t batch_count() const { return first_games.size() - 1; }
+
+        // Streams the games again and replays the batches on nb_workers
+        // threads from a pool of two per worker, so memory does not grow
+        // with the file. visit(p, row, batch) is called on every ply; the
+        // calls of one batch come from one thread in row order, so the batch
+        // can serve as the shard of a sharded pass. visit may search or flip
+        // p as long as it leaves the same position behind, the game is
+        // replayed on from it.
+        PgnPassStats pass_positions(const std::function<void(Position &, u64, size_t)> &visit,
+                                    size_t nb_workers) const;
+
+    private:
+        std::string path;
+
+        // first_rows[g] is the first row of game g, back() the row count
+        std::vector<u64> first_rows{0};
+        std::vector<u64> first_games{0};
+    };
+}
@@ -1,10 +1,12 @@
 
 #include<cstring>
+#include <algorithm>
 #include <sstream>
 
 #include "position.h"
 
 #include "bitboard.h"
+#include "movegen.h"
 
 using std::string;
 
@@ -43,10 +45,53 @@ namespace Chess {
         }
     }
 
-    Position &Position::set(const std::string &FEN)
+    void fen_piece_counts(std::string_view FEN, u8 counts[Piece_NB])
     {
+        static constexpr Piece FEN_PIECES[] = {
+            White_Pawn, White_Knight, White_Bishop, White_Rook, White_Queen, White_King,
+            Black_Pawn, Black_Knight, Black_Bishop, Black_Rook, Black_Queen, Black_King,
+        };
+        static constexpr char FEN_CHARS[] = "PNBRQKpnbrqk";
 
-        std::memset(this, 0, sizeof(Position));
+        std::fill(counts, counts + Piece_NB, 0);
+
+        const char *ptr = FEN.data();
+        const char *const end = ptr + FEN.size();
+
+        const __m256i space = _mm256_set1_epi8(' ');
+
+        // One compare per piece letter over 32 bytes, masked to the bytes
+        // before the first space. The remainder is done byte by byte so
+        // nothing is read past the FEN.
+        while (end - ptr >= 32)
+        {
+            const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr));
+            const u32 spaces = u32(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, space)));
+            const u32 live = spaces ? (spaces & (0u - spaces)) - 1 : ~0u;
+
+            for (int i = 0; i < 12; i++)
+            {
+                const __m256i hits = _mm256_cmpeq_epi8(block, _mm256_set1_epi8(FEN_CHARS[i]));
+                counts[FEN_PIECES[i]] += u8(_mm_popcnt_u32(u32(_mm256_movemask_epi8(hits)) & live));
+            }
+
+            if (spaces)
+                return;
+            ptr += 32;
+        }
+
+        for (; ptr < end && *ptr != ' '; ++ptr)
+        {
+            const Piece piece = char_to_piece(*ptr);
+            if (piece != No_Piece)
+                counts[piece]++;
+        }
+    }
+
+    Position &Position::set(std::string_view FEN)
+    {
+
+        clear();
 
         const char *ptr = FEN.data();
         const char *const end = ptr + FEN.size();
@@ -80,37 +125,542 @@ namespace Chess {
             }
         }
 
+        auto skip_spaces = [&]() {
+            while (ptr < end && *ptr == ' ')
+                ++ptr;
+        };
+
+        auto parse_number = [&]() {
+            int n = 0;
+            while (ptr < end && *ptr >= '0' && *ptr <= '9')
+                n = n * 10 + (*ptr++ - '0');
+            return n;
+        };
+
         // Skip spaces and parse side to move
-        while (ptr < end && *ptr == ' ') {
-            ++ptr;
-        }
+        skip_spaces();
         if (ptr < end)
         {
             _side_to_move = (*ptr == 'w') ? White : Black;
             ++ptr;
         }
 
+        skip_spaces();
+        for (; ptr < end && *ptr != ' '; ++ptr)
+        {
+            switch (*ptr)
+            {
+            case 'K':
+                st->castling_rights |= White_OO;
+                break;
+            case 'Q':
+                st->castling_rights |= White_OOO;
+                break;
+            case 'k':
+                st->castling_rights |= Black_OO;
+                break;
+            case 'q':
+                st->castling_rights |= Black_OOO;
+                break;
+            default:
+                break;
+            }
+        }
+
+        // Kept only if a pawn can actually take there, so equal positions
+        // have equal states
+        skip_spaces();
+        if (end - ptr >= 2 && ptr[0] >= 'a' && ptr[0] <= 'h' && (ptr[1] == '3' || ptr[1] == '6'))
+        {
+            Square ep = make_square(File(ptr[0] - 'a'), Rank(ptr[1] - '1'));
+            if (pawn_attacks_bb(~_side_to_move, ep) & pieces(_side_to_move, Pawn))
+                st->ep_square = ep;
+        }
+        while (ptr < end && *ptr != ' ')
+            ++ptr;
+
+        skip_spaces();
+        st->rule50 = parse_number();
+
+        skip_spaces();
+        int fullmove = parse_number();
+        _game_ply = std::max(2 * (fullmove - 1), 0) + (_side_to_move == Black);
+
+        add_state_keys();
+
+        return *this;
+    }
+
+
+    Position &Position::set(Bitboard occupied, const u8 *codes, Color stm, int castling_rights, Square ep_square, Piece captured)
+    {
+        clear();
+
+        for (int k = 0; occupied; k++)
+        {
+            Square sq = pop_lsb(occupied);
+            put_piece(Piece((codes[k >> 1] >> ((k & 1) * 4)) & 0xF), sq);
+        }
+
+        _side_to_move = stm;
+        st->castling_rights = castling_rights;
+        st->ep_square = ep_square;
+        st->captured = captured;
+
+        add_state_keys();
+
+        return *this;
+    }
+
+    Position &Position::set_and_move(std::string_view FEN, std::string_view uci)
+    {
+        set(FEN);
+        make_move(parse_uci(uci));
         return *this;
     }
 
+    void Position::flip()
+    {
+        auto swap_colour = [](Piece pc) { return pc == No_Piece ? pc : make_piece(~color_of(pc), typeof_piece(pc)); };
+
+        const StateInfo state = *st;
+        const Color stm = _side_to_move;
+        const int ply = _game_ply;
+        const bool was_flipped = _flipped;
+
+        Piece board[Square_NB];
+        std::copy(std::begin(_pieces), std::end(_pieces), board);
+        Bitboard occupied = pieces();
+
+        clear();
+
+        while (occupied)
+        {
+            Square s = pop_lsb(occupied);
+            put_piece(swap_colour(board[s]), flip_rank(s));
+        }
+
+        // Half a move either way keeps the full move number of the FEN
+        _side_to_move = ~stm;
+        _game_ply = ply + (stm == White ? 1 : -1);
+        _flipped = !was_flipped;
+
+        st->castling_rights = ((state.castling_rights & White_Castling) << 2) | ((state.castling_rights & Black_Castling) >> 2);
+        st->ep_square = state.ep_square == Sq_None ? Sq_None : flip_rank(state.ep_square);
+        st->rule50 = state.rule50;
+        st->captured = swap_colour(state.captured);
+
+        add_state_keys();
+    }
+
+    std::string Position::fen() const
+    {
+        std::string s;
+
+        for (Rank r = Rank_8; r >= Rank_1; --r)
+        {
+            int empty_run = 0;
+            for (File f = File_A; f <= File_H; ++f)
+            {
+                Piece pc = piece_on(make_square(f, r));
+                if (pc == No_Piece)
+                {
+                    empty_run++;
+                    continue;
+                }
+                if (empty_run)
+                    s += char('0' + empty_run);
+                empty_run = 0;
+                s += " PNBRQK  pnbrqk"[pc];
+            }
+            if (empty_run)
+                s += char('0' + empty_run);
+            if (r > Rank_1)
+                s += '/';
+        }
+
+        s += _side_to_move == White ? " w " : " b ";
+
+        if (can_castle(White_OO))
+            s += 'K';
+        if (can_castle(White_OOO))
+            s += 'Q';
+        if (can_castle(Black_OO))
+            s += 'k';
+        if (can_castle(Black_OOO))
+            s += 'q';
+        if (!can_castle(Any_Castling))
+            s += '-';
+
+        if (ep_square() == Sq_None)
+            s += " -";
+        else
+        {
+            s += ' ';
+            s += char('a' + file_of(ep_square()));
+            s += char('1' + rank_of(ep_square()));
+        }
+
+        s += ' ' + std::to_string(rule50_count()) + ' ' + std::to_string(1 + (_game_ply - (_side_to_move == Black)) / 2);
+
+        return s;
+    }
+
+    void Position::pack(u8 *codes) const
+    {
+        Bitboard occupied = pieces();
+
+        for (int k = 0; occupied; k++)
+        {
+            Square sq = pop_lsb(occupied);
+
+            if (k & 1)
+                codes[k >> 1] |= u8(piece_on(sq) << 4);
+            else
+                codes[k >> 1] = u8(piece_on(sq));
+        }
+    }
+
+    namespace {
+
+        // Rights lost when a move starts or ends on the square
+        constexpr int castling_mask(Square s)
+        {
+            switch (s)
+            {
+            case A1:
+                return White_OOO;
+            case E1:
+                return White_Castling;
+            case H1:
+                return White_OO;
+            case A8:
+                return Black_OOO;
+            case E8:
+                return Black_Castling;
+            case H8:
+                return Black_OO;
+            default:
+                return No_Castling;
+            }
+        }
+    }
+
+    void Position::add_state_keys()
+    {
+        if (_side_to_move == Black)
+            st->key ^= Zobrist::KEYS.side;
+        if (st->ep_square != Sq_None)
+            st->key ^= Zobrist::KEYS.enpassant[file_of(st->ep_square)];
+        st->key ^= Zobrist::KEYS.castling[st->castling_rights];
+    }
+
+    Move Position::parse_uci(std::string_view uci) const
+    {
+        Move m = Move::parse_uci(uci);
+
+        if (!m.is_ok() || m.type_of() == PROMOTION)
+            return m;
+
+        const Square from = m.from_sq();
+        const Square to = m.to_sq();
+        const PieceType pt = typeof_piece(piece_on(from));
+
+        if (pt == King && distance<File>(from, to) == 2)
+            return Move::make<CASTLING>(from, to);
+
+        if (pt == Pawn && to == st->ep_square)
+            return Move::make<EN_PASSANT>(from, to);
+
+        return m;
+    }
+
+    Move Position::parse_san(std::string_view san) const
+    {
+        while (!san.empty() && std::string_view("+#!?").find(san.back()) != std::string_view::npos)
+            san.remove_suffix(1);
+
+        if (san.empty())
+            return Move::none();
+
+        const MoveList legal(*this);
+
+        // Lichess writes O-O, some older files 0-0
+        if (san[0] == 'O' || san[0] == '0')
+        {
+            if (san != "O-O" && san != "O-O-O" && san != "0-0" && san != "0-0-0")
+                return Move::none();
 
-    void Position::make_move(Move move) {
-        Square from = move.from_sq();
-        Square to = move.to_sq();
+            const Square from = king_square(_side_to_move);
+            const Move m = Move::make<CASTLING>(from, make_square(san.size() == 3 ? File_G : File_C, rank_of(from)));
+            return legal.contains(m) ? m : Move::none();
+        }
+
+        constexpr std::string_view PIECES = "PNBRQK";
 
-        bool captured = !empty(to);
+        PieceType pt = Pawn;
+        if (PIECES.find(san[0]) != std::string_view::npos)
+        {
+            pt = PieceType(PIECES.find(san[0]) + Pawn);
+            san.remove_prefix(1);
+        }
 
-        if (captured)
+        PieceType promotion = No_Piece_Type;
+        if (san.size() > 2 && PIECES.find(san.back()) != std::string_view::npos)
         {
-            Piece pc = piece_on(from);
-            remove_piece(from);
-            swap_piece(to, pc);
+            promotion = PieceType(PIECES.find(san.back()) + Pawn);
+            san.remove_suffix(1);
+            if (san.back() == '=')
+                san.remove_suffix(1);
         }
+
+        // The destination ends the text, file, rank and 'x' come before it
+        if (san.size() < 2)
+            return Move::none();
+
+        const char to_file = san[san.size() - 2], to_rank = san[san.size() - 1];
+        if (to_file < 'a' || to_file > 'h' || to_rank < '1' || to_rank > '8')
+            return Move::none();
+
+        const Square to = make_square(File(to_file - 'a'), Rank(to_rank - '1'));
+        san.remove_suffix(2);
+
+        int from_file = -1, from_rank = -1;
+        for (char c : san)
+        {
+            if (c >= 'a' && c <= 'h')
+                from_file = c - 'a';
+            else if (c >= '1' && c <= '8')
+                from_rank = c - '1';
+            else if (c != 'x')
+                return Move::none();
+        }
+
+        Move found = Move::none();
+        for (Move m : legal)
+        {
+            const Square from = m.from_sq();
+
+            if (m.to_sq() != to || m.type_of() == CASTLING || typeof_piece(piece_on(from)) != pt)
+                continue;
+            if ((from_file >= 0 && file_of(from) != from_file) || (from_rank >= 0 && rank_of(from) != from_rank))
+                continue;
+            if ((m.type_of() == PROMOTION) != (promotion != No_Piece_Type))
+                continue;
+            if (promotion != No_Piece_Type && m.promotion_type() != promotion)
+                continue;
+
+            if (found.is_ok())
+                return Move::none();
+            found = m;
+        }
+        return found;
+    }
+
+    void Position::castle_rook(Color us, Square king_to, bool undo)
+    {
+        const Rank rank = us == White ? Rank_1 : Rank_8;
+        const bool king_side = file_of(king_to) == File_G;
+
+        Square rook_from = make_square(king_side ? File_H : File_A, rank);
+        Square rook_to = make_square(king_side ? File_F : File_D, rank);
+
+        if (undo)
+            move_piece(rook_to, rook_from);
         else
+            move_piece(rook_from, rook_to);
+    }
+
+    void Position::apply_move(Move move)
+    {
+        const Color us = _side_to_move;
+        const Color them = ~us;
+        const Square from = move.from_sq();
+        const Square to = move.to_sq();
+        const Piece pc = piece_on(from);
+
+        Piece captured = move.type_of() == EN_PASSANT ? make_piece(them, Pawn) : piece_on(to);
+
+        st->rule50++;
+        st->key ^= Zobrist::KEYS.side;
+
+        if (st->ep_square != Sq_None)
+        {
+            st->key ^= Zobrist::KEYS.enpassant[file_of(st->ep_square)];
+            st->ep_square = Sq_None;
+        }
+
+        if (move.type_of() == CASTLING)
+        {
+            castle_rook(us, to, false);
+        }
+        else if (captured != No_Piece)
+        {
+            remove_piece(move.type_of() == EN_PASSANT ? to - pawn_push(us) : to);
+            st->rule50 = 0;
+        }
+
+        move_piece(from, to);
+
+        if (typeof_piece(pc) == Pawn)
+        {
+            if ((int(from) ^ int(to)) == 16)
+            {
+                Square ep = to - pawn_push(us);
+                if (pawn_attacks_bb(us, ep) & pieces(them, Pawn))
+                {
+                    st->ep_square = ep;
+                    st->key ^= Zobrist::KEYS.enpassant[file_of(ep)];
+                }
+            }
+            else if (move.type_of() == PROMOTION)
+            {
+                swap_piece(to, make_piece(us, move.promotion_type()));
+            }
+            st->rule50 = 0;
+        }
+
+        if (const int lost = st->castling_rights & (castling_mask(from) | castling_mask(to)))
         {
-            move_piece(from, to);
+            st->key ^= Zobrist::KEYS.castling[st->castling_rights];
+            st->castling_rights &= ~lost;
+            st->key ^= Zobrist::KEYS.castling[st->castling_rights];
         }
+        st->captured = captured;
 
+        _side_to_move = them;
+        _game_ply++;
+    }
+
+    void Position::do_move(Move move, StateInfo &new_st)
+    {
+        new_st = *st;
+        new_st.previous = st;
+        st = &new_st;
+
+        apply_move(move);
+    }
+
+    void Position::undo_move(Move move)
+    {
         _side_to_move = ~_side_to_move;
+        _game_ply--;
+
+        const Color us = _side_to_move;
+        const Square from = move.from_sq();
+        const Square to = move.to_sq();
+
+        if (move.type_of() == PROMOTION)
+            swap_piece(to, make_piece(us, Pawn));
+
+        move_piece(to, from);
+
+        if (move.type_of() == CASTLING)
+            castle_rook(us, to, true);
+        else if (st->captured != No_Piece)
+            put_piece(st->captured, move.type_of() == EN_PASSANT ? to - pawn_push(us) : to);
+
+        st = st->previous;
+    }
+
+    void Position::make_move(Move move)
+    {
+        // Puzzle text is not trusted to hold a move of this position
+        if (move.is_ok() && !empty(move.from_sq()))
+            apply_move(move);
+    }
+
+    Bitboard Position::attackers_to(Square s, Bitboard occupied) const
+    {
+        return (pawn_attacks_bb(Black, s) & pieces(White, Pawn))
+             | (pawn_attacks_bb(White, s) & pieces(Black, Pawn))
+             | (attacks_bb<Knight>(s) & pieces(Knight))
+             | (attacks_bb<Bishop>(s, occupied) & (pieces(Bishop) | pieces(Queen)))
+             | (attacks_bb<Rook>(s, occupied) & (pieces(Rook) | pieces(Queen)))
+             | (attacks_bb<King>(s) & pieces(King));
+    }
+
+    bool Position::see_ge(Move m, int threshold) const
+    {
+        // Castling, en passant and promotions are rare enough to be called
+        // an even trade
+        if (m.type_of() != NORMAL)
+            return 0 >= threshold;
+
+        const Square from = m.from_sq(), to = m.to_sq();
+
+        // swap is what the side to capture next has to win back for the
+        // exchange to stay at or above threshold for the mover
+        int swap = PieceValue[piece_on(to)] - threshold;
+        if (swap < 0)
+            return false;
+
+        // A king may only take a piece nobody defends, and then keeps it
+        if (typeof_piece(piece_on(from)) == King)
+            return !(attackers_to(to, pieces() ^ from) & pieces(~color_on(from)));
+
+        swap = PieceValue[piece_on(from)] - swap;
+        if (swap <= 0)
+            return true;
+
+        Bitboard occupied = pieces() ^ from ^ to;
+        Color stm = color_on(from);
+        Bitboard attackers = attackers_to(to, occupied);
+        Bitboard stm_attackers, bb;
+        int res = 1;
+
+        while (true)
+        {
+            stm = ~stm;
+            attackers &= occupied;
+
+            if (!(stm_attackers = attackers & pieces(stm)))
+                break;
+
+            res ^= 1;
+
+            // Each capture takes the least valuable attacker off the board,
+            // which uncovers the sliders lined up behind it
+            if ((bb = stm_attackers & pieces(Pawn)))
+            {
+                if ((swap = PawnValue - swap) < res)
+                    break;
+                occupied ^= lsb(bb);
+                attackers |= attacks_bb<Bishop>(to, occupied) & (pieces(Bishop) | pieces(Queen));
+            }
+            else if ((bb = stm_attackers & pieces(Knight)))
+            {
+                if ((swap = KnightValue - swap) < res)
+                    break;
+                occupied ^= lsb(bb);
+            }
+            else if ((bb = stm_attackers & pieces(Bishop)))
+            {
+                if ((swap = BishopValue - swap) < res)
+                    break;
+                occupied ^= lsb(bb);
+                attackers |= attacks_bb<Bishop>(to, occupied) & (pieces(Bishop) | pieces(Queen));
+            }
+            else if ((bb = stm_attackers & pieces(Rook)))
+            {
+                if ((swap = RookValue - swap) < res)
+                    break;
+                occupied ^= lsb(bb);
+                attackers |= attacks_bb<Rook>(to, occupied) & (pieces(Rook) | pieces(Queen));
+            }
+            else if ((bb = stm_attackers & pieces(Queen)))
+            {
+                if ((swap = QueenValue - swap) < res)
+                    break;
+                occupied ^= lsb(bb);
+                attackers |= (attacks_bb<Bishop>(to, occupied) & (pieces(Bishop) | pieces(Queen)))
+                           | (attacks_bb<Rook>(to, occupied) & (pieces(Rook) | pieces(Queen)));
+            }
+            else
+                // The king may only capture last, never into a defended square
+                return (attackers & ~pieces(stm)) ? res ^ 1 : res;
+        }
+
+        return bool(res);
     }
 }
\ No newline at end of file
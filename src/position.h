@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 
 #include "types.h"
 #include "bitboard.h"
@@ -9,6 +10,56 @@
 
 namespace Chess {
 
+    namespace Zobrist {
+
+        struct Keys {
+            Key psq[Piece_NB][Square_NB];
+            Key enpassant[File_Nb];
+            Key castling[Castling_Right_NB];
+            Key side;
+        };
+
+        // xorshift64* from a fixed seed, evaluated by the compiler so the
+        // keys need no init and are the same on every run
+        constexpr Keys make_keys()
+        {
+            Keys keys{};
+            u64 s = 1070372;
+
+            auto next = [&s]() {
+                s ^= s >> 12;
+                s ^= s << 25;
+                s ^= s >> 27;
+                return s * 2685821657736338717ULL;
+            };
+
+            for (auto &piece : keys.psq)
+                for (Key &k : piece)
+                    k = next();
+            for (Key &k : keys.enpassant)
+                k = next();
+            for (Key &k : keys.castling)
+                k = next();
+            keys.side = next();
+
+            return keys;
+        }
+
+        inline constexpr Keys KEYS = make_keys();
+    }
+
+    // The part of a position that do_move cannot recompute when the move is
+    // taken back. Each do_move links a new one to the previous.
+    struct StateInfo {
+        Key key = 0;
+        int castling_rights = No_Castling;
+        Square ep_square = Sq_None;
+        int rule50 = 0;
+
+        Piece captured = No_Piece;
+        StateInfo *previous = nullptr;
+    };
+
     class Position {
 
         public:
@@ -16,11 +67,34 @@ namespace Chess {
         Position(Position&) = delete;
         Position& operator=(const Position&) = delete;
 
-        Position& set(const std::string& FEN);
+        Position& set(std::string_view FEN);
+
+        // set(FEN) followed by make_move of the UCI move, both parsed in place
+        Position& set_and_move(std::string_view FEN, std::string_view uci);
+
+        // Packed form kept by the position store: one 4 bit Piece code per
+        // occupied square in ascending square order, two codes per byte with
+        // the lower square in the low nibble. 32 pieces fit in 16 bytes.
+        // captured is what the move that led here took, see captured_piece.
+        Position& set(Bitboard occupied, const u8* codes, Color stm,
+                      int castling_rights = No_Castling, Square ep_square = Sq_None,
+                      Piece captured = No_Piece);
+        void pack(u8* codes) const;
+
+        std::string fen() const;
+
+        // Mirrors the board top to bottom and swaps the colours, so the
+        // other side is to move from the same squares of its own. The move
+        // history is dropped, flip is not taken back by undo_move. flipped()
+        // tells an odd number of flips since the last set.
+        void flip();
+        bool flipped() const;
 
 
         Bitboard pieces(PieceType pt = All_Pieces) const;
         Bitboard pieces(Color c) const;
+        Bitboard pieces(Color c, PieceType pt) const;
+        Square king_square(Color c) const;
         Piece piece_on(Square s) const;
         Color color_on(Square s) const;
         bool empty(Square s) const;
@@ -31,19 +105,86 @@ namespace Chess {
 
         Color side_to_move() const;
 
+        // Zobrist key of pieces, side to move, castling rights and en
+        // passant square, kept up to date by every board change
+        Key key() const;
+        int castling_rights() const;
+        bool can_castle(CastlingRights cr) const;
+        Square ep_square() const;
+        int rule50_count() const;
+        int game_ply() const;
+        Piece captured_piece() const;
+
+        // Full move from UCI text, with castling and en passant told apart
+        // by the pieces involved. Move::none() if uci is malformed.
+        Move parse_uci(std::string_view uci) const;
+
+        // Legal move from SAN text such as Nbd7, exd6, e8=Q+ or O-O, check
+        // and annotation marks ignored. Move::none() if san is malformed,
+        // illegal or ambiguous.
+        Move parse_san(std::string_view san) const;
+
+        // The move is taken back with undo_move, new_st must stay alive
+        // until then
+        void do_move(Move move, StateInfo &new_st);
+        void undo_move(Move move);
+
+        // Plays a move that is never taken back, the current state is
+        // updated in place. Move::none() and moves from an empty square are
+        // ignored.
         void make_move(Move move);
 
+        // Pieces of both colours attacking s, with sliders seeing through
+        // everything not in occupied
+        Bitboard attackers_to(Square s, Bitboard occupied) const;
+        Bitboard attackers_to(Square s) const;
+
+        // Static exchange evaluation: true if playing m and then trading on
+        // its destination square, least valuable attacker first, leaves the
+        // mover at least threshold centipawns up. Either side may stop
+        // trading when going on would lose. Pins are not looked at.
+        bool see_ge(Move m, int threshold = 0) const;
+
         private:
         void move_piece(Square from, Square to);
+        void clear();
+        void apply_move(Move move);
+        void castle_rook(Color us, Square king_to, bool undo);
+        void add_state_keys();
+
+        Piece _pieces[Square_NB]{};
+        Bitboard by_Type_BB[Piece_Type_NB]{};
+        Bitboard by_Color_BB[Color_NB]{};
+        Color _side_to_move = White;
+        int _game_ply = 0;
+        bool _flipped = false;
 
-        Piece _pieces[Square_NB];
-        Bitboard by_Type_BB[Piece_Type_NB];
-        Bitboard by_Color_BB[Color_NB];
-        Color _side_to_move;
+        StateInfo root_state;
+        StateInfo *st = &root_state;
     };
 
+    // Number of each Piece in the placement field of FEN, counted on the
+    // text without building a Position
+    void fen_piece_counts(std::string_view FEN, u8 counts[Piece_NB]);
+
     inline Color Position::side_to_move() const { return _side_to_move; }
 
+    inline Key Position::key() const { return st->key; }
+
+    inline bool Position::flipped() const { return _flipped; }
+
+    inline int Position::castling_rights() const { return st->castling_rights; }
+
+    inline bool Position::can_castle(CastlingRights cr) const { return st->castling_rights & cr; }
+
+    inline Square Position::ep_square() const { return st->ep_square; }
+
+    inline int Position::rule50_count() const { return st->rule50; }
+
+    inline int Position::game_ply() const { return _game_ply; }
+
+    inline Piece Position::captured_piece() const { return st->captured; }
+
     inline Piece Position::piece_on(Square s) const {
         assert(is_ok(s));
         return _pieces[s];
@@ -59,11 +200,21 @@ namespace Chess {
 
     inline Bitboard Position::pieces(Color c) const { return by_Color_BB[c]; }
 
+    inline Bitboard Position::pieces(Color c, PieceType pt) const { return by_Color_BB[c] & by_Type_BB[pt]; }
+
+    inline Bitboard Position::attackers_to(Square s) const { return attackers_to(s, pieces()); }
+
+    inline Square Position::king_square(Color c) const {
+        assert(pieces(c, King));
+        return lsb(pieces(c, King));
+    }
+
 
     inline void Position::put_piece(Piece pc, Square s) {
         _pieces[s] = pc;
         by_Type_BB[All_Pieces] |= by_Type_BB[typeof_piece(pc)] |= s;
         by_Color_BB[color_of(pc)] |= s;
+        st->key ^= Zobrist::KEYS.psq[pc][s];
     }
 
     inline void Position::remove_piece(Square s) {
@@ -72,6 +223,7 @@ namespace Chess {
         by_Type_BB[typeof_piece(pc)] ^= s;
         by_Color_BB[color_of(pc)] ^= s;
         _pieces[s] = No_Piece;
+        st->key ^= Zobrist::KEYS.psq[pc][s];
     }
 
     inline void Position::move_piece(Square from, Square to) {
@@ -83,6 +235,25 @@ namespace Chess {
         by_Color_BB[color_of(pc)] ^= fromTo;
         _pieces[from] = No_Piece;
         _pieces[to] = pc;
+        st->key ^= Zobrist::KEYS.psq[pc][from] ^ Zobrist::KEYS.psq[pc][to];
+    }
+
+    // Only the squares occupied so far are reset, which is a handful of
+    // stores instead of wiping the whole object
+    inline void Position::clear() {
+        Bitboard occupied = by_Type_BB[All_Pieces];
+        while (occupied)
+            _pieces[pop_lsb(occupied)] = No_Piece;
+
+        for (Bitboard &b : by_Type_BB)
+            b = 0;
+        by_Color_BB[White] = by_Color_BB[Black] = 0;
+
+        _side_to_move = White;
+        _game_ply = 0;
+        _flipped = false;
+        root_state = StateInfo();
+        st = &root_state;
     }
 
     inline void Position::swap_piece(Square s, Piece pc) {
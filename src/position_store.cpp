@@ -0,0 +1,225 @@
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "position_store.h"
+
+namespace Chess
+{
+
+    namespace {
+
+        constexpr char STORE_MAGIC[8] = {'L', 'P', 'Z', 'P', 'O', 'S', '\0', '\0'};
+        constexpr u32 STORE_VERSION = 3;
+
+        constexpr size_t align8(size_t n) { return (n + 7) & ~size_t(7); }
+
+        struct ColumnLayout
+        {
+            size_t occupancy;
+            size_t codes;
+            size_t sides;
+            size_t castling;
+            size_t ep_squares;
+            size_t captured;
+            size_t move_index;
+            size_t moves;
+            size_t end;
+        };
+
+        ColumnLayout column_layout(size_t nb_positions, size_t nb_moves)
+        {
+            ColumnLayout l;
+            l.occupancy = align8(sizeof(PositionStoreHeader));
+            l.codes = align8(l.occupancy + nb_positions * sizeof(u64));
+            l.sides = align8(l.codes + nb_positions * PACKED_CODES_SIZE);
+            l.castling = align8(l.sides + nb_positions);
+            l.ep_squares = align8(l.castling + nb_positions);
+            l.captured = align8(l.ep_squares + nb_positions);
+            l.move_index = align8(l.captured + nb_positions);
+            l.moves = align8(l.move_index + (nb_positions + 1) * sizeof(u32));
+            l.end = l.moves + nb_moves * sizeof(u16);
+            return l;
+        }
+
+        bool csv_stamp(const std::string &csv_path, u64 &size, i64 &mtime)
+        {
+            std::error_code ec;
+            size = std::filesystem::file_size(csv_path, ec);
+            if (ec)
+                return false;
+            mtime = static_cast<i64>(std::filesystem::last_write_time(csv_path, ec).time_since_epoch().count());
+            return !ec;
+        }
+
+        template <typename T>
+        void write_column(std::ofstream &out, size_t offset, const std::vector<T> &column)
+        {
+            while (size_t(out.tellp()) < offset)
+                out.put('\0');
+            out.write(reinterpret_cast<const char *>(column.data()), column.size() * sizeof(T));
+        }
+    }
+
+    bool PositionStore::open(const std::string &path, const std::string &csv_path)
+    {
+        close();
+
+        if (!file.open(path))
+            return false;
+
+        PositionStoreHeader header;
+        u64 csv_size;
+        i64 csv_mtime;
+
+        if (file.get_size() < sizeof(header) || !csv_stamp(csv_path, csv_size, csv_mtime))
+        {
+            close();
+            return false;
+        }
+        std::memcpy(&header, file.begin(), sizeof(header));
+
+        const ColumnLayout l = column_layout(header.nb_positions, header.nb_moves);
+
+        if (std::memcmp(header.magic, STORE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != STORE_VERSION ||
+            header.csv_size != csv_size ||
+            header.csv_mtime != csv_mtime ||
+            file.get_size() != l.end)
+        {
+            close();
+            return false;
+        }
+
+        const char *base = file.begin();
+        occupancy = reinterpret_cast<const u64 *>(base + l.occupancy);
+        codes = reinterpret_cast<const u8 *>(base + l.codes);
+        sides = reinterpret_cast<const u8 *>(base + l.sides);
+        castling = reinterpret_cast<const u8 *>(base + l.castling);
+        ep_squares = reinterpret_cast<const u8 *>(base + l.ep_squares);
+        captured = reinterpret_cast<const u8 *>(base + l.captured);
+        move_index = reinterpret_cast<const u32 *>(base + l.move_index);
+        move_data = reinterpret_cast<const u16 *>(base + l.moves);
+        nb_positions = header.nb_positions;
+
+        file.advise(Test::Access::Sequential);
+        return true;
+    }
+
+    void PositionStore::close()
+    {
+        file.close();
+        occupancy = nullptr;
+        codes = nullptr;
+        sides = nullptr;
+        castling = nullptr;
+        ep_squares = nullptr;
+        captured = nullptr;
+        move_index = nullptr;
+        move_data = nullptr;
+        nb_positions = 0;
+    }
+
+    bool write_position_store(Test::LichessDbPuzzle &db, const std::string &path, const std::string &csv_path)
+    {
+        PositionStoreHeader header{};
+        std::memcpy(header.magic, STORE_MAGIC, sizeof(header.magic));
+        header.version = STORE_VERSION;
+
+        if (!csv_stamp(csv_path, header.csv_size, header.csv_mtime))
+            return false;
+
+        std::vector<u64> occupancy;
+        std::vector<u8> codes;
+        std::vector<u8> sides;
+        std::vector<u8> castling;
+        std::vector<u8> ep_squares;
+        std::vector<u8> captured;
+        std::vector<u32> move_index;
+        std::vector<u16> moves;
+
+        Position p;
+
+        move_index.push_back(0);
+
+        auto push_position = [&]() {
+            occupancy.push_back(p.pieces());
+            codes.resize(codes.size() + PACKED_CODES_SIZE, 0);
+            p.pack(&codes[codes.size() - PACKED_CODES_SIZE]);
+            sides.push_back(u8(p.side_to_move()));
+            castling.push_back(u8(p.castling_rights()));
+            ep_squares.push_back(u8(p.ep_square()));
+            captured.push_back(u8(p.captured_piece()));
+        };
+
+        db.pass_FEN_and_moves([&](std::string_view FEN, std::string_view line, size_t) {
+            p.set(FEN);
+
+            // Later moves are replayed too, their castling, en passant and
+            // promotion types depend on the position they are played in
+            bool first = true;
+            while (!line.empty())
+            {
+                size_t space = line.find(' ');
+                std::string_view uci = line.substr(0, space);
+                line = space == std::string_view::npos ? std::string_view() : line.substr(space + 1);
+
+                if (uci.empty())
+                    continue;
+
+                Move m = p.parse_uci(uci);
+
+                if (first)
+                {
+                    p.make_move(m);
+                    push_position();
+                }
+                else
+                {
+                    moves.push_back(m.raw());
+                    p.make_move(m);
+                }
+                first = false;
+            }
+
+            // No moves at all, the position is stored as is
+            if (first)
+                push_position();
+
+            move_index.push_back(u32(moves.size()));
+        });
+
+        header.nb_positions = occupancy.size();
+        header.nb_moves = moves.size();
+
+        const ColumnLayout l = column_layout(header.nb_positions, header.nb_moves);
+
+        const std::string tmp_path = path + ".tmp";
+        {
+            std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+            if (!out)
+                return false;
+
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            write_column(out, l.occupancy, occupancy);
+            write_column(out, l.codes, codes);
+            write_column(out, l.sides, sides);
+            write_column(out, l.castling, castling);
+            write_column(out, l.ep_squares, ep_squares);
+            write_column(out, l.captured, captured);
+            write_column(out, l.move_index, move_index);
+            write_column(out, l.moves, moves);
+
+            if (!out)
+                return false;
+        }
+
+        std::error_code ec;
+        std::filesystem::rename(tmp_path, path, ec);
+
+        std::cout << "Packed " << header.nb_positions << " positions, " << header.nb_moves << " moves into " << path << std::endl;
+        return !ec;
+    }
+}
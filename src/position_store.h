@@ -0,0 +1,81 @@
+#pragma once
+
+#include <span>
+#include <string>
+
+#include "types.h"
+#include "position.h"
+#include "test.h"
+
+namespace Chess {
+
+    // Columnar binary copy of the puzzle positions, each one stored with its
+    // first move already applied. The file is the header followed by these
+    // columns, each starting on an 8 byte boundary:
+    //
+    //   occupancy   u64[nb_positions]
+    //   codes       u8[nb_positions][16]   see Position::pack
+    //   side        u8[nb_positions]
+    //   castling    u8[nb_positions]       CastlingRights
+    //   ep_square   u8[nb_positions]       Sq_None if there is none
+    //   captured    u8[nb_positions]       Piece the first move took, No_Piece if none
+    //   move_index  u32[nb_positions + 1]  start of each row in moves
+    //   moves       u16[nb_moves]          remaining solution moves, Move::raw
+    struct PositionStoreHeader
+    {
+        char magic[8];
+        u32 version;
+        u32 reserved;
+        u64 csv_size;
+        i64 csv_mtime;
+        u64 nb_positions;
+        u64 nb_moves;
+    };
+
+    constexpr size_t PACKED_CODES_SIZE = 16;
+
+    class PositionStore
+    {
+    public:
+        // Fails if the store is missing, malformed or older than csv_path
+        bool open(const std::string &path, const std::string &csv_path);
+        void close();
+
+        bool valid() const { return file.valid(); }
+        size_t size() const { return nb_positions; }
+
+        void get(size_t index, Position &p) const;
+
+        // Solution moves after the first, which get() has already applied
+        std::span<const u16> moves(size_t index) const;
+
+    private:
+        Test::MemoryMappedFile file;
+
+        const u64 *occupancy = nullptr;
+        const u8 *codes = nullptr;
+        const u8 *sides = nullptr;
+        const u8 *castling = nullptr;
+        const u8 *ep_squares = nullptr;
+        const u8 *captured = nullptr;
+        const u32 *move_index = nullptr;
+        const u16 *move_data = nullptr;
+        size_t nb_positions = 0;
+    };
+
+    // One text pass over db, parsing every FEN and move list once
+    bool write_position_store(Test::LichessDbPuzzle &db, const std::string &path, const std::string &csv_path);
+
+    inline void PositionStore::get(size_t index, Position &p) const
+    {
+        assert(index < nb_positions);
+        p.set(occupancy[index], codes + index * PACKED_CODES_SIZE, Color(sides[index]),
+              castling[index], Square(ep_squares[index]), Piece(captured[index]));
+    }
+
+    inline std::span<const u16> PositionStore::moves(size_t index) const
+    {
+        assert(index < nb_positions);
+        return std::span<const u16>(move_data + move_index[index], move_data + move_index[index + 1]);
+    }
+}
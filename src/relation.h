@@ -12,9 +12,17 @@ namespace Chess {
         KnightInstance, // indexed by knight_instance_id
         BishopInstance,
         RookInstance,
-        QueenInstance
+        QueenInstance,
+        PieceInstance   // any piece, indexed by piece id like the above
     };
 
+    // Whether a feature of domain feature holds on the pieces at an end of
+    // domain relation_end
+    constexpr bool domain_holds(FeatureDomain relation_end, FeatureDomain feature)
+    {
+        return relation_end == feature || (relation_end == FeatureDomain::PieceInstance && feature != FeatureDomain::Position);
+    }
+
 
 
     struct PositionTag {};
@@ -23,6 +31,7 @@ namespace Chess {
     struct RookTag {};
     struct QueenTag {};
     struct MoveTag {};
+    struct PieceTag {};
 
 
     /*
@@ -70,6 +79,10 @@ namespace Chess {
             return edges.size();
         }
 
+        void append(const Relation &other) {
+            edges.insert(edges.end(), other.edges.begin(), other.edges.end());
+        }
+
         private:
         std::vector<Edge> edges;
     };
@@ -92,6 +105,10 @@ namespace Chess {
         Knight_Defends_Bishop,
         Bishop_Defends_Knight,
         Knight_Attacks_Knight,
+        Queen_Attacks_Queen,
+        Xrays_Through,
+        Pinned_To,
+        Discovered_Attack_On,
     };
 
     struct RelationInfo {
@@ -108,13 +125,104 @@ namespace Chess {
             FeatureDomain::KnightInstance,
             FeatureDomain::BishopInstance,
             "knight_defends_bishop"
+        },
+        {
+            RelationID::Queen_Attacks_Queen,
+            FeatureDomain::QueenInstance,
+            FeatureDomain::QueenInstance,
+            "queen_attacks_queen"
+        },
+        {
+            RelationID::Xrays_Through,
+            FeatureDomain::PieceInstance,
+            FeatureDomain::PieceInstance,
+            "xrays_through"
+        },
+        {
+            RelationID::Pinned_To,
+            FeatureDomain::PieceInstance,
+            FeatureDomain::PieceInstance,
+            "pinned_to"
+        },
+        {
+            RelationID::Discovered_Attack_On,
+            FeatureDomain::PieceInstance,
+            FeatureDomain::PieceInstance,
+            "discovered_attack_on"
         }
     };
 
+    // Registry entry by id, nullptr if there is none
+    constexpr const RelationInfo *find_relation(RelationID id)
+    {
+        for (const auto &info : RELATION_REGISTRY)
+            if (info.id == id)
+                return &info;
+        return nullptr;
+    }
+
+    constexpr bool is_registered(RelationID id)
+    {
+        return find_relation(id) != nullptr;
+    }
+
 
     struct RelationStorage {
         Relation<KnightTag, BishopTag> knight_defends_bishop;
         Relation<QueenTag, QueenTag> queen_attacks_queen;
+
+        // Lines through exactly one piece from a slider to an enemy piece.
+        // xrays_through is (slider, target), the one piece between them is
+        // the blocker. pinned_to is (blocker, target) for an enemy blocker
+        // other than the king shielding its king, or its queen from a rook
+        // or bishop; discovered_attack_on is (blocker, target) for a blocker
+        // of the slider's own colour.
+        Relation<PieceTag, PieceTag> xrays_through;        // slider, target
+        Relation<PieceTag, PieceTag> pinned_to;            // blocker, king or queen
+        Relation<PieceTag, PieceTag> discovered_attack_on; // blocker, target
+
+        // Edges of a registered relation, typed by its domains
+        template <RelationID id>
+        const auto &get() const {
+            if constexpr (id == RelationID::Knight_Defends_Bishop)
+                return knight_defends_bishop;
+            else if constexpr (id == RelationID::Queen_Attacks_Queen)
+                return queen_attacks_queen;
+            else if constexpr (id == RelationID::Xrays_Through)
+                return xrays_through;
+            else if constexpr (id == RelationID::Pinned_To)
+                return pinned_to;
+            else {
+                static_assert(id == RelationID::Discovered_Attack_On, "relation has no storage");
+                return discovered_attack_on;
+            }
+        }
+
+        void append(const RelationStorage &other) {
+            knight_defends_bishop.append(other.knight_defends_bishop);
+            queen_attacks_queen.append(other.queen_attacks_queen);
+            xrays_through.append(other.xrays_through);
+            pinned_to.append(other.pinned_to);
+            discovered_attack_on.append(other.discovered_attack_on);
+        }
+    };
+
+
+    // Edges between the pieces of a row at ply k and at ply k + 1, piece ids
+    // as numbered by each ply's BitsetManager. same_piece and moved go from
+    // ply k to ply k + 1; captured and recaptured_by stay within ply k.
+    struct TemporalRelations {
+        Relation<PieceTag, PieceTag> same_piece;    // every piece still on the board
+        Relation<PieceTag, PieceTag> moved;         // the pieces move k moved
+        Relation<PieceTag, PieceTag> captured;      // capturer, captured piece
+        Relation<PieceTag, PieceTag> recaptured_by; // piece that captured on move k - 1, its capturer
+
+        void append(const TemporalRelations &other) {
+            same_piece.append(other.same_piece);
+            moved.append(other.moved);
+            captured.append(other.captured);
+            recaptured_by.append(other.recaptured_by);
+        }
     };
 
 
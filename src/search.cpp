@@ -0,0 +1,289 @@
+#include <algorithm>
+
+#include "search.h"
+#include "movegen.h"
+
+namespace Chess
+{
+
+    namespace {
+
+        bool in_check(const Position &p)
+        {
+            const Color us = p.side_to_move();
+            return p.attackers_to(p.king_square(us)) & p.pieces(~us);
+        }
+
+        bool is_capture(const Position &p, Move m)
+        {
+            return m.type_of() == EN_PASSANT || (m.type_of() != CASTLING && !p.empty(m.to_sq()));
+        }
+
+        // Most valuable victim first, the cheaper attacker breaking ties.
+        // Promotions count the piece they make.
+        int mvv_lva(const Position &p, Move m)
+        {
+            int score = 0;
+
+            if (m.type_of() == EN_PASSANT)
+                score = PawnValue * 8;
+            else if (is_capture(p, m))
+                score = PieceValue[p.piece_on(m.to_sq())] * 8;
+
+            if (m.type_of() == PROMOTION)
+                score += PieceValue[m.promotion_type()] * 8;
+
+            return score - typeof_piece(p.piece_on(m.from_sq()));
+        }
+
+        // Mates are stored as plies from the node, not from the root
+        int value_to_tt(int v, int ply)
+        {
+            return v >= VALUE_MATE - MAX_PLY ? v + ply : v <= -VALUE_MATE + MAX_PLY ? v - ply : v;
+        }
+
+        int value_from_tt(int v, int ply)
+        {
+            return v >= VALUE_MATE - MAX_PLY ? v - ply : v <= -VALUE_MATE + MAX_PLY ? v + ply : v;
+        }
+    }
+
+    int material_balance(const Position &p)
+    {
+        const Color us = p.side_to_move();
+
+        int balance = 0;
+        for (PieceType pt : {Pawn, Knight, Bishop, Rook, Queen})
+            balance += (popcount(p.pieces(us, pt)) - popcount(p.pieces(~us, pt))) * PieceValue[pt];
+        return balance;
+    }
+
+    TranspositionTable::TranspositionTable(size_t log2_entries)
+        : entries(size_t(1) << log2_entries), mask((u64(1) << log2_entries) - 1)
+    {
+        clear();
+    }
+
+    const TTEntry *TranspositionTable::probe(Key key) const
+    {
+        const TTEntry &e = entries[key & mask];
+        return e.key == key && e.bound != BOUND_NONE ? &e : nullptr;
+    }
+
+    void TranspositionTable::store(Key key, int value, int depth, Bound bound, Move m)
+    {
+        entries[key & mask] = {key, i16(value), i8(depth), bound, m.raw()};
+    }
+
+    void TranspositionTable::clear()
+    {
+        std::fill(entries.begin(), entries.end(), TTEntry{0, 0, 0, BOUND_NONE, 0});
+    }
+
+    TacticalSearch::TacticalSearch(SearchLimits limits, size_t log2_tt_entries)
+        : limits(limits), tt(log2_tt_entries)
+    {
+    }
+
+    TacticalSearch::Result TacticalSearch::search(Position &p)
+    {
+        nodes = 0;
+        stopped = false;
+
+        const int value = alpha_beta(p, -VALUE_INFINITE, VALUE_INFINITE, limits.depth, 0);
+        return {value, nodes, !stopped};
+    }
+
+    bool TacticalSearch::wins_material(Position &p, int margin)
+    {
+        // What the last move took is ours again as far as the baseline goes
+        const int before = material_balance(p) + PieceValue[p.captured_piece()];
+
+        const Result r = search(p);
+        return r.complete && r.value >= before + margin;
+    }
+
+    bool TacticalSearch::out_of_budget()
+    {
+        if (++nodes > limits.node_budget)
+            stopped = true;
+        return stopped;
+    }
+
+    Move *TacticalSearch::pick_moves(const Position &p, Move *first, Move *last, Move tt_move, bool all) const
+    {
+        if (!all)
+            last = std::remove_if(first, last, [&p](Move m) {
+                return !is_capture(p, m) && m.type_of() != PROMOTION;
+            });
+
+        int scores[MAX_MOVES];
+        for (Move *m = first; m != last; ++m)
+            scores[m - first] = m->raw() == tt_move.raw() ? VALUE_INFINITE : mvv_lva(p, *m);
+
+        // Insertion sort, the lists are short
+        for (int i = 1; i < last - first; i++)
+        {
+            const Move m = first[i];
+            const int score = scores[i];
+
+            int j = i - 1;
+            for (; j >= 0 && scores[j] < score; j--)
+            {
+                first[j + 1] = first[j];
+                scores[j + 1] = scores[j];
+            }
+            first[j + 1] = m;
+            scores[j + 1] = score;
+        }
+        return last;
+    }
+
+    int TacticalSearch::alpha_beta(Position &p, int alpha, int beta, int depth, int ply)
+    {
+        if (depth <= 0)
+            return qsearch(p, alpha, beta, ply);
+
+        if (out_of_budget())
+            return 0;
+
+        if (ply >= MAX_PLY)
+            return material_balance(p);
+
+        const int alpha_orig = alpha;
+        Move tt_move = Move::none();
+
+        if (const TTEntry *e = tt.probe(p.key()))
+        {
+            tt_move = Move(e->move);
+            const int v = value_from_tt(e->value, ply);
+
+            if (e->depth >= depth
+                && (e->bound == BOUND_EXACT
+                    || (e->bound == BOUND_LOWER && v >= beta)
+                    || (e->bound == BOUND_UPPER && v <= alpha)))
+                return v;
+        }
+
+        Move moves[MAX_MOVES];
+        Move *last = generate_legal(p, moves);
+        const bool checked = in_check(p);
+
+        if (last == moves)
+            return checked ? -VALUE_MATE + ply : 0;
+
+        // Below the full width plies standing pat is allowed unless in
+        // check, and quiet moves that do not check are not looked at
+        const bool full_width = ply < limits.full_width;
+
+        int best = checked || full_width ? -VALUE_INFINITE : material_balance(p);
+        if (best >= beta)
+            return best;
+        alpha = std::max(alpha, best);
+
+        last = pick_moves(p, moves, last, tt_move, true);
+
+        Move best_move = Move::none();
+        StateInfo st;
+
+        for (Move *m = moves; m != last; ++m)
+        {
+            const bool tactical = full_width || checked || is_capture(p, *m) || m->type_of() == PROMOTION;
+
+            p.do_move(*m, st);
+
+            if (!tactical && !in_check(p))
+            {
+                p.undo_move(*m);
+                continue;
+            }
+
+            const int v = -alpha_beta(p, -beta, -alpha, depth - 1, ply + 1);
+            p.undo_move(*m);
+
+            if (stopped)
+                return 0;
+
+            if (v > best)
+            {
+                best = v;
+                best_move = *m;
+
+                if (v > alpha)
+                    alpha = v;
+                if (alpha >= beta)
+                    break;
+            }
+        }
+
+        const Bound bound = best >= beta ? BOUND_LOWER : best > alpha_orig ? BOUND_EXACT : BOUND_UPPER;
+        tt.store(p.key(), value_to_tt(best, ply), depth, bound, best_move);
+        return best;
+    }
+
+    int TacticalSearch::qsearch(Position &p, int alpha, int beta, int ply)
+    {
+        if (out_of_budget())
+            return 0;
+
+        if (ply >= MAX_PLY)
+            return material_balance(p);
+
+        const int alpha_orig = alpha;
+        Move tt_move = Move::none();
+
+        // Any depth is enough for a quiescence node
+        if (const TTEntry *e = tt.probe(p.key()))
+        {
+            tt_move = Move(e->move);
+            const int v = value_from_tt(e->value, ply);
+
+            if (e->bound == BOUND_EXACT
+                || (e->bound == BOUND_LOWER && v >= beta)
+                || (e->bound == BOUND_UPPER && v <= alpha))
+                return v;
+        }
+
+        Move moves[MAX_MOVES];
+        Move *last = generate_legal(p, moves);
+        const bool checked = in_check(p);
+
+        if (last == moves)
+            return checked ? -VALUE_MATE + ply : 0;
+
+        int best = checked ? -VALUE_INFINITE : material_balance(p);
+        if (best >= beta)
+            return best;
+        alpha = std::max(alpha, best);
+
+        last = pick_moves(p, moves, last, tt_move, checked);
+
+        Move best_move = Move::none();
+        StateInfo st;
+
+        for (Move *m = moves; m != last; ++m)
+        {
+            p.do_move(*m, st);
+            const int v = -qsearch(p, -beta, -alpha, ply + 1);
+            p.undo_move(*m);
+
+            if (stopped)
+                return 0;
+
+            if (v > best)
+            {
+                best = v;
+                best_move = *m;
+
+                if (v > alpha)
+                    alpha = v;
+                if (alpha >= beta)
+                    break;
+            }
+        }
+
+        const Bound bound = best >= beta ? BOUND_LOWER : best > alpha_orig ? BOUND_EXACT : BOUND_UPPER;
+        tt.store(p.key(), value_to_tt(best, ply), 0, bound, best_move);
+        return best;
+    }
+}
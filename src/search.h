@@ -0,0 +1,103 @@
+#pragma once
+
+#include <vector>
+
+#include "types.h"
+#include "moves.h"
+#include "position.h"
+
+namespace Chess {
+
+    // Centipawns from the side to move's point of view. Mates are scored
+    // VALUE_MATE minus the plies to mate.
+    constexpr int VALUE_MATE = 32000;
+    constexpr int VALUE_INFINITE = 32001;
+    constexpr int MAX_PLY = 64;
+
+    // Material of the side to move minus the other side's, kings left out
+    int material_balance(const Position &p);
+
+    enum Bound : u8 {
+        BOUND_NONE,
+        BOUND_UPPER,
+        BOUND_LOWER,
+        BOUND_EXACT = BOUND_UPPER | BOUND_LOWER
+    };
+
+    struct TTEntry
+    {
+        Key key;
+        i16 value;
+        i8 depth;
+        Bound bound;
+        u16 move;
+    };
+
+    // Always replace table indexed by the low bits of the key. Not shared,
+    // each thread owns its own.
+    class TranspositionTable
+    {
+    public:
+        explicit TranspositionTable(size_t log2_entries = 16);
+
+        // Entry stored for key, nullptr if the slot holds another position
+        const TTEntry *probe(Key key) const;
+        void store(Key key, int value, int depth, Bound bound, Move m);
+        void clear();
+
+    private:
+        std::vector<TTEntry> entries;
+        u64 mask;
+    };
+
+    struct SearchLimits
+    {
+        int full_width = 2;
+        int depth = 4;
+        u64 node_budget = 50000;
+    };
+
+    // Alpha-beta over every move for the first full_width plies, over
+    // captures, promotions and checking moves down to depth, then over
+    // captures and promotions until the position is quiet. The full width
+    // plies let a quiet first move and the answer to it be found, standing
+    // pat is only allowed below them. Every move of a side in check is
+    // searched. Moves are tried
+    // transposition table move first, then most valuable victim by least
+    // valuable attacker. The search gives up once node_budget nodes were
+    // visited, the result is then incomplete and its value meaningless.
+    class TacticalSearch
+    {
+    public:
+        struct Result
+        {
+            int value;
+            u64 nodes;
+            bool complete;
+        };
+
+        explicit TacticalSearch(SearchLimits limits = SearchLimits(), size_t log2_tt_entries = 16);
+
+        Result search(Position &p);
+
+        // Whether the side to move ends at least margin above the material
+        // it had before the move that led to p, a mate included. A search
+        // out of budget has not shown the gain and counts as a no.
+        bool wins_material(Position &p, int margin = PawnValue);
+
+    private:
+        int alpha_beta(Position &p, int alpha, int beta, int depth, int ply);
+        int qsearch(Position &p, int alpha, int beta, int ply);
+
+        // Keeps the moves worth searching at depth and sorts them, returns
+        // the new end. Quiet checks are left to the caller to find.
+        Move *pick_moves(const Position &p, Move *first, Move *last, Move tt_move, bool all) const;
+
+        bool out_of_budget();
+
+        SearchLimits limits;
+        TranspositionTable tt;
+        u64 nodes = 0;
+        bool stopped = false;
+    };
+}
@@ -0,0 +1,903 @@
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+#include <unistd.h>
+
+#include "bitboard.h"
+#include "matcher.h"
+#include "movegen.h"
+#include "pgn.h"
+#include "position.h"
+#include "position_store.h"
+#include "search.h"
+#include "stream.h"
+#include "witness_line.h"
+#include "test.h"
+
+
+namespace {
+
+    // Scratch files of the checks, removed when the run ends
+    class ScratchDir
+    {
+    public:
+        ScratchDir()
+            : path(std::filesystem::temp_directory_path() / ("puzzle-selftest-" + std::to_string(getpid())))
+        {
+            std::filesystem::create_directories(path);
+        }
+
+        ~ScratchDir()
+        {
+            std::error_code ec;
+            std::filesystem::remove_all(path, ec);
+        }
+
+        std::string file(const std::string &name) const { return (path / name).string(); }
+
+        std::string write(const std::string &name, std::string_view text) const
+        {
+            std::ofstream out(file(name), std::ios::binary | std::ios::trunc);
+            out.write(text.data(), text.size());
+            return file(name);
+        }
+
+    private:
+        std::filesystem::path path;
+    };
+
+    // Prints what went wrong and returns ok, for chaining with &=
+    bool expect(bool ok, const std::string &what)
+    {
+        if (!ok)
+            std::cout << "     " << what << std::endl;
+        return ok;
+    }
+
+    // The first move of each row takes something, or castles, so the
+    // baseline of wins_material depends on what the packed store kept.
+    //   knight taken, only a pawn back     no
+    //   queen takes a defended pawn        yes
+    //   castling                           no
+    //   the dataset's queen trade          yes
+    constexpr std::string_view STORE_CSV =
+        "00001,4k3/8/2p5/3n4/4P3/8/8/4K3 w - - 0 1,e4d5 c6d5,1000,75,90,100,crushing,https://lichess.org/a,\n"
+        "00002,4k3/8/2p5/3p4/8/8/3Q4/4K3 w - - 0 1,d2d5 c6d5,1000,75,90,100,crushing,https://lichess.org/b,\n"
+        "00003,4k3/8/8/8/8/8/8/4K2R w K - 0 1,e1g1 e8d7,1000,75,90,100,endgame,https://lichess.org/c,\n"
+        "0000D,5rk1/1p3ppp/pq3b2/8/8/1P1Q1N2/P4PPP/3R2K1 w - - 2 27,d3d6 f8d8 d6d8 f6d8,1580,73,95,8225,advantage,https://lichess.org/F8M8OS71#53,\n";
+
+    bool check_store_wins(const ScratchDir &dir)
+    {
+        using namespace Chess;
+
+        const std::string csv_path = dir.write("store.csv", STORE_CSV);
+        const std::string store_path = dir.file("store.pos");
+
+        Test::LichessDbPuzzle db;
+        if (!expect(db.open_and_build_index(csv_path) == 0, "cannot index " + csv_path))
+            return false;
+        if (!expect(write_position_store(db, store_path, csv_path), "cannot write " + store_path))
+            return false;
+
+        PositionStore store;
+        if (!expect(store.open(store_path, csv_path), "cannot open " + store_path))
+            return false;
+
+        const std::vector<bool> expected = {false, true, false, true};
+        std::vector<bool> from_csv;
+
+        TacticalSearch search;
+        Position p;
+
+        db.pass_FEN_and_first_UCI([&](std::string_view FEN, std::string_view UCI, size_t) {
+            p.set_and_move(FEN, UCI);
+            from_csv.push_back(search.wins_material(p));
+        });
+
+        bool ok = expect(store.size() == expected.size() && from_csv == expected, "CSV rows disagree with the expected wins");
+
+        for (size_t k = 0; k < store.size() && k < from_csv.size(); k++)
+        {
+            store.get(k, p);
+            ok &= expect(search.wins_material(p) == from_csv[k], "packed row " + std::to_string(k) + " disagrees with the CSV");
+        }
+
+        // Out of budget is not a win, whatever the value it stopped at
+        TacticalSearch starved(SearchLimits{2, 4, 8});
+        store.get(1, p);
+        ok &= expect(!starved.wins_material(p), "a search out of budget counted as verified");
+
+        return ok;
+    }
+
+    // Puzzle rows from the dataset, the second half appended to the CSV
+    // after the first is indexed. Its last row repeats a first half
+    // position, which has to fold into the earlier row across the append.
+    constexpr std::string_view APPEND_CSV_HEAD =
+        "00008,r6k/pp2r2p/4Rp1Q/3p4/8/1N1P2R1/PqP2bPP/7K b - - 0 24,f2g3 e6e7 b2b1 b3c1 b1c1 h6c1,1913,75,94,5767,crushing,https://lichess.org/787zsVup/black#47,\n"
+        "0000D,5rk1/1p3ppp/pq3b2/8/8/1P1Q1N2/P4PPP/3R2K1 w - - 2 27,d3d6 f8d8 d6d8 f6d8,1580,73,95,8225,advantage,https://lichess.org/F8M8OS71#53,\n"
+        "0008Q,8/4R3/1p2P3/p4r2/P6p/1P3Pk1/4K3/8 w - - 1 64,e7f7 f5e5 e2f1 e5e6,1330,74,95,1300,endgame,https://lichess.org/MQSyb3KW#127,\n"
+        "000Vc,r2qr1k1/b1p2ppp/pp4n1/P1P1p3/4P1n1/B2P2Pb/3NBP1P/RN1QR1K1 b - - 1 16,b6c5 e2g4 h3g4 d1g4,1500,76,92,560,middlegame,https://lichess.org/ZnP6TtrA/black#32,\n"
+        "000Qe,rnb1kbnr/pppp1ppp/8/4p3/4P2q/8/PPPPQPPP/RNB1KBNR w KQkq - 2 3,g2g3 h4e4 e2e4,900,80,90,100,opening,https://lichess.org/abcdefgh#5,\n";
+
+    constexpr std::string_view APPEND_CSV_TAIL =
+        "001Qq,3r2k1/5ppp/8/2q5/8/2Q5/5PPP/3R2K1 w - - 0 30,h2h3 c5c3 d1d8,1200,80,90,100,endgame,https://lichess.org/qqqqqqqq#59,\n"
+        "002Nb,r1bqk2r/pppp1ppp/2n2n2/2b1p3/2B1P3/3P1N2/PPP2PPP/RNBQK2R w KQkq - 1 5,e1g1 f6g4 h2h3,1100,80,90,100,opening,https://lichess.org/nnnnnnnn#9,\n"
+        "003Ep,rnbqkbnr/ppp1p1pp/8/3pPp2/8/8/PPPP1PPP/RNBQKBNR w KQkq f6 0 3,e5f6 g8f6 d2d4,1000,80,90,100,opening,https://lichess.org/epepepep#5,\n"
+        "004Pr,8/P5k1/8/8/8/8/6K1/8 w - - 0 60,g2f3 g7f7 a7a8q,800,80,90,100,endgame,https://lichess.org/prprprpr#119,\n"
+        "0000E,5rk1/1p3ppp/pq3b2/8/8/1P1Q1N2/P4PPP/3R2K1 w - - 2 27,d3d6 f8d8 d6d8 f6d8,1580,73,95,8225,advantage,https://lichess.org/F8M8OS71#53,\n";
+
+    // Both passes over the rows from first_row on, a full build from row 0
+    // and an append pass after. Serial, so relation edges are in row order.
+    void ingest(Chess::BitsetManager &res, Test::LichessDbPuzzle &db, size_t first_row)
+    {
+        Chess::Position p;
+
+        auto pass = [&](auto &&visit) {
+            db.pass_FEN_and_first_UCI([&](std::string_view FEN, std::string_view UCI, size_t index) {
+                p.set_and_move(FEN, UCI);
+                visit(p, index);
+            }, first_row);
+        };
+
+        if (first_row == 0)
+            res.begin_first_pass();
+        else
+            res.begin_append_pass(db.row_count());
+
+        pass([&res](const Chess::Position &p, u64 index) { res.push_position_first_pass(p, index); });
+
+        if (first_row == 0)
+            res.end_first_pass();
+        else
+            res.end_append_pass();
+
+        res.begin_second_pass();
+        pass([&res](const Chess::Position &p, u64 index) {
+            if (res.is_canonical(index))
+                res.process_position_second_pass(p, index);
+        });
+        res.end_second_pass();
+    }
+
+    template <typename Rel>
+    bool same_edges(const Rel &a, const Rel &b)
+    {
+        return std::equal(a.data().begin(), a.data().end(), b.data().begin(), b.data().end(), [](const auto &x, const auto &y) {
+            return x.l == y.l && x.r == y.r;
+        });
+    }
+
+    bool check_append(const ScratchDir &dir)
+    {
+        using namespace Chess;
+
+        const std::string csv_path = dir.write("append.csv", APPEND_CSV_HEAD);
+
+        Test::LichessDbPuzzle db;
+        if (!expect(db.open_and_build_index(csv_path) == 0, "cannot index " + csv_path))
+            return false;
+
+        BitsetManager appended;
+        ingest(appended, db, 0);
+
+        {
+            std::ofstream out(csv_path, std::ios::binary | std::ios::app);
+            out.write(APPEND_CSV_TAIL.data(), APPEND_CSV_TAIL.size());
+        }
+
+        const size_t first_new = db.refresh();
+        bool ok = expect(first_new == 5 && db.row_count() == 10, "refresh did not pick up the appended rows");
+        ingest(appended, db, first_new);
+
+        // A fresh index over the whole file, not the sidecar refresh wrote
+        const std::string full_path = dir.write("full.csv", std::string(APPEND_CSV_HEAD) + std::string(APPEND_CSV_TAIL));
+
+        Test::LichessDbPuzzle full_db;
+        if (!expect(full_db.open_and_build_index(full_path) == 0, "cannot index " + full_path))
+            return false;
+
+        BitsetManager rebuilt;
+        ingest(rebuilt, full_db, 0);
+
+        ok &= expect(appended.row_count() == rebuilt.row_count() && appended.piece_count() == rebuilt.piece_count(),
+                     "row or piece counts differ");
+        if (!ok)
+            return false;
+
+        for (u64 row = 0; row < rebuilt.row_count(); row++)
+            ok &= expect(appended.canonical_row(row) == rebuilt.canonical_row(row), "row " + std::to_string(row) + " has another canonical row");
+        ok &= expect(rebuilt.canonical_row(9) == 1, "the repeated position was not folded");
+
+        for (const FeatureInfo &info : FEATURE_REGISTRY)
+        {
+            ok &= expect(appended.rows_with(info.id) == rebuilt.rows_with(info.id), std::string(info.name) + " rows differ");
+            if (info.domain != FeatureDomain::Position)
+                ok &= expect(appended.piece_features(info.id) == rebuilt.piece_features(info.id), std::string(info.name) + " pieces differ");
+        }
+
+        const RelationStorage &a = appended.relation_storage();
+        const RelationStorage &b = rebuilt.relation_storage();
+        ok &= expect(same_edges(a.knight_defends_bishop, b.knight_defends_bishop)
+                         && same_edges(a.queen_attacks_queen, b.queen_attacks_queen)
+                         && same_edges(a.xrays_through, b.xrays_through)
+                         && same_edges(a.pinned_to, b.pinned_to)
+                         && same_edges(a.discovered_attack_on, b.discovered_attack_on),
+                     "relation edges differ");
+
+        std::vector<u64> from_append, from_rebuild;
+        appended.full_query([&from_append](u64 row) { from_append.push_back(row); });
+        rebuilt.full_query([&from_rebuild](u64 row) { from_rebuild.push_back(row); });
+        ok &= expect(from_append == from_rebuild && from_rebuild == std::vector<u64>{1, 9}, "full_query answers differ");
+
+        return ok;
+    }
+
+    // Only a true append keeps the earlier rows, a CSV rewritten to any
+    // size is indexed again from row 0
+    bool check_refresh(const ScratchDir &dir)
+    {
+        const std::string head(APPEND_CSV_HEAD), tail(APPEND_CSV_TAIL);
+        const std::string path = dir.write("refresh.csv", head);
+
+        Test::LichessDbPuzzle db;
+        if (!expect(db.open_and_build_index(path) == 0, "cannot index " + path))
+            return false;
+
+        auto id = [&db](size_t row) { return std::string(db.get_view(row).id); };
+
+        bool ok = expect(db.refresh() == 5 && db.row_count() == 5, "an unchanged CSV gave new rows");
+
+        dir.write("refresh.csv", tail + head);
+        ok &= expect(db.refresh() == 0 && db.row_count() == 10 && id(0) == "001Qq" && id(5) == "00008",
+                     "a longer rewrite was taken for an append");
+
+        dir.write("refresh.csv", tail);
+        ok &= expect(db.refresh() == 0 && db.row_count() == 5 && id(4) == "0000E", "a shorter rewrite kept the old rows");
+
+        // Same length, one rating changed
+        std::string edited = tail;
+        edited.replace(edited.find(",1200,"), 6, ",1201,");
+        dir.write("refresh.csv", edited);
+        ok &= expect(db.refresh() == 0 && db.row_count() == 5 && db.get_view(0).full.find(",1201,") != std::string_view::npos,
+                     "a same length rewrite was not indexed again");
+
+        {
+            std::ofstream out(path, std::ios::binary | std::ios::app);
+            out.write(head.data(), head.size());
+        }
+        ok &= expect(db.refresh() == 5 && db.row_count() == 10 && id(4) == "0000E" && id(5) == "00008",
+                     "the append did not follow the earlier rows");
+
+        // The sidecar refresh wrote is the one the next open loads
+        Test::LichessDbPuzzle reopened;
+        if (!expect(reopened.open_and_build_index(path) == 0, "cannot reopen " + path))
+            return false;
+
+        ok &= expect(reopened.row_count() == 10, "the reopened index lost rows");
+        for (size_t row = 0; ok && row < 10; row++)
+            ok &= expect(reopened.get_view(row).id == id(row), "row " + std::to_string(row) + " differs after reopening");
+
+        return ok;
+    }
+
+    // The second game stops at 2. Ke3, which leaves two of its five rows
+    constexpr std::string_view PGN_GAMES =
+        "[Event \"a\"]\n\n1. e4 e5 2. Nf3 Nc6 3. Bb5 a6 *\n\n"
+        "[Event \"b\"]\n\n1. d4 d5 2. Ke3 Nf6 *\n\n"
+        "[Event \"c\"]\n\n1. Nf3 Nf6 2. g3 g6 3. Bg2 Bg7 4. O-O O-O *\n\n";
+
+    // A 9 square rank, a 9th rank, a side without its king, then a board
+    // that is fine
+    constexpr std::string_view PGN_FEN_GAMES =
+        "[FEN \"rnbqkbnr/pppppppp/9/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1\"]\n\n1. e4 e5 *\n\n"
+        "[FEN \"4k3/8/8/8/8/8/8/4K3/4K3 w - - 0 1\"]\n\n1. Kd2 *\n\n"
+        "[FEN \"8/8/8/8/8/8/8/4K3 w - - 0 1\"]\n\n1. Kd2 *\n\n"
+        "[FEN \"4k3/8/8/8/8/8/8/4K3 w - - 0 1\"]\n\n1. Kd2 Kd7 *\n\n";
+
+    bool check_pgn_pass(const ScratchDir &dir)
+    {
+        using namespace Chess;
+
+        std::string text;
+        for (int k = 0; k < 20; k++)
+            text += PGN_GAMES;
+        text += PGN_FEN_GAMES;
+        const std::string path = dir.write("games.pgn", text);
+
+        // Batches of a few games, so the workers share them out
+        PgnDatabase games;
+        if (!expect(games.open_and_build_index(path, 100), "cannot read " + path))
+            return false;
+
+        bool ok = expect(games.game_count() == 64 && games.row_count() == 20 * (7 + 5 + 9) + 3 + 2 + 2 + 3, "unexpected game or row count");
+        ok &= expect(games.batch_count() > 4, "too few batches to share out");
+
+        std::vector<std::vector<u64>> rows(games.batch_count());
+        const PgnPassStats stats = games.pass_positions([&rows](const Position &, u64 row, size_t batch) {
+            rows[batch].push_back(row);
+        }, 4);
+
+        ok &= expect(stats.read && stats.truncated_games == 20 + 3 && stats.skipped_rows == 40 + 7,
+                     "illegal moves or bad FEN tags not counted");
+
+        // Row order within each batch and from one batch to the next
+        std::vector<u64> all;
+        for (const auto &batch : rows)
+            all.insert(all.end(), batch.begin(), batch.end());
+
+        ok &= expect(std::is_sorted(all.begin(), all.end()) && std::adjacent_find(all.begin(), all.end()) == all.end(),
+                     "batches do not visit rows in order");
+        ok &= expect(all.size() == games.row_count() - stats.skipped_rows, "rows missed or visited twice");
+
+        return ok;
+    }
+
+    template <typename Rel>
+    bool has_edge(const Rel &rel, u64 l, u64 r)
+    {
+        return std::any_of(rel.data().begin(), rel.data().end(), [&](const auto &e) { return e.l == l && e.r == r; });
+    }
+
+    // exd5 cxd5 after a row of quiet moves, whose pieces come first in
+    // every ply. The pieces of the second row are, in square order,
+    //   ply 0   Ke1 Pe4 pd5 pc6 ke8
+    //   ply 1   Ke1 Pd5 pc6 ke8
+    //   ply 2   Ke1 pd5 ke8
+    bool check_temporal(const ScratchDir &)
+    {
+        using namespace Chess;
+
+        const std::pair<const char *, const char *> rows[] = {
+            {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", "g1f3 g8f6"},
+            {"4k3/8/2p5/3p4/4P3/8/8/4K3 w - - 0 1", "e4d5 c6d5"},
+        };
+
+        WitnessLineIndex lines(3, true);
+        Position p;
+
+        auto each_ply = [&](auto &&visit) {
+            for (u64 row = 0; row < 2; row++)
+            {
+                p.set(rows[row].first);
+                WitnessLineIndex::replay(p, std::string_view(rows[row].second), 3, [&](size_t ply, const Position &q, Move m) {
+                    visit(ply, q, m, row);
+                });
+            }
+        };
+
+        lines.begin_first_pass(2);
+        each_ply([&](size_t ply, const Position &q, Move, u64 row) { lines.push_position_first_pass(ply, q, row); });
+        lines.end_first_pass();
+
+        lines.begin_second_pass();
+        each_ply([&](size_t ply, const Position &q, Move m, u64 row) { lines.process_position_second_pass(ply, q, m, row); });
+        lines.end_second_pass();
+
+        const u64 at0 = lines.ply(0).first_piece(1);
+        const u64 at1 = lines.ply(1).first_piece(1);
+        const u64 at2 = lines.ply(2).first_piece(1);
+
+        bool ok = expect(at0 == 32 && at1 == 32 && at2 == 32, "the quiet row does not hold 32 pieces per ply");
+
+        const TemporalRelations &t0 = lines.transition(0);
+        const TemporalRelations &t1 = lines.transition(1);
+
+        ok &= expect(has_edge(t0.captured, at0 + 1, at0 + 2) && t0.captured.size() == 1, "exd5 does not capture d5");
+        ok &= expect(t0.recaptured_by.size() == 0, "a recapture on the first move");
+
+        ok &= expect(has_edge(t1.captured, at1 + 2, at1 + 1) && t1.captured.size() == 1, "cxd5 does not capture the e-pawn");
+        ok &= expect(has_edge(t1.recaptured_by, at1 + 1, at1 + 2) && t1.recaptured_by.size() == 1, "cxd5 is not linked as the recapture of exd5");
+        ok &= expect(has_edge(t1.moved, at1 + 2, at2 + 1), "the c-pawn does not move to d5");
+        ok &= expect(!has_edge(t1.same_piece, at1 + 1, at2 + 1), "the captured pawn lives on");
+
+        // The black king is the same piece all along
+        Bitset king(lines.ply(0).piece_count());
+        king.set(at0 + 4);
+        const Bitset later = lines.follow(1, lines.follow(0, king));
+        ok &= expect(later.test(at2 + 2) && lines.ply(2).rows_of(later).test(1), "the king is lost along the line");
+
+        return ok;
+    }
+
+    // Lines of every length class, CRLF among them and an unterminated last
+    // one. The compressed copies are two gzip members and two zstd frames,
+    // cut after row 12, made with gzip and zstd -19.
+    constexpr std::string_view STREAM_TEXT =
+        "row 00 \n"
+        "row 01 abcdefgabcdefg\n"
+        "row 02 abcabcabc\n"
+        "row 03 abcdefghijabcdefghijabcdefghijabcdefghij\r\n"
+        "row 04 abcdef\n"
+        "row 05 abab\n"
+        "row 06 abcdefghiabcdefghiabcdefghi\n"
+        "row 07 abcdeabcdeabcdeabcde\n"
+        "row 08 a\r\n"
+        "row 09 abcdefghabcdefgh\n"
+        "row 10 abcdabcdabcd\n"
+        "row 11 \n"
+        "row 12 abcdefg\n"
+        "row 13 abcabc\r\n"
+        "row 14 abcdefghijabcdefghijabcdefghij\n"
+        "row 15 abcdefabcdefabcdefabcdef\n"
+        "row 16 ab\n"
+        "row 17 abcdefghiabcdefghi\n"
+        "row 18 abcdeabcdeabcde\r\n"
+        "row 19 aaaa\n"
+        "row 20 abcdefgh\n"
+        "row 21 abcdabcd\n"
+        "row 22 \n"
+        "row 23 abcdefgabcdefgabcdefgabcdefg\r\n"
+        "last row without a newline";
+
+    constexpr unsigned char STREAM_GZIP[] = {
+        0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x2b, 0xca, 0x2f, 0x57, 0x30, 0x30,
+        0x50, 0xe0, 0x2a, 0x02, 0xd1, 0x86, 0x0a, 0x89, 0x49, 0xc9, 0x29, 0xa9, 0x69, 0xe9, 0x50, 0x0a,
+        0x22, 0x6a, 0x04, 0x12, 0x85, 0x20, 0x88, 0x80, 0x31, 0x4c, 0x59, 0x46, 0x66, 0x16, 0x7e, 0x16,
+        0x2f, 0x44, 0x83, 0x09, 0x54, 0x03, 0x84, 0x67, 0x0a, 0xe4, 0x25, 0x26, 0x41, 0xd8, 0x66, 0x08,
+        0xa3, 0x30, 0x19, 0x10, 0x25, 0xe6, 0x10, 0x25, 0x68, 0x04, 0x44, 0xce, 0x42, 0x21, 0x11, 0x6a,
+        0x85, 0x25, 0xdc, 0x20, 0x18, 0x0d, 0x16, 0x37, 0x34, 0x00, 0x8b, 0xc3, 0x30, 0x44, 0xcc, 0x10,
+        0xe2, 0x5d, 0x43, 0x23, 0x98, 0x1e, 0x2e, 0x00, 0xb4, 0x53, 0x34, 0xe1, 0x06, 0x01, 0x00, 0x00,
+        0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x2b, 0xca, 0x2f, 0x57, 0x30, 0x34,
+        0x56, 0x48, 0x4c, 0x4a, 0x06, 0x22, 0x5e, 0xae, 0x22, 0x10, 0xd7, 0x04, 0xc4, 0x4d, 0x49, 0x4d,
+        0x4b, 0xcf, 0xc8, 0xcc, 0xc2, 0xc6, 0x82, 0xa8, 0x32, 0x85, 0xaa, 0xc2, 0x24, 0x21, 0xf2, 0x66,
+        0x40, 0x79, 0x08, 0xcb, 0x1c, 0x61, 0x1e, 0x9c, 0x01, 0x91, 0xb1, 0x80, 0xc8, 0x20, 0x08, 0xa8,
+        0x0b, 0x2c, 0x15, 0x12, 0x81, 0x00, 0xcc, 0x36, 0x32, 0x80, 0xeb, 0x86, 0xf0, 0x0d, 0xc1, 0x7c,
+        0x10, 0x86, 0xf0, 0x8d, 0x14, 0x20, 0xb4, 0x31, 0x4c, 0x1d, 0x56, 0x8a, 0x97, 0x2b, 0x27, 0xb1,
+        0xb8, 0x44, 0x01, 0xa4, 0xb2, 0x3c, 0xb3, 0x24, 0x23, 0xbf, 0xb4, 0x44, 0x21, 0x51, 0x21, 0x2f,
+        0xb5, 0x3c, 0x27, 0x33, 0x2f, 0x15, 0x00, 0xb8, 0xf7, 0xd2, 0x3d, 0x04, 0x01, 0x00, 0x00,
+    };
+
+    constexpr unsigned char STREAM_ZSTD[] = {
+        0x28, 0xb5, 0x2f, 0xfd, 0x60, 0x06, 0x00, 0x1d, 0x03, 0x00, 0x74, 0x02, 0x72, 0x6f, 0x77, 0x20,
+        0x30, 0x30, 0x20, 0x0a, 0x31, 0x20, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x32, 0x33, 0x68,
+        0x69, 0x6a, 0x0d, 0x34, 0x35, 0x61, 0x62, 0x36, 0x37, 0x38, 0x20, 0x61, 0x39, 0x31, 0x30, 0x31,
+        0x20, 0x32, 0x20, 0x1c, 0xa0, 0x00, 0xb5, 0x6b, 0x1c, 0x70, 0x66, 0x12, 0xd2, 0x03, 0xeb, 0x08,
+        0xf6, 0x78, 0x3c, 0x3c, 0x9d, 0x77, 0xa7, 0x99, 0x37, 0x23, 0x9a, 0x4d, 0xb2, 0x67, 0x88, 0x7b,
+        0x37, 0x9a, 0x06, 0x9c, 0xe7, 0xbc, 0xfd, 0x0c, 0x07, 0x06, 0x03, 0xce, 0xd1, 0x86, 0xea, 0xc4,
+        0xea, 0x2f, 0x0d, 0xee, 0x03, 0xc3, 0x7c, 0x5c, 0x49, 0xa6, 0x6d, 0x90, 0x01, 0x28, 0xb5, 0x2f,
+        0xfd, 0x64, 0x04, 0x00, 0x85, 0x03, 0x00, 0x02, 0x84, 0x0e, 0x11, 0x80, 0x7d, 0x00, 0xfc, 0x77,
+        0x77, 0xfb, 0x60, 0x86, 0x02, 0xa8, 0xe2, 0x79, 0x80, 0xa4, 0xea, 0x01, 0xf0, 0x52, 0xdb, 0xe1,
+        0x15, 0x2f, 0x36, 0xc7, 0x73, 0xd3, 0x2e, 0xb6, 0x7e, 0x0b, 0x82, 0x11, 0x85, 0x8c, 0xf2, 0xff,
+        0x2f, 0x58, 0x58, 0x2a, 0xa1, 0x4a, 0xa7, 0x8c, 0xf0, 0x1d, 0x10, 0x5c, 0x7b, 0xd7, 0x5e, 0x18,
+        0x22, 0x3a, 0xce, 0x01, 0x19, 0xa0, 0x10, 0x97, 0xa9, 0x3d, 0x03, 0x90, 0x44, 0x96, 0xf5, 0x4d,
+        0x40, 0xfd, 0xaf, 0x09, 0xc6, 0x30, 0xe7, 0xc7, 0xba, 0x66, 0x63, 0x81, 0x65, 0xff, 0x7d, 0x1d,
+        0xc0, 0xde, 0x63, 0x8f, 0x31, 0x16, 0x53, 0x5b, 0x1d, 0x02, 0x30, 0x0c, 0x93, 0x97, 0x79, 0x7a,
+        0x28, 0x85, 0x1c, 0x43, 0x22, 0xa0, 0x14, 0x28, 0x35, 0x25, 0x61,
+    };
+
+    // Streams path in blocks of a few lines and checks the blocks put back
+    // together give STREAM_TEXT, each but the last ending a line
+    bool stream_matches(const std::string &path, const std::string &what)
+    {
+        std::unique_ptr<Test::ByteSource> src = Test::open_byte_source(path);
+        if (!expect(src != nullptr, "cannot open the " + what + " stream"))
+            return false;
+
+        std::string text;
+        bool whole_lines = true;
+        const bool read = Test::stream_line_blocks(*src, [&](const char *first, const char *last) {
+            whole_lines &= text.size() + (last - first) == STREAM_TEXT.size() || last[-1] == '\n' || last[-1] == '\r';
+            text.append(first, last);
+        }, 64, 2);
+
+        return expect(read, what + " stream reports an error")
+               & expect(text == STREAM_TEXT, what + " stream gives other bytes")
+               & expect(whole_lines, what + " stream splits a line across blocks");
+    }
+
+    bool check_streams(const ScratchDir &dir)
+    {
+        using Test::Compression;
+
+        auto bytes = [](const unsigned char *data, size_t size) {
+            return std::string_view(reinterpret_cast<const char *>(data), size);
+        };
+
+        const std::string plain = dir.write("stream.txt", STREAM_TEXT);
+        const std::string gz = dir.write("stream.txt.gz", bytes(STREAM_GZIP, sizeof(STREAM_GZIP)));
+        const std::string zst = dir.write("stream.txt.zst", bytes(STREAM_ZSTD, sizeof(STREAM_ZSTD)));
+
+        bool ok = expect(Test::detect_compression(plain) == Compression::None
+                             && Test::detect_compression(gz) == Compression::Gzip
+                             && Test::detect_compression(zst) == Compression::Zstd,
+                         "compression not told by the magic bytes");
+
+        ok &= stream_matches(plain, "plain");
+
+        for (auto [path, c, name, data, size] : {std::tuple{gz, Compression::Gzip, "gzip", STREAM_GZIP, sizeof(STREAM_GZIP)},
+                                                 std::tuple{zst, Compression::Zstd, "zstd", STREAM_ZSTD, sizeof(STREAM_ZSTD)}})
+        {
+            if (!Test::can_decompress(c))
+            {
+                std::cout << "     " << name << " not compiled in, skipped" << std::endl;
+                ok &= expect(Test::open_byte_source(path) == nullptr, std::string(name) + " opens without its codec");
+                continue;
+            }
+
+            ok &= stream_matches(path, name);
+
+            // Cut in the middle of the second member or frame
+            const std::string cut = dir.write(std::string("cut.") + name, bytes(data, size - 20));
+            std::unique_ptr<Test::ByteSource> src = Test::open_byte_source(cut);
+            ok &= expect(src && !Test::stream_line_blocks(*src, [](const char *, const char *) {}),
+                         std::string("a cut ") + name + " stream reads as complete");
+        }
+
+        return ok;
+    }
+
+    // Rows and the canonical row each folds into. The knight reaches f3
+    // from g1 or g5, the move counters do not count; castling rights and a
+    // capturable en passant square do.
+    constexpr std::tuple<const char *, const char *, u64> DEDUP_ROWS[] = {
+        {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", "g1f3", 0},
+        {"rnbqkbnr/pppppppp/8/6N1/8/8/PPPPPPPP/RNBQKB1R w KQkq - 3 2", "g5f3", 0},
+        {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w Kkq - 0 1", "g1f3", 2},
+        {"rnbqkbnr/pppppppp/8/6N1/8/8/PPPPPPPP/RNBQKB1R w KQkq - 40 90", "g5f3", 0},
+        {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", "e2e4", 4},
+        {"rnbqkbnr/pppppppp/8/8/8/4P3/PPPP1PPP/RNBQKBNR w KQkq - 0 1", "e3e4", 4},
+        {"rnbqkbnr/ppp1pppp/8/8/3p4/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", "e2e4", 6},
+        {"rnbqkbnr/ppp1pppp/8/8/3p4/4P3/PPPP1PPP/RNBQKBNR w KQkq - 0 1", "e3e4", 7},
+    };
+
+    bool check_dedup(const ScratchDir &)
+    {
+        using namespace Chess;
+
+        constexpr u64 NB_ROWS = std::size(DEDUP_ROWS);
+
+        auto first_pass = [](BitsetManager &res) {
+            Position p;
+            res.begin_first_pass();
+            for (u64 row = 0; row < NB_ROWS; row++)
+                res.push_position_first_pass(p.set_and_move(std::get<0>(DEDUP_ROWS[row]), std::get<1>(DEDUP_ROWS[row])), row);
+            res.end_first_pass();
+        };
+
+        bool ok = true;
+
+        // The key kept up by the move is the key of the position set afresh
+        Position p, q;
+        for (const auto &[FEN, UCI, canonical] : DEDUP_ROWS)
+        {
+            p.set_and_move(FEN, UCI);
+            ok &= expect(p.key() == q.set(p.fen()).key(), std::string("the key after ") + UCI + " from " + FEN + " is not the key of its FEN");
+        }
+
+        BitsetManager folded;
+        first_pass(folded);
+
+        for (u64 row = 0; row < NB_ROWS; row++)
+        {
+            const u64 canonical = std::get<2>(DEDUP_ROWS[row]);
+            ok &= expect(folded.canonical_row(row) == canonical && folded.is_canonical(row) == (row == canonical),
+                         "row " + std::to_string(row) + " folds into " + std::to_string(folded.canonical_row(row)));
+        }
+        ok &= expect(folded.piece_count() == 5 * 32, "folded rows still hold pieces");
+
+        ok &= expect(folded.find_position(p.set_and_move(std::get<0>(DEDUP_ROWS[0]), "g1f3")) == 0, "the knight position is not found");
+        ok &= expect(folded.find_position(p.set_and_move(std::get<0>(DEDUP_ROWS[7]), "e3e4")) == 7, "the position without en passant is not found");
+        ok &= expect(folded.find_position(p.set(std::get<0>(DEDUP_ROWS[0]))) == BitsetManager::NO_ROW, "the start position is found");
+
+        BitsetManager kept;
+        kept.set_dedup(false);
+        first_pass(kept);
+
+        for (u64 row = 0; row < NB_ROWS; row++)
+            ok &= expect(kept.is_canonical(row), "row " + std::to_string(row) + " folded with dedup off");
+        ok &= expect(kept.piece_count() == NB_ROWS * 32, "rows lost pieces with dedup off");
+
+        return ok;
+    }
+
+    // FEN of the board seen from the other side, built on the text: ranks in
+    // reverse order, colours and side to move swapped, en passant on the
+    // mirrored rank. The move counters are left out.
+    std::string mirrored_fen(std::string_view FEN)
+    {
+        auto field = [&FEN]() {
+            const size_t space = std::min(FEN.find(' '), FEN.size());
+            const std::string_view f = FEN.substr(0, space);
+            FEN.remove_prefix(std::min(space + 1, FEN.size()));
+            return f;
+        };
+
+        auto swap_case = [](std::string s) {
+            for (char &c : s)
+                c = std::isupper(c) ? std::tolower(c) : std::toupper(c);
+            return s;
+        };
+
+        std::string_view board = field();
+        std::string ranks;
+        while (!board.empty())
+        {
+            const size_t slash = board.rfind('/');
+            const size_t first = slash == std::string_view::npos ? 0 : slash + 1;
+            ranks += board.substr(first);
+            ranks += first ? "/" : "";
+            board = board.substr(0, first ? first - 1 : 0);
+        }
+
+        const std::string stm = field() == "w" ? "b" : "w";
+
+        std::string castling = swap_case(std::string(field()));
+        std::stable_sort(castling.begin(), castling.end(), [](char a, char b) { return std::isupper(a) > std::isupper(b); });
+
+        std::string ep(field());
+        if (ep != "-")
+            ep[1] = ep[1] == '3' ? '6' : '3';
+
+        return swap_case(ranks) + " " + stm + " " + castling + " " + ep;
+    }
+
+    // First four fields of a FEN
+    std::string_view without_counters(std::string_view FEN)
+    {
+        size_t end = 0;
+        for (int k = 0; k < 4 && end != std::string_view::npos; k++)
+            end = FEN.find(' ', end + (k > 0));
+        return FEN.substr(0, end);
+    }
+
+    bool check_flip(const ScratchDir &)
+    {
+        using namespace Chess;
+
+        constexpr const char *FENs[] = {
+            "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+            "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+            "r3k2r/8/8/8/8/8/8/4K2R b Kq - 3 30",
+            "rnbqkbnr/ppp1p1pp/8/3pPp2/8/8/PPPP1PPP/RNBQKBNR w KQkq f6 0 3",
+            "rnbqkbnr/pppp1ppp/8/8/3PpP2/8/PPP1P1PP/RNBQKBNR b KQkq f3 0 3",
+        };
+
+        bool ok = true;
+        Position p, q;
+
+        for (const char *FEN : FENs)
+        {
+            p.set(FEN);
+            const std::string before = p.fen();
+            const Key key = p.key();
+
+            p.flip();
+            ok &= expect(p.flipped(), std::string("not flipped after one flip of ") + FEN);
+
+            const std::string mirrored = mirrored_fen(FEN);
+            ok &= expect(without_counters(p.fen()) == mirrored, p.fen() + " is not the mirror " + mirrored);
+            ok &= expect(p.key() == q.set(mirrored).key(), std::string("the key of flipped ") + FEN + " is not the key of " + mirrored);
+
+            p.flip();
+            ok &= expect(!p.flipped() && p.fen() == before && p.key() == key, std::string("two flips do not give back ") + FEN);
+        }
+
+        return ok;
+    }
+
+    // Every edge of the line relations on a few positions, as squares
+    struct LineCase
+    {
+        const char *FEN;
+        std::vector<std::pair<Chess::Square, Chess::Square>> xrays, pins, discoveries;
+    };
+
+    bool check_line_relations(const ScratchDir &)
+    {
+        using namespace Chess;
+
+        const LineCase cases[] = {
+            // The rook pins the knight to its king
+            {"k3r3/8/8/8/4N3/8/8/4K3 w - - 0 1", {{E8, E1}}, {{E4, E1}}, {}},
+            // The bishop pins the knight to its queen, which looks through
+            // the knight at the bishop
+            {"7k/8/8/8/4q3/3n4/8/1B4K1 w - - 0 1", {{B1, E4}, {E4, B1}}, {{D3, E4}}, {{D3, B1}}},
+            // A queen behind a piece in front of a queen pins nothing
+            {"4k3/6q1/8/8/3n4/8/8/Q1K5 w - - 0 1", {{A1, G7}, {G7, A1}}, {}, {{D4, A1}}},
+            // The knight discovers the rook's attack on the queen
+            {"7k/8/8/8/R1N3q1/8/8/7K w - - 0 1", {{A4, G4}, {G4, A4}}, {}, {{C4, G4}}},
+            // A king in check is not pinned, and can discover an attack
+            {"4q3/8/8/4k3/8/8/8/K3R3 b - - 0 1", {{E1, E8}, {E8, E1}}, {}, {{E5, E1}}},
+        };
+
+        BitsetManager res;
+        Position p;
+
+        res.begin_first_pass();
+        for (u64 row = 0; row < std::size(cases); row++)
+            res.push_position_first_pass(p.set(cases[row].FEN), row);
+        res.end_first_pass();
+
+        res.begin_second_pass();
+        for (u64 row = 0; row < std::size(cases); row++)
+            res.process_position_second_pass(p.set(cases[row].FEN), row);
+        res.end_second_pass();
+
+        using Edges = std::vector<std::pair<u64, u64>>;
+        Edges xrays, pins, discoveries;
+
+        for (u64 row = 0; row < std::size(cases); row++)
+        {
+            const Bitboard occupied = p.set(cases[row].FEN).pieces();
+            auto ids = [&](const auto &squares, Edges &out) {
+                for (const auto &[l, r] : squares)
+                    out.emplace_back(res.piece_id(row, occupied, l), res.piece_id(row, occupied, r));
+            };
+            ids(cases[row].xrays, xrays);
+            ids(cases[row].pins, pins);
+            ids(cases[row].discoveries, discoveries);
+        }
+
+        auto same = [](const auto &rel, Edges expected) {
+            Edges found;
+            for (const auto &e : rel.data())
+                found.emplace_back(e.l, e.r);
+            std::sort(found.begin(), found.end());
+            std::sort(expected.begin(), expected.end());
+            return found == expected;
+        };
+
+        const RelationStorage &relations = res.relation_storage();
+        bool ok = expect(same(relations.get<RelationID::Xrays_Through>(), xrays), "xrays_through edges differ");
+        ok &= expect(same(relations.get<RelationID::Pinned_To>(), pins), "pinned_to edges differ");
+        ok &= expect(same(relations.get<RelationID::Discovered_Attack_On>(), discoveries), "discovered_attack_on edges differ");
+
+        // The rook's knight is loose as well as pinned, the bishop's is not
+        const Bitset rows = res.rows_where<PieceRelationQuery{FeatureID::KNIGHT_HANGING, RelationID::Pinned_To}>();
+        ok &= expect(rows.test(0) && !rows.test(1) && !rows.test(2) && !rows.test(3) && !rows.test(4), "the loose pinned knight is not found by the join");
+
+        return ok;
+    }
+
+    // Exchanges with a known outcome, as FEN, move, threshold, see_ge
+    constexpr std::tuple<const char *, const char *, int, bool> SEE_CASES[] = {
+        // Pawn takes a knight a pawn defends, 220 up
+        {"4k3/8/2p5/3n4/4P3/8/8/4K3 w - - 0 1", "e4d5", 0, true},
+        {"4k3/8/2p5/3n4/4P3/8/8/4K3 w - - 0 1", "e4d5", 220, true},
+        {"4k3/8/2p5/3n4/4P3/8/8/4K3 w - - 0 1", "e4d5", 221, false},
+        // Queen takes a defended pawn
+        {"4k3/8/2p5/3p4/8/8/3Q4/4K3 w - - 0 1", "d2d5", 0, false},
+        // Rook takes a free pawn
+        {"4k3/8/8/3p4/8/8/8/3RK3 w - - 0 1", "d1d5", 100, true},
+        {"4k3/8/8/3p4/8/8/8/3RK3 w - - 0 1", "d1d5", 101, false},
+        // The king takes only what nobody defends
+        {"4k3/8/2p5/3n4/4K3/8/8/8 w - - 0 1", "e4d5", 0, false},
+        {"4k3/8/8/3n4/4K3/8/8/8 w - - 0 1", "e4d5", 320, true},
+        // The rook behind wins the pawn the rook in front alone would lose
+        {"3rk3/8/8/3p4/8/8/3R4/3RK3 w - - 0 1", "d2d5", 100, true},
+        {"3rk3/8/8/3p4/8/8/3R4/3RK3 w - - 0 1", "d2d5", 101, false},
+        {"3rk3/8/8/3p4/8/8/3R4/4K3 w - - 0 1", "d2d5", 0, false},
+        // Castling is an even trade
+        {"4k3/8/8/8/8/8/8/4K2R w K - 0 1", "e1g1", 0, true},
+        {"4k3/8/8/8/8/8/8/4K2R w K - 0 1", "e1g1", 1, false},
+    };
+
+    bool check_see(const ScratchDir &)
+    {
+        using namespace Chess;
+
+        bool ok = true;
+        Position p;
+
+        for (const auto &[FEN, UCI, threshold, expected] : SEE_CASES)
+        {
+            p.set(FEN);
+            ok &= expect(p.see_ge(p.parse_uci(UCI), threshold) == expected,
+                         std::string(UCI) + " from " + FEN + " at " + std::to_string(threshold) + " is not " + (expected ? "true" : "false"));
+        }
+
+        return ok;
+    }
+
+    // SAN and the move it stands for in UCI, "" where parse_san has to
+    // refuse it as malformed, illegal or ambiguous
+    constexpr std::tuple<const char *, const char *, const char *> SAN_CASES[] = {
+        {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", "e4", "e2e4"},
+        {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", "Nf3!?", "g1f3"},
+        {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", "Ke2", ""},
+        {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", "Zf3", ""},
+        // Knights on b1 and f1 both reach d2
+        {"4k3/8/8/8/8/8/8/1N2KN2 w - - 0 1", "Nbd2", "b1d2"},
+        {"4k3/8/8/8/8/8/8/1N2KN2 w - - 0 1", "Nfd2", "f1d2"},
+        {"4k3/8/8/8/8/8/8/1N2KN2 w - - 0 1", "Nd2", ""},
+        {"4k3/8/8/8/8/8/8/1N2KN2 w - - 0 1", "N1d2", ""},
+        {"4k3/8/8/3pP3/8/8/8/4K3 w - d6 0 1", "exd6", "e5d6"},
+        {"1r5k/P7/8/8/8/8/8/7K w - - 0 1", "a8=Q+", "a7a8q"},
+        {"1r5k/P7/8/8/8/8/8/7K w - - 0 1", "axb8N", "a7b8n"},
+        {"1r5k/P7/8/8/8/8/8/7K w - - 0 1", "a8", ""},
+        {"r3k2r/8/8/8/8/8/8/R3K2R w KQkq - 0 1", "O-O", "e1g1"},
+        {"r3k2r/8/8/8/8/8/8/R3K2R w KQkq - 0 1", "0-0-0", "e1c1"},
+        {"r3k2r/8/8/8/8/8/8/R3K2R b KQkq - 0 1", "0-0", "e8g8"},
+        {"r3k2r/8/8/8/8/8/8/R3K2R b Kk - 0 1", "O-O-O", ""},
+    };
+
+    bool check_san(const ScratchDir &)
+    {
+        using namespace Chess;
+
+        bool ok = true;
+        Position p;
+
+        for (const auto &[FEN, SAN, UCI] : SAN_CASES)
+        {
+            p.set(FEN);
+            const Move m = p.parse_san(SAN);
+            const bool as_expected = *UCI ? m.is_ok() && m.raw() == p.parse_uci(UCI).raw() : !m.is_ok();
+            ok &= expect(as_expected, std::string(SAN) + " from " + FEN + " is not " + (*UCI ? UCI : "refused"));
+        }
+
+        // Numbers glued to the move or followed by dots, comments holding
+        // parentheses, nested variations, NAGs and the result all go
+        std::string_view movetext =
+            "1. e4 {best (by test)} e5 2.Nf3 (2. Nc3 (2. d4 exd4) Nc6) Nc6 $1 3. Bc4 Bc5 "
+            "4. 0-0 Nf6 5. d3 d6 6.Be3 0-0?! 7... Bxe3 8. fxe3 a8=Q+ 1-0";
+        const std::vector<std::string_view> expected = {
+            "e4", "e5", "Nf3", "Nc6", "Bc4", "Bc5", "0-0", "Nf6", "d3", "d6", "Be3", "0-0?!", "Bxe3", "fxe3", "a8=Q+"};
+
+        std::vector<std::string_view> tokens;
+        std::string_view san;
+        while (next_san(movetext, san))
+            tokens.push_back(san);
+
+        ok &= expect(tokens == expected, "next_san does not split the movetext into its moves");
+
+        return ok;
+    }
+
+    struct Check
+    {
+        const char *name;
+        bool (*run)(const ScratchDir &);
+    };
+
+    constexpr Check CHECKS[] = {
+        {"store-wins", check_store_wins},
+        {"append", check_append},
+        {"refresh", check_refresh},
+        {"pgn-pass", check_pgn_pass},
+        {"temporal", check_temporal},
+        {"streams", check_streams},
+        {"dedup", check_dedup},
+        {"line-relations", check_line_relations},
+        {"flip", check_flip},
+        {"see", check_see},
+        {"san", check_san},
+    };
+}
+
+
+// Usage: selftest             runs every check
+//        selftest <name>...   runs the named checks
+int main(int argc, char **argv) {
+
+    Chess::Bitboards::pick_slider_layout();
+
+    const ScratchDir dir;
+    int failures = 0;
+    int ran = 0;
+
+    for (const auto &c : CHECKS) {
+        bool wanted = argc == 1;
+        for (int i = 1; i < argc; i++)
+            wanted |= std::string_view(argv[i]) == c.name;
+        if (!wanted)
+            continue;
+
+        const bool ok = c.run(dir);
+        failures += !ok;
+        ran++;
+
+        std::cout << (ok ? "ok   " : "FAIL ") << c.name << std::endl;
+    }
+
+    std::cout << ran - failures << "/" << ran << " checks passed" << std::endl;
+    return failures || !ran ? 1 : 0;
+}
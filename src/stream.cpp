@@ -0,0 +1,350 @@
+#include <algorithm>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef PUZZLE_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef PUZZLE_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "stream.h"
+
+namespace Test
+{
+
+    namespace {
+
+        class PlainFileSource : public ByteSource
+        {
+            FILE *file;
+
+        public:
+            explicit PlainFileSource(FILE *file) : file(file) {}
+            ~PlainFileSource() override { std::fclose(file); }
+
+            size_t read(char *out, size_t capacity) override
+            {
+                return std::fread(out, 1, capacity, file);
+            }
+
+            bool ok() const override { return !std::ferror(file); }
+        };
+
+#ifdef PUZZLE_HAVE_ZLIB
+        class GzipSource : public ByteSource
+        {
+            gzFile file;
+            bool failed = false;
+
+        public:
+            explicit GzipSource(gzFile file) : file(file)
+            {
+                gzbuffer(file, 1 << 18);
+            }
+            ~GzipSource() override { gzclose(file); }
+
+            size_t read(char *out, size_t capacity) override
+            {
+                int n = gzread(file, out, static_cast<unsigned>(std::min<size_t>(capacity, INT_MAX)));
+
+                // A member cut short ends like a complete one, gzerror
+                // tells them apart (Z_BUF_ERROR)
+                int error = Z_OK;
+                if (n <= 0 && (gzerror(file, &error), error != Z_OK))
+                {
+                    failed = true;
+                    return 0;
+                }
+                return static_cast<size_t>(n);
+            }
+
+            bool ok() const override { return !failed; }
+        };
+#endif
+
+#ifdef PUZZLE_HAVE_ZSTD
+        class ZstdSource : public ByteSource
+        {
+            FILE *file;
+            ZSTD_DStream *stream;
+            std::vector<char> input;
+            ZSTD_inBuffer in{nullptr, 0, 0};
+            size_t last_ret = 0;
+            bool eof = false;
+            bool failed = false;
+
+        public:
+            explicit ZstdSource(FILE *file)
+                : file(file), stream(ZSTD_createDStream()), input(ZSTD_DStreamInSize())
+            {
+                ZSTD_initDStream(stream);
+                in.src = input.data();
+            }
+
+            ~ZstdSource() override
+            {
+                ZSTD_freeDStream(stream);
+                std::fclose(file);
+            }
+
+            size_t read(char *out, size_t capacity) override
+            {
+                ZSTD_outBuffer ob{out, capacity, 0};
+
+                while (!failed && ob.pos < ob.size)
+                {
+                    if (in.pos == in.size && !eof)
+                    {
+                        size_t n = std::fread(input.data(), 1, input.size(), file);
+                        eof = n == 0;
+                        in.size = n;
+                        in.pos = 0;
+                    }
+
+                    // Called with empty input at end of file too, to flush
+                    // whatever the decoder still buffers
+                    const size_t in_before = in.pos;
+                    const size_t out_before = ob.pos;
+                    size_t ret = ZSTD_decompressStream(stream, &ob, &in);
+                    if (ZSTD_isError(ret))
+                    {
+                        failed = true;
+                        break;
+                    }
+
+                    // An idle call after a finished frame already hints at
+                    // the next frame header, only progress tells frame state
+                    if (in.pos != in_before || ob.pos != out_before)
+                        last_ret = ret;
+
+                    if (ob.pos > 0)
+                        break;
+
+                    if (eof && in.pos == in.size)
+                    {
+                        // A non zero hint here means the last frame is cut off
+                        failed = last_ret != 0 || std::ferror(file);
+                        break;
+                    }
+                }
+
+                return ob.pos;
+            }
+
+            bool ok() const override { return !failed; }
+        };
+#endif
+
+        struct Block
+        {
+            std::vector<char> data;
+            size_t size = 0;
+        };
+
+        // Bounded hand-off between the decompressing thread and the consumer
+        class BlockQueue
+        {
+            std::mutex m;
+            std::condition_variable cv;
+            std::deque<Block *> blocks;
+            bool closed = false;
+
+        public:
+            void push(Block *b)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m);
+                    blocks.push_back(b);
+                }
+                cv.notify_one();
+            }
+
+            // nullptr once closed
+            Block *pop()
+            {
+                std::unique_lock<std::mutex> lock(m);
+                cv.wait(lock, [this] { return closed || !blocks.empty(); });
+                if (blocks.empty())
+                    return nullptr;
+                Block *b = blocks.front();
+                blocks.pop_front();
+                return b;
+            }
+
+            void close()
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m);
+                    closed = true;
+                }
+                cv.notify_all();
+            }
+        };
+
+        bool is_line_end(char c) { return c == '\n' || c == '\r'; }
+    }
+
+    Compression detect_compression(const std::string &path)
+    {
+        unsigned char magic[4] = {0, 0, 0, 0};
+
+        FILE *file = std::fopen(path.c_str(), "rb");
+        if (!file)
+            return Compression::None;
+        size_t n = std::fread(magic, 1, sizeof(magic), file);
+        std::fclose(file);
+
+        if (n >= 2 && magic[0] == 0x1F && magic[1] == 0x8B)
+            return Compression::Gzip;
+        if (n == 4 && magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD)
+            return Compression::Zstd;
+        return Compression::None;
+    }
+
+    std::unique_ptr<ByteSource> open_byte_source(const std::string &path)
+    {
+        switch (detect_compression(path))
+        {
+        case Compression::None:
+            if (FILE *file = std::fopen(path.c_str(), "rb"))
+                return std::make_unique<PlainFileSource>(file);
+            return nullptr;
+
+        case Compression::Gzip:
+#ifdef PUZZLE_HAVE_ZLIB
+            if (gzFile file = gzopen(path.c_str(), "rb"))
+                return std::make_unique<GzipSource>(file);
+#endif
+            return nullptr;
+
+        case Compression::Zstd:
+#ifdef PUZZLE_HAVE_ZSTD
+            if (FILE *file = std::fopen(path.c_str(), "rb"))
+                return std::make_unique<ZstdSource>(file);
+#endif
+            return nullptr;
+        }
+
+        return nullptr;
+    }
+
+    bool can_decompress(Compression c)
+    {
+        switch (c)
+        {
+        case Compression::Gzip:
+#ifdef PUZZLE_HAVE_ZLIB
+            return true;
+#else
+            return false;
+#endif
+        case Compression::Zstd:
+#ifdef PUZZLE_HAVE_ZSTD
+            return true;
+#else
+            return false;
+#endif
+        default:
+            return true;
+        }
+    }
+
+    bool stream_line_blocks(
+        ByteSource &src,
+        const std::function<void(const char *, const char *)> &consumer,
+        size_t block_size,
+        size_t nb_blocks)
+    {
+        std::vector<Block> pool(std::max<size_t>(nb_blocks, 2));
+        BlockQueue free_blocks;
+        BlockQueue full_blocks;
+
+        for (auto &b : pool)
+        {
+            b.data.resize(block_size);
+            free_blocks.push(&b);
+        }
+
+        std::thread producer([&]() {
+            // Partial line at the end of the previous block, moved to the
+            // front of the next one
+            std::vector<char> carry;
+            bool eof = false;
+
+            while (!eof)
+            {
+                Block *b = free_blocks.pop();
+                if (!b)
+                    break;
+
+                if (b->data.size() < carry.size() + block_size)
+                    b->data.resize(carry.size() + block_size);
+
+                std::copy(carry.begin(), carry.end(), b->data.begin());
+                b->size = carry.size();
+                carry.clear();
+
+                for (;;)
+                {
+                    while (b->size < b->data.size())
+                    {
+                        size_t n = src.read(b->data.data() + b->size, b->data.size() - b->size);
+                        if (n == 0)
+                        {
+                            eof = true;
+                            break;
+                        }
+                        b->size += n;
+                    }
+
+                    if (eof)
+                        break;
+
+                    size_t cut = b->size;
+                    while (cut > 0 && !is_line_end(b->data[cut - 1]))
+                        cut--;
+
+                    if (cut > 0)
+                    {
+                        carry.assign(b->data.begin() + cut, b->data.begin() + b->size);
+                        b->size = cut;
+                        break;
+                    }
+
+                    // A single line longer than the block, grow and keep reading
+                    b->data.resize(b->data.size() * 2);
+                }
+
+                full_blocks.push(b);
+            }
+
+            full_blocks.close();
+        });
+
+        try
+        {
+            while (Block *b = full_blocks.pop())
+            {
+                consumer(b->data.data(), b->data.data() + b->size);
+                free_blocks.push(b);
+            }
+        }
+        catch (...)
+        {
+            free_blocks.close();
+            producer.join();
+            throw;
+        }
+
+        producer.join();
+        return src.ok();
+    }
+}
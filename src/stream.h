@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace Test {
+
+    enum class Compression {
+        None,
+        Gzip,
+        Zstd,
+    };
+
+    // Sequential byte stream over a plain or compressed file
+    class ByteSource
+    {
+    public:
+        virtual ~ByteSource() = default;
+
+        // Reads up to capacity bytes into out, returns 0 at end of stream
+        virtual size_t read(char *out, size_t capacity) = 0;
+
+        // False once a read or decompression error happened
+        virtual bool ok() const = 0;
+    };
+
+    // Detects the compression from the magic bytes at the start of the file
+    Compression detect_compression(const std::string &path);
+
+    // nullptr if the file cannot be opened or its compression was not
+    // compiled in (PUZZLE_HAVE_ZLIB / PUZZLE_HAVE_ZSTD)
+    std::unique_ptr<ByteSource> open_byte_source(const std::string &path);
+
+    // Whether the codec for c was compiled in
+    bool can_decompress(Compression c);
+
+    // Decompresses src on a background thread into nb_blocks buffers of about
+    // block_size bytes and hands them to consumer on the calling thread. Every
+    // block ends on a line terminator (except at end of stream), so no line is
+    // split across two consumer calls. Returns false on a source error.
+    bool stream_line_blocks(
+        ByteSource &src,
+        const std::function<void(const char *, const char *)> &consumer,
+        size_t block_size = 8 << 20,
+        size_t nb_blocks = 4);
+}
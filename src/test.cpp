@@ -1,13 +1,36 @@
+#include <algorithm>
+#include <bit>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string_view>
+#include <thread>
 
 
 
 #include "test.h"
+#include "stream.h"
 
-#ifdef __AVX2__
 #include <immintrin.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifndef _MSC_VER
+#define __forceinline inline __attribute__((always_inline))
+
+inline unsigned char _BitScanForward(unsigned long *index, unsigned long mask)
+{
+    *index = __builtin_ctzl(mask);
+    return mask != 0;
+}
 #endif
 
 namespace Test
@@ -23,7 +46,8 @@ namespace Test
         return str.substr(0, space_pos);
     }
 
-    bool MemoryMappedFile::open(const std::string &path)
+#ifdef _WIN32
+    bool MemoryMappedFile::open(const std::string &path, unsigned flags)
     {
         // Close any existing mapping
         close();
@@ -87,9 +111,28 @@ namespace Test
             return false;
         }
 
+        // No MAP_POPULATE or huge pages for file views, prefetch instead
+        if (flags & Map_Populate)
+            advise(Access::WillNeed);
+
         return true;
     }
 
+    void MemoryMappedFile::advise(Access access, size_t offset, size_t length) const
+    {
+        if (!data || offset >= size || access != Access::WillNeed)
+            return;
+
+        if (length == 0 || offset + length > size)
+            length = size - offset;
+
+        // Windows has no madvise; the only hint worth giving is a prefetch
+        WIN32_MEMORY_RANGE_ENTRY range;
+        range.VirtualAddress = static_cast<char *>(data) + offset;
+        range.NumberOfBytes = length;
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+    }
+
     void MemoryMappedFile::close()
     {
         if (data)
@@ -103,6 +146,99 @@ namespace Test
         hFile = INVALID_HANDLE_VALUE;
         size = 0;
     }
+#else
+    bool MemoryMappedFile::open(const std::string &path, unsigned flags)
+    {
+        // Close any existing mapping
+        close();
+
+        fd = ::open(path.c_str(), O_RDONLY);
+
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+        size = static_cast<size_t>(st.st_size);
+
+        int map_flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        if (flags & Map_Populate)
+            map_flags |= MAP_POPULATE;
+#endif
+
+        data = mmap(nullptr, size, PROT_READ, map_flags, fd, 0);
+
+        if (data == MAP_FAILED)
+        {
+            data = nullptr;
+            ::close(fd);
+            fd = -1;
+            size = 0;
+            return false;
+        }
+
+#ifdef MADV_HUGEPAGE
+        // Only honoured for file mappings on kernels with CONFIG_READ_ONLY_THP_FOR_FS
+        if (flags & Map_HugePages)
+            madvise(data, size, MADV_HUGEPAGE);
+#endif
+
+        return true;
+    }
+
+    void MemoryMappedFile::advise(Access access, size_t offset, size_t length) const
+    {
+        if (!data || offset >= size)
+            return;
+
+        // madvise wants a page aligned start address
+        const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        const size_t aligned = offset & ~(page - 1);
+
+        if (length == 0 || offset + length > size)
+            length = size - offset;
+        length += offset - aligned;
+
+        int advice = MADV_NORMAL;
+        switch (access)
+        {
+        case Access::Normal:
+            advice = MADV_NORMAL;
+            break;
+        case Access::Sequential:
+            advice = MADV_SEQUENTIAL;
+            break;
+        case Access::Random:
+            advice = MADV_RANDOM;
+            break;
+        case Access::WillNeed:
+            advice = MADV_WILLNEED;
+            break;
+        }
+
+        madvise(static_cast<char *>(data) + aligned, length, advice);
+    }
+
+    void MemoryMappedFile::close()
+    {
+        if (data)
+            munmap(data, size);
+        if (fd >= 0)
+            ::close(fd);
+        data = nullptr;
+        fd = -1;
+        size = 0;
+    }
+
+#endif
 
     // AVX2-accelerated newline detection (assumes AVX2 is available)
     __forceinline size_t find_next_line_avx2(const char *start, const char *end)
@@ -153,46 +289,73 @@ namespace Test
         return end - start;
     }
 
-    // Optimized comma search using SIMD
-    __forceinline const char *find_comma_avx2(const char *start, size_t max_len)
+    // Single pass row tokenizer: per 32 byte block one compare against ',' and
+    // one against the line terminators, then every comma before the first
+    // terminator is taken off the movemask. The last column runs to the end
+    // of the row, missing trailing columns are left empty. Returns the row end.
+    __forceinline const char *tokenize_row_avx2(const char *row_start, const char *file_end, std::string_view *columns)
     {
         const __m256i comma = _mm256_set1_epi8(',');
-        const char *ptr = start;
-        const char *end = start + max_len;
+        const __m256i newline = _mm256_set1_epi8('\n');
+        const __m256i carriage = _mm256_set1_epi8('\r');
 
-        // Align to 32-byte boundary
-        while (reinterpret_cast<uintptr_t>(ptr) & 31 && ptr < end)
-        {
-            if (*ptr == ',')
-                return ptr;
-            ptr++;
-        }
+        const char *ptr = row_start;
+        const char *col_start = row_start;
+        int col = 0;
 
-        // Process aligned chunks
-        for (; ptr + 32 <= end; ptr += 32)
+        auto take_commas = [&](const char *block, uint32_t mask) {
+            while (mask && col < Column_NB - 1)
+            {
+                unsigned long pos;
+                _BitScanForward(&pos, mask);
+                columns[col++] = std::string_view(col_start, block + pos - col_start);
+                col_start = block + pos + 1;
+                mask &= mask - 1;
+            }
+        };
+
+        const char *row_end = nullptr;
+
+        for (; ptr + 32 <= file_end; ptr += 32)
         {
-            __m256i chunk = _mm256_load_si256(reinterpret_cast<const __m256i *>(ptr));
-            __m256i cmp = _mm256_cmpeq_epi8(chunk, comma);
-            int mask = _mm256_movemask_epi8(cmp);
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr));
+            uint32_t commas = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, comma));
+            uint32_t ends = _mm256_movemask_epi8(_mm256_or_si256(
+                _mm256_cmpeq_epi8(chunk, newline),
+                _mm256_cmpeq_epi8(chunk, carriage)));
 
-            if (mask != 0)
+            if (ends)
             {
                 unsigned long pos;
-                _BitScanForward(&pos, mask);
-                return ptr + pos;
+                _BitScanForward(&pos, ends);
+                take_commas(ptr, commas & ((1u << pos) - 1));
+                row_end = ptr + pos;
+                break;
             }
+
+            take_commas(ptr, commas);
         }
 
-        // Handle remaining bytes
-        for (; ptr < end; ptr++)
+        // Tail shorter than a block
+        if (!row_end)
         {
-            if (*ptr == ',')
-                return ptr;
+            for (; ptr < file_end && *ptr != '\n' && *ptr != '\r'; ptr++)
+            {
+                if (*ptr == ',')
+                    take_commas(ptr, 1);
+            }
+            row_end = ptr;
         }
 
-        return nullptr;
+        columns[col++] = std::string_view(col_start, row_end - col_start);
+
+        for (; col < Column_NB; col++)
+            columns[col] = std::string_view(row_end, 0);
+
+        return row_end;
     }
 
+#ifdef _WIN32
     // Windows-specific high-performance timer
     class HighResolutionTimer
     {
@@ -218,17 +381,25 @@ namespace Test
             return elapsed_seconds() * 1000.0;
         }
     };
+#endif
 
-    bool UltraFastCSVParser::open(const std::string &filename)
+    bool UltraFastCSVParser::open(const std::string &filename, unsigned flags)
     {
-        return mmap.open(filename);
+        this->filename = filename;
+        map_flags = flags;
+        return mmap.open(filename, flags);
     }
 
     void UltraFastCSVParser::close()
     {
         mmap.close();
+        index_mmap.close();
         row_offsets.clear();
+        chunk_hashes.clear();
+        offsets = nullptr;
+        nb_rows = 0;
         index_built = false;
+        index_truncated = false;
     }
 
 
@@ -261,32 +432,18 @@ namespace Test
             return result;
         }
 
-        // Find the end of this row (next newline)
-        size_t line_len = find_next_line_avx2(row_start, file_end);
-        const char *row_end = row_start + line_len;
+        // Split all columns and find the end of this row in one go
+        const char *row_end = tokenize_row_avx2(row_start, file_end, result.columns);
 
         // Set full line view
         result.full_line = std::string_view(row_start, row_end - row_start);
 
-        // Parse columns
-        const char *col_start = row_start;
-        const char *line_end = row_end;
-
-        const char *comma = find_comma_avx2(col_start, line_end - col_start);
-
-        col_start = comma + 1; // Skip comma
-        comma = find_comma_avx2(col_start, line_end - col_start);
-        // Add column from col_start to comma
-        result.FEN = std::string_view(col_start, comma - col_start);
-
-        col_start = comma + 1; // Skip comma
-        comma = find_comma_avx2(col_start, line_end - col_start);
-
-        result.first_UCI = get_first_word(std::string_view(col_start, comma - col_start));
+        result.FEN = result.columns[Column_FEN];
+        result.first_UCI = get_first_word(result.columns[Column_Moves]);
         return result;
     }
 
-    std::vector<size_t> build_row_offset_index(const MemoryMappedFile &mmap, size_t max_rows = 0)
+    std::vector<size_t> build_row_offset_index_serial(const MemoryMappedFile &mmap, size_t max_rows = 0)
     {
         std::vector<size_t> offsets;
 
@@ -329,33 +486,506 @@ namespace Test
         return offsets;
     }
 
+    // Row starts inside [begin, end). begin has to be a row start itself and
+    // end either the file end or the row start following a newline run, so no
+    // row straddles two chunks.
+    void scan_row_offsets(const MemoryMappedFile &mmap, size_t begin, size_t end, std::vector<size_t> &offsets)
+    {
+        const char *base = mmap.begin();
+        const char *ptr = base + begin;
+        const char *stop = base + end;
+
+        if (ptr < stop)
+        {
+            offsets.push_back(begin);
+        }
+
+        while (ptr < stop)
+        {
+            ptr += find_next_line_avx2(ptr, stop);
+
+            bool found_newline = false;
+            while (ptr < stop && (*ptr == '\r' || *ptr == '\n'))
+            {
+                ptr++;
+                found_newline = true;
+            }
+
+            if (found_newline && ptr < stop)
+            {
+                offsets.push_back(ptr - base);
+            }
+        }
+    }
+
+    // Below this the thread start-up costs more than the scan itself
+    constexpr size_t PARALLEL_INDEX_MIN_BYTES = 16 << 20;
+
+    std::vector<size_t> build_row_offset_index_parallel(const MemoryMappedFile &mmap, size_t max_rows, size_t nb_chunks)
+    {
+        const size_t size = mmap.get_size();
+
+        // Chunk boundaries: split evenly, then move each one past the next
+        // newline run so every chunk starts on a row
+        const char *base = mmap.begin();
+        std::vector<size_t> bounds(nb_chunks + 1);
+        bounds[0] = 0;
+        bounds[nb_chunks] = size;
+
+        for (size_t i = 1; i < nb_chunks; i++)
+        {
+            size_t b = std::max(bounds[i - 1], size / nb_chunks * i);
+
+            b += find_next_line_avx2(base + b, base + size);
+            while (b < size && (base[b] == '\r' || base[b] == '\n'))
+            {
+                b++;
+            }
+
+            bounds[i] = b;
+        }
+
+        std::vector<std::vector<size_t>> chunks(nb_chunks);
+        {
+            std::vector<std::thread> workers;
+            for (size_t i = 0; i < nb_chunks; i++)
+            {
+                workers.emplace_back([&, i]() {
+                    chunks[i].reserve((bounds[i + 1] - bounds[i]) / 64);
+                    scan_row_offsets(mmap, bounds[i], bounds[i + 1], chunks[i]);
+                });
+            }
+            for (auto &t : workers)
+                t.join();
+        }
+
+        // Prefix sum of chunk sizes gives each chunk its slot in the result
+        std::vector<size_t> starts(nb_chunks + 1, 0);
+        for (size_t i = 0; i < nb_chunks; i++)
+        {
+            starts[i + 1] = starts[i] + chunks[i].size();
+        }
+
+        std::vector<size_t> offsets(starts[nb_chunks]);
+        {
+            std::vector<std::thread> workers;
+            for (size_t i = 0; i < nb_chunks; i++)
+            {
+                workers.emplace_back([&, i]() {
+                    std::copy(chunks[i].begin(), chunks[i].end(), offsets.begin() + starts[i]);
+                    std::vector<size_t>().swap(chunks[i]);
+                });
+            }
+            for (auto &t : workers)
+                t.join();
+        }
+
+        // Same cutoff as the serial scan, which only checks max_rows after
+        // pushing a row past the first one
+        const size_t limit = std::max<size_t>(max_rows, 2);
+        if (max_rows > 0 && offsets.size() > limit)
+        {
+            offsets.resize(limit);
+        }
+
+        return offsets;
+    }
+
+    std::vector<size_t> build_row_offset_index(const MemoryMappedFile &mmap, size_t max_rows = 0)
+    {
+        const size_t nb_chunks = std::thread::hardware_concurrency();
+
+        if (!mmap.valid() || nb_chunks <= 1 || mmap.get_size() < PARALLEL_INDEX_MIN_BYTES)
+        {
+            return build_row_offset_index_serial(mmap, max_rows);
+        }
+
+        return build_row_offset_index_parallel(mmap, max_rows, nb_chunks);
+    }
+
+
+
+    static_assert(sizeof(size_t) == sizeof(uint64_t), "sidecar index stores offsets as size_t");
+
+    constexpr char SIDECAR_MAGIC[8] = {'L', 'P', 'Z', 'I', 'D', 'X', '\0', '\0'};
+    constexpr uint32_t SIDECAR_VERSION = 3;
+
+    // When the size or mtime of the CSV moved, the whole of it is hashed,
+    // so an edit anywhere in it is caught, in chunks of this size on every
+    // core. The chunking does not depend on the core count, the hash of a
+    // file is the same on every machine. The chunk hashes are kept in the
+    // sidecar, rows appended later only need the chunks they touch hashed.
+    constexpr size_t SIDECAR_HASH_CHUNK = 16 << 20;
+
+    uint64_t fnv1a64(const char *data, size_t len, uint64_t h = 0xcbf29ce484222325ULL)
+    {
+        for (size_t i = 0; i < len; i++)
+        {
+            h ^= static_cast<unsigned char>(data[i]);
+            h *= 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    // Four independent multiply-rotate lanes over 8 byte words keep the
+    // loop at memory speed, the tail goes through FNV-1a
+    uint64_t hash_chunk(const char *data, size_t len)
+    {
+        constexpr uint64_t K = 0x9E3779B97F4A7C15ULL;
+        uint64_t lanes[4] = {K, K * 3, K * 5, K * 7};
+
+        size_t i = 0;
+        for (; i + 32 <= len; i += 32)
+        {
+            for (int l = 0; l < 4; l++)
+            {
+                uint64_t w;
+                std::memcpy(&w, data + i + 8 * l, sizeof(w));
+                lanes[l] = std::rotl((lanes[l] ^ w) * K, 29);
+            }
+        }
+
+        uint64_t h = fnv1a64(data + i, len - i);
+        for (uint64_t lane : lanes)
+            h = (h ^ lane) * K;
+        return h ^ len;
+    }
+
+    uint64_t combine_chunk_hashes(const std::vector<uint64_t> &chunks)
+    {
+        return fnv1a64(reinterpret_cast<const char *>(chunks.data()), chunks.size() * sizeof(uint64_t));
+    }
+
+    size_t sidecar_chunk_count(size_t size)
+    {
+        return (size + SIDECAR_HASH_CHUNK - 1) / SIDECAR_HASH_CHUNK;
+    }
+
+    // Hashes the chunks of [data, data + size) from first_chunk on into
+    // chunks, the ones before are kept as they are. Returns the hash of
+    // the whole.
+    uint64_t hash_bytes(const char *data, size_t size, std::vector<uint64_t> &chunks, size_t first_chunk = 0)
+    {
+        const size_t nb_chunks = sidecar_chunk_count(size);
+        chunks.resize(nb_chunks);
+        first_chunk = std::min(first_chunk, nb_chunks);
+
+        run_sharded(first_chunk, nb_chunks, nb_chunks - first_chunk, [&](size_t, size_t first, size_t last) {
+            for (size_t c = first; c < last; c++)
+            {
+                const size_t begin = c * SIDECAR_HASH_CHUNK;
+                chunks[c] = hash_chunk(data + begin, std::min(SIDECAR_HASH_CHUNK, size - begin));
+            }
+        });
+
+        return combine_chunk_hashes(chunks);
+    }
+
+    int64_t file_mtime(const std::string &path)
+    {
+        std::error_code ec;
+        auto mtime = std::filesystem::last_write_time(path, ec);
+        return ec ? 0 : static_cast<int64_t>(mtime.time_since_epoch().count());
+    }
+
+    // Describes the file as it is mapped, chunk_hashes must cover it
+    RowIndexHeader UltraFastCSVParser::make_sidecar_header() const
+    {
+        RowIndexHeader header{};
+        std::memcpy(header.magic, SIDECAR_MAGIC, sizeof(header.magic));
+        header.version = SIDECAR_VERSION;
+        header.csv_size = mmap.get_size();
+        header.csv_mtime = csv_mtime;
+        header.csv_hash = combine_chunk_hashes(chunk_hashes);
+        header.row_count = nb_rows;
+
+        return header;
+    }
+
+    bool UltraFastCSVParser::load_sidecar_index()
+    {
+        if (!index_mmap.open(filename + ".idx"))
+        {
+            return false;
+        }
+
+        RowIndexHeader header;
+
+        if (index_mmap.get_size() < sizeof(header))
+        {
+            index_mmap.close();
+            return false;
+        }
+        std::memcpy(&header, index_mmap.begin(), sizeof(header));
+
+        if (header.csv_size > mmap.get_size())
+        {
+            index_mmap.close();
+            return false;
+        }
+
+        // An older, shorter CSV is fine as long as the bytes the sidecar was
+        // built from are unchanged
+        const bool appended = header.csv_size < mmap.get_size();
+        const size_t nb_chunks = sidecar_chunk_count(header.csv_size);
+
+        if (std::memcmp(header.magic, SIDECAR_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != SIDECAR_VERSION ||
+            index_mmap.get_size() != sizeof(header) + (header.row_count + nb_chunks) * sizeof(uint64_t))
+        {
+            index_mmap.close();
+            return false;
+        }
+
+        const char *stored_chunks = index_mmap.begin() + sizeof(header) + header.row_count * sizeof(uint64_t);
+        chunk_hashes.resize(nb_chunks);
+        std::memcpy(chunk_hashes.data(), stored_chunks, nb_chunks * sizeof(uint64_t));
+
+        // The same size and mtime are taken for the same file, the CSV is
+        // only read through when either moved
+        csv_mtime = file_mtime(filename);
+        const bool touched = !appended && header.csv_mtime != csv_mtime;
+
+        if ((appended || touched) && header.csv_hash != hash_bytes(mmap.begin(), header.csv_size, chunk_hashes))
+        {
+            chunk_hashes.clear();
+            index_mmap.close();
+            return false;
+        }
+
+        offsets = reinterpret_cast<const size_t *>(index_mmap.begin() + sizeof(header));
+        nb_rows = header.row_count;
+
+        if (appended || touched)
+        {
+            take_offsets_from_sidecar();
+            if (appended)
+            {
+                size_t added = append_rows_from(header.csv_size);
+                std::cout << "Index appended " << added << " rows past the sidecar" << std::endl;
+            }
+
+            // With the new mtime the next start is back on the cheap check
+            if (!write_sidecar_index())
+            {
+                std::cerr << "Failed to write " << filename << ".idx" << std::endl;
+            }
+            return true;
+        }
+
+        // Offsets are looked up in row order by the passes
+        index_mmap.advise(Access::Sequential);
+        return true;
+    }
+
+    // Moves the offsets out of the mapped sidecar so they can grow
+    void UltraFastCSVParser::take_offsets_from_sidecar()
+    {
+        if (!index_mmap.valid())
+        {
+            return;
+        }
+
+        row_offsets.assign(offsets, offsets + nb_rows);
+        offsets = row_offsets.data();
+        index_mmap.close();
+    }
+
+    // Indexes the rows that start at or after old_size, the previous end of
+    // the file. Returns how many were added.
+    size_t UltraFastCSVParser::append_rows_from(size_t old_size)
+    {
+        const char *base = mmap.begin();
+        const char *ptr = base + old_size;
+        const char *end = mmap.end();
+        const size_t before = row_offsets.size();
+
+        // If the old file ended on a newline run, step back into it so the
+        // row right at old_size counts as following a newline
+        if (old_size > 0 && (base[old_size - 1] == '\r' || base[old_size - 1] == '\n'))
+        {
+            ptr--;
+        }
+
+        while (ptr < end)
+        {
+            ptr += find_next_line_avx2(ptr, end);
+
+            bool found_newline = false;
+            while (ptr < end && (*ptr == '\r' || *ptr == '\n'))
+            {
+                ptr++;
+                found_newline = true;
+            }
+
+            if (found_newline && ptr < end)
+            {
+                row_offsets.push_back(ptr - base);
+            }
+        }
+
+        offsets = row_offsets.data();
+        nb_rows = row_offsets.size();
+
+        // The chunk old_size fell in grew, the ones before it did not change
+        hash_bytes(base, mmap.get_size(), chunk_hashes, old_size / SIDECAR_HASH_CHUNK);
+
+        return nb_rows - before;
+    }
+
+    size_t UltraFastCSVParser::refresh()
+    {
+        if (!index_built || index_truncated)
+        {
+            return nb_rows;
+        }
+
+        const size_t old_size = mmap.get_size();
+
+        std::error_code ec;
+        if (std::filesystem::file_size(filename, ec) == old_size && !ec && file_mtime(filename) == csv_mtime)
+        {
+            return nb_rows;
+        }
+
+        take_offsets_from_sidecar();
+
+        if (!mmap.open(filename, map_flags))
+        {
+            std::cerr << "Failed to reopen " << filename << std::endl;
+            row_offsets.clear();
+            chunk_hashes.clear();
+            offsets = nullptr;
+            nb_rows = 0;
+            index_built = false;
+            return 0;
+        }
+
+        csv_mtime = file_mtime(filename);
+
+        // Rows were only appended if the bytes indexed before are all still
+        // there, checked against the hash the sidecar holds for them.
+        // Anything else is indexed again from the first row.
+        const uint64_t old_hash = combine_chunk_hashes(chunk_hashes);
+
+        if (mmap.get_size() < old_size || hash_bytes(mmap.begin(), old_size, chunk_hashes) != old_hash)
+        {
+            std::cout << filename << " was rewritten, indexing it again" << std::endl;
+            index_rows();
+            return 0;
+        }
+
+        size_t first_new = nb_rows;
+        append_rows_from(old_size);
+
+        if (!write_sidecar_index())
+        {
+            std::cerr << "Failed to write " << filename << ".idx" << std::endl;
+        }
+
+        return first_new;
+    }
+
+    bool UltraFastCSVParser::write_sidecar_index() const
+    {
+        const RowIndexHeader header = make_sidecar_header();
+
+        // Write next to the final name and rename, so a reader never maps a
+        // half written index
+        const std::string path = filename + ".idx";
+        const std::string tmp_path = path + ".tmp";
+        {
+            std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+            if (!out)
+            {
+                return false;
+            }
+
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char *>(offsets), nb_rows * sizeof(size_t));
+            out.write(reinterpret_cast<const char *>(chunk_hashes.data()), chunk_hashes.size() * sizeof(uint64_t));
 
+            if (!out)
+            {
+                return false;
+            }
+        }
+
+        std::error_code ec;
+        std::filesystem::rename(tmp_path, path, ec);
+        return !ec;
+    }
 
     void UltraFastCSVParser::build_index(size_t max_rows = 0)
     {
         if (!mmap.valid())
             return;
 
+        // A truncated index is not worth persisting, nor is a persisted one
+        // usable for a truncated build
+        if (max_rows == 0 && load_sidecar_index())
+        {
+            index_built = true;
+            std::cout << "Index loaded from " << filename << ".idx: " << nb_rows << " rows" << std::endl;
+            return;
+        }
+
+        index_rows(max_rows);
+    }
+
+    // Builds the row offsets from scratch, and the sidecar unless the index
+    // stops at max_rows
+    void UltraFastCSVParser::index_rows(size_t max_rows)
+    {
+        index_mmap.close();
+
         std::cout << "Building row offset index..." << std::endl;
         auto start = __rdtsc();
 
+        mmap.advise(Access::Sequential);
+        mmap.advise(Access::WillNeed);
+
         row_offsets = build_row_offset_index(mmap, max_rows);
+        offsets = row_offsets.data();
+        nb_rows = row_offsets.size();
         index_built = true;
+        index_truncated = max_rows > 0;
+
+        // Row lookups after indexing hop around (get_full on query matches)
+        mmap.advise(Access::Normal);
 
         auto end = __rdtsc();
         double cycles_per_row = 0;
 
         std::cout << "Index built: " << row_offsets.size() << " rows" << std::endl;
+
+        if (max_rows > 0)
+        {
+            return;
+        }
+
+        csv_mtime = file_mtime(filename);
+        hash_bytes(mmap.begin(), mmap.get_size(), chunk_hashes);
+
+        if (!write_sidecar_index())
+        {
+            std::cerr << "Failed to write " << filename << ".idx" << std::endl;
+        }
+    }
+
+    void UltraFastCSVParser::advise(Access access) const
+    {
+        mmap.advise(access);
     }
 
     ParsedRow UltraFastCSVParser::get_row(size_t row_index)
     {
-        if (!index_built || row_index >= row_offsets.size())
+        if (!index_built || row_index >= nb_rows)
         {
             return ParsedRow();
         }
 
-        return parse_row_at_offset(mmap, row_offsets[row_index], row_index);
+        return parse_row_at_offset(mmap, offsets[row_index], row_index);
     }
 
     ParsedRow UltraFastCSVParser::get_row_at_offset(size_t offset, size_t hint_line_number = 0)
@@ -365,7 +995,7 @@ namespace Test
 
     size_t UltraFastCSVParser::row_count() const
     {
-        return row_offsets.size();
+        return nb_rows;
     }
 
     bool UltraFastCSVParser::is_open() const
@@ -373,12 +1003,26 @@ namespace Test
         return mmap.valid();
     }
 
-    int LichessDbPuzzle::open_and_build_index(std::string db_filename)
+    int LichessDbPuzzle::open_and_build_index(std::string db_filename, unsigned map_flags)
     {
-        std::cout << "Ultra-Fast CSV Parser for Windows (AVX2)" << std::endl;
-        std::cout << "========================================" << std::endl;
+        std::cout << "Ultra-Fast CSV Parser (AVX2)" << std::endl;
+        std::cout << "============================" << std::endl;
 
-        if (!parser.open(db_filename))
+        if (detect_compression(db_filename) != Compression::None)
+        {
+            if (!open_byte_source(db_filename))
+            {
+                std::cerr << "Failed to open compressed file (is its codec compiled in?)" << std::endl;
+                return 1;
+            }
+
+            std::cout << "Streaming from compressed file, no row index" << std::endl;
+            stream_path = db_filename;
+            streaming = true;
+            return 0;
+        }
+
+        if (!parser.open(db_filename, map_flags))
         {
             std::cerr << "Failed to open file" << std::endl;
             return 1;
@@ -388,10 +1032,75 @@ namespace Test
         return 0;
     }
 
-    int LichessDbPuzzle::pass_FEN_and_first_UCI(std::function<void(std::string_view, std::string_view, size_t)> processor)
+    int LichessDbPuzzle::stream_rows(const std::function<void(const ParsedRow &)> &processor)
     {
+        auto src = open_byte_source(stream_path);
+        if (!src)
+        {
+            std::cerr << "Failed to open file" << std::endl;
+            return 1;
+        }
+
+        size_t row_id = 0;
+        size_t stream_offset = 0;
+        ParsedRow row;
+
+        bool ok = stream_line_blocks(*src, [&](const char *begin, const char *end) {
+            const char *ptr = begin;
+
+            while (ptr < end)
+            {
+                while (ptr < end && (*ptr == '\r' || *ptr == '\n'))
+                {
+                    ptr++;
+                }
+
+                if (ptr >= end)
+                {
+                    break;
+                }
 
-        for (size_t row_id = 0; row_id < parser.row_count(); row_id++)
+                const char *row_end = tokenize_row_avx2(ptr, end, row.columns);
+
+                row.full_line = std::string_view(ptr, row_end - ptr);
+                row.FEN = row.columns[Column_FEN];
+                row.first_UCI = get_first_word(row.columns[Column_Moves]);
+                row.line_number = row_id++;
+                row.file_offset = stream_offset + (ptr - begin);
+
+                processor(row);
+
+                ptr = row_end;
+            }
+
+            stream_offset += end - begin;
+        });
+
+        if (!ok)
+        {
+            std::cerr << "Read error in " << stream_path << std::endl;
+            return 1;
+        }
+
+        streamed_rows = row_id;
+
+        return 0;
+    }
+
+    int LichessDbPuzzle::pass_FEN_and_first_UCI(std::function<void(std::string_view, std::string_view, size_t)> processor, size_t first_row)
+    {
+        if (streaming)
+        {
+            return stream_rows([&](const ParsedRow &row) {
+                if (row.line_number >= first_row)
+                    processor(row.FEN, row.first_UCI, row.line_number);
+            });
+        }
+
+        parser.advise(Access::Sequential);
+        parser.advise(Access::WillNeed);
+
+        for (size_t row_id = first_row; row_id < parser.row_count(); row_id++)
         {
 
             ParsedRow row = parser.get_row(row_id);
@@ -399,46 +1108,208 @@ namespace Test
             processor(row.FEN, row.first_UCI, row_id);
         }
 
+        parser.advise(Access::Normal);
+
         return 0;
     }
 
-    LichessPuzzle LichessDbPuzzle::get_full(size_t index)
+    size_t default_shard_count()
     {
+        return std::max<size_t>(std::thread::hardware_concurrency(), 1) * 4;
+    }
 
-        ParsedRow row = parser.get_row(index);
+    void run_sharded(size_t begin, size_t end, size_t nb_shards,
+                     const std::function<void(size_t, size_t, size_t)> &fn)
+    {
+        nb_shards = std::max<size_t>(nb_shards, 1);
 
-        std::string_view input = row.full_line;
+        auto shard_begin = [&](size_t shard) {
+            return begin + (end - begin) * shard / nb_shards;
+        };
 
-        std::string s{input}; // Need copy for stringstream
-        std::istringstream iss(s);
-        std::string tags;
+        const size_t nb_workers = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), nb_shards);
 
-        // Extract next three tokens
-        std::string id, FEN, moves;
-        std::getline(iss, id, ',');
-        std::getline(iss, FEN, ',');
-        std::getline(iss, moves, ',');
+        if (nb_workers == 1)
+        {
+            for (size_t shard = 0; shard < nb_shards; shard++)
+            {
+                fn(shard, shard_begin(shard), shard_begin(shard + 1));
+            }
+            return;
+        }
+
+        std::atomic<size_t> next_shard{0};
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < nb_workers; i++)
+        {
+            workers.emplace_back([&]() {
+                for (size_t shard; (shard = next_shard.fetch_add(1, std::memory_order_relaxed)) < nb_shards;)
+                {
+                    fn(shard, shard_begin(shard), shard_begin(shard + 1));
+                }
+            });
+        }
+        for (auto &t : workers)
+            t.join();
+    }
 
-        std::string rating1, rating2, rating3, rating4;
-        std::getline(iss, rating1, ',');
-        std::getline(iss, rating2, ',');
-        std::getline(iss, rating3, ',');
-        std::getline(iss, rating4, ',');
-        std::getline(iss, tags, ',');
+    int LichessDbPuzzle::pass_FEN_and_first_UCI_sharded(std::function<void(std::string_view, std::string_view, size_t, size_t)> processor, size_t nb_shards, size_t first_row)
+    {
+        if (streaming)
+        {
+            return stream_rows([&](const ParsedRow &row) {
+                if (row.line_number >= first_row)
+                    processor(row.FEN, row.first_UCI, row.line_number, 0);
+            });
+        }
 
-        std::string link = std::string{"https://lichess.org/training/"} + id;
+        parser.advise(Access::Sequential);
+        parser.advise(Access::WillNeed);
 
-       
-        //link = link.substr(0, 28);
+        run_sharded(first_row, std::max(first_row, parser.row_count()), nb_shards, [&](size_t shard, size_t first, size_t last) {
+            for (size_t row_id = first; row_id < last; row_id++)
+            {
+                ParsedRow row = parser.get_row(row_id);
+
+                processor(row.FEN, row.first_UCI, row_id, shard);
+            }
+        });
 
+        parser.advise(Access::Normal);
+
+        return 0;
+    }
+
+    int LichessDbPuzzle::pass_FEN_and_moves(std::function<void(std::string_view, std::string_view, size_t)> processor, size_t first_row)
+    {
+        if (streaming)
+        {
+            return stream_rows([&](const ParsedRow &row) {
+                if (row.line_number >= first_row)
+                    processor(row.FEN, row.columns[Column_Moves], row.line_number);
+            });
+        }
+
+        parser.advise(Access::Sequential);
+        parser.advise(Access::WillNeed);
+
+        for (size_t row_id = first_row; row_id < parser.row_count(); row_id++)
+        {
+            ParsedRow row = parser.get_row(row_id);
+
+            processor(row.FEN, row.columns[Column_Moves], row_id);
+        }
+
+        parser.advise(Access::Normal);
+
+        return 0;
+    }
+
+    int LichessDbPuzzle::pass_FEN_and_moves_sharded(std::function<void(std::string_view, std::string_view, size_t, size_t)> processor, size_t nb_shards, size_t first_row)
+    {
+        if (streaming)
+        {
+            return stream_rows([&](const ParsedRow &row) {
+                if (row.line_number >= first_row)
+                    processor(row.FEN, row.columns[Column_Moves], row.line_number, 0);
+            });
+        }
+
+        parser.advise(Access::Sequential);
+        parser.advise(Access::WillNeed);
+
+        run_sharded(first_row, std::max(first_row, parser.row_count()), nb_shards, [&](size_t shard, size_t first, size_t last) {
+            for (size_t row_id = first; row_id < last; row_id++)
+            {
+                ParsedRow row = parser.get_row(row_id);
+
+                processor(row.FEN, row.columns[Column_Moves], row_id, shard);
+            }
+        });
+
+        parser.advise(Access::Normal);
+
+        return 0;
+    }
+
+    size_t LichessDbPuzzle::refresh()
+    {
+        // A compressed stream is re-read in full on every pass anyway
+        if (streaming)
+        {
+            return row_count();
+        }
+
+        size_t first_new = parser.refresh();
+
+        std::cout << "Refresh: " << parser.row_count() - first_new << " new rows" << std::endl;
+        return first_new;
+    }
+
+    LichessPuzzleView make_view(const ParsedRow &row)
+    {
+        return LichessPuzzleView
+        {
+            .FEN = row.columns[Column_FEN],
+            .moves = row.columns[Column_Moves],
+            .id = row.columns[Column_PuzzleId],
+            .full = row.full_line
+        };
+    }
+
+    int LichessDbPuzzle::pass_rows(const std::vector<size_t> &ids, std::function<void(size_t, const LichessPuzzleView &)> processor)
+    {
+        if (!streaming)
+        {
+            for (size_t id : ids)
+            {
+                processor(id, get_view(id));
+            }
+            return 0;
+        }
+
+        auto next = ids.begin();
+
+        return stream_rows([&](const ParsedRow &row) {
+            if (next != ids.end() && *next == row.line_number)
+            {
+                processor(row.line_number, make_view(row));
+                ++next;
+            }
+        });
+    }
+
+    std::string_view LichessLink::write(char *out, size_t capacity) const
+    {
+        if (size() > capacity)
+        {
+            return std::string_view();
+        }
+
+        std::memcpy(out, prefix.data(), prefix.size());
+        std::memcpy(out + prefix.size(), id.data(), id.size());
+        return std::string_view(out, size());
+    }
+
+    LichessPuzzleView LichessDbPuzzle::get_view(size_t index)
+    {
+        return make_view(parser.get_row(index));
+    }
+
+    LichessPuzzle LichessDbPuzzle::get_full(size_t index)
+    {
+        LichessPuzzleView view = get_view(index);
+
+        std::string link = std::string{LichessLink::prefix} + std::string{view.id};
 
         return LichessPuzzle
         {
-            .FEN = FEN,
-            .moves = moves,
-            .id = id,
+            .FEN = std::string{view.FEN},
+            .moves = std::string{view.moves},
+            .id = std::string{view.id},
             .link = link,
-            .full = std::string{input}
+            .full = std::string{view.full}
         };
     }
-}
+}
\ No newline at end of file
@@ -1,32 +1,59 @@
 #pragma once
 
+#ifdef _WIN32
 #include <windows.h>
 #include <memoryapi.h>
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#include <cstdint>
 #include <string>
 #include <string_view>
 #include <functional>
 #include <iostream>
-#include <intrin.h>
+#include <vector>
 
 
 
 namespace Test {
 
 
+    // Optional backing for the mapping. Populate pre-faults the whole file at
+    // map time (MAP_POPULATE), HugePages asks for transparent huge pages.
+    // Both are hints and ignored where the platform has no equivalent.
+    enum MapFlags : unsigned {
+        Map_Default = 0,
+        Map_Populate = 1 << 0,
+        Map_HugePages = 1 << 1,
+    };
+
+    // Access pattern hints, forwarded to madvise(2) / PrefetchVirtualMemory.
+    enum class Access {
+        Normal,
+        Sequential,
+        Random,
+        WillNeed,
+    };
+
     class MemoryMappedFile
     {
     public:
         MemoryMappedFile() = default;
 
-        MemoryMappedFile(const std::string &path)
+        MemoryMappedFile(const std::string &path, unsigned flags = Map_Default)
         {
-            open(path);
+            open(path, flags);
         }
 
 
-        bool open(const std::string &path);
+        bool open(const std::string &path, unsigned flags = Map_Default);
         void close();
 
+        // Hint the kernel about how [offset, offset + length) is going to be read.
+        // length == 0 means up to the end of the mapping.
+        void advise(Access access, size_t offset = 0, size_t length = 0) const;
+
         ~MemoryMappedFile()
         {
             close();
@@ -38,6 +65,7 @@ namespace Test {
         MemoryMappedFile &operator=(const MemoryMappedFile &) = delete;
 
         // Allow moving
+#ifdef _WIN32
         MemoryMappedFile(MemoryMappedFile &&other) noexcept
             : hFile(other.hFile), hMapping(other.hMapping),
               data(other.data), size(other.size)
@@ -47,6 +75,15 @@ namespace Test {
             other.data = nullptr;
             other.size = 0;
         }
+#else
+        MemoryMappedFile(MemoryMappedFile &&other) noexcept
+            : fd(other.fd), data(other.data), size(other.size)
+        {
+            other.fd = -1;
+            other.data = nullptr;
+            other.size = 0;
+        }
+#endif
 
         const char *begin() const { return static_cast<const char *>(data); }
         const char *end() const { return static_cast<const char *>(data) + size; }
@@ -57,16 +94,36 @@ namespace Test {
 
         private:
 
+#ifdef _WIN32
         HANDLE hFile = INVALID_HANDLE_VALUE;
         HANDLE hMapping = nullptr;
+#else
+        int fd = -1;
+#endif
         void *data = nullptr;
         size_t size = 0;
     };
 
+    // Columns of lichess_db_puzzle.csv, in file order
+    enum LichessColumn {
+        Column_PuzzleId,
+        Column_FEN,
+        Column_Moves,
+        Column_Rating,
+        Column_RatingDeviation,
+        Column_Popularity,
+        Column_NbPlays,
+        Column_Themes,
+        Column_GameUrl,
+        Column_OpeningTags,
+        Column_NB
+    };
+
     // Structure to hold parsed row information
     struct ParsedRow
     {
         std::string_view full_line;
+        std::string_view columns[Column_NB];
         std::string_view FEN;
         std::string_view first_UCI;
         size_t line_number;
@@ -75,17 +132,61 @@ namespace Test {
 
 
 
+    // Header of the persistent row offset index written next to the CSV
+    // (<csv>.idx). The packed uint64_t offsets follow right after it, then
+    // the hashes of the CSV's 16 MiB chunks that csv_hash combines.
+    struct RowIndexHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t csv_size;
+        int64_t csv_mtime;
+        uint64_t csv_hash;
+        uint64_t row_count;
+    };
+
     class UltraFastCSVParser
     {
         MemoryMappedFile mmap;
+        MemoryMappedFile index_mmap;
+        std::string filename;
+        unsigned map_flags = Map_Default;
         std::vector<size_t> row_offsets;
+
+        // Either row_offsets.data() or the offsets inside index_mmap
+        const size_t *offsets = nullptr;
+        size_t nb_rows = 0;
         bool index_built = false;
+        bool index_truncated = false;
+
+        // What the sidecar records of the mapped bytes
+        std::vector<uint64_t> chunk_hashes;
+        int64_t csv_mtime = 0;
+
+        bool load_sidecar_index();
+        bool write_sidecar_index() const;
+        RowIndexHeader make_sidecar_header() const;
+        void take_offsets_from_sidecar();
+        size_t append_rows_from(size_t old_size);
+        void index_rows(size_t max_rows = 0);
 
     public:
 
-        bool open(const std::string &filename);
+        bool open(const std::string &filename, unsigned flags = Map_Default);
         void close();
         void build_index(size_t max_rows);
+
+        // Remaps the file after rows were appended to it and indexes only the
+        // rows past the previous end, once the bytes before it are checked
+        // against the sidecar's hash. A file that shrank or changed before
+        // its previous end is indexed again from scratch. Returns the id of
+        // the first new row: the previous row_count() after an append, 0
+        // after a rebuild, when every row has to be read again. Views into
+        // the file taken before, ParsedRow and LichessPuzzleView alike, do
+        // not survive a refresh.
+        size_t refresh();
+        void advise(Access access) const;
         ParsedRow get_row(size_t row_index);
 
         ParsedRow get_row_at_offset(size_t offset, size_t hint_line_number);
@@ -103,17 +204,91 @@ namespace Test {
         std::string full;
     };
 
+    // Lazily formatted lichess.org training link, streams as prefix + id
+    struct LichessLink {
+        static constexpr std::string_view prefix = "https://lichess.org/training/";
+
+        std::string_view id;
+
+        size_t size() const { return prefix.size() + id.size(); }
+
+        // Writes the link into out, which has room for capacity bytes.
+        // Returns the written link, empty if it does not fit.
+        std::string_view write(char *out, size_t capacity) const;
+    };
+
+    inline std::ostream &operator<<(std::ostream &os, const LichessLink &link)
+    {
+        return os << LichessLink::prefix << link.id;
+    }
+
+    // Non-owning counterpart of LichessPuzzle. The views point into the
+    // mapped CSV and stay valid as long as the LichessDbPuzzle is open and
+    // not refreshed.
+    struct LichessPuzzleView {
+        std::string_view FEN;
+        std::string_view moves;
+        std::string_view id;
+        std::string_view full;
+
+        LichessLink link() const { return LichessLink{id}; }
+    };
+
+    // A few shards per hardware thread, so one slow shard does not leave
+    // the other threads idle at the end of a pass
+    size_t default_shard_count();
+
+    // Cuts [begin, end) into nb_shards contiguous ranges and calls
+    // fn(shard, first, last) once per range from a pool of worker threads.
+    // Returns after every shard is done.
+    void run_sharded(size_t begin, size_t end, size_t nb_shards,
+                     const std::function<void(size_t, size_t, size_t)> &fn);
+
     class LichessDbPuzzle
     {
 
     private:
         UltraFastCSVParser parser;
 
+        // Compressed dumps are not mappable, every pass re-reads them
+        // through the decompression pipeline instead
+        std::string stream_path;
+        bool streaming = false;
+        size_t streamed_rows = 0;
+
+        int stream_rows(const std::function<void(const ParsedRow &)> &processor);
+
     public:
-        int open_and_build_index(std::string db_filename);
-        int pass_FEN_and_first_UCI(std::function<void(std::string_view, std::string_view, size_t)> processor);
+        int open_and_build_index(std::string db_filename, unsigned map_flags = Map_Default);
+        int pass_FEN_and_first_UCI(std::function<void(std::string_view, std::string_view, size_t)> processor, size_t first_row = 0);
+
+        // Multi-threaded pass_FEN_and_first_UCI over nb_shards contiguous row
+        // ranges (see run_sharded). processor also gets the shard index, to
+        // pick per-shard state. Rows of a shard are visited in ascending
+        // order by a single thread; shards run concurrently with each other.
+        // A compressed stream cannot be split and runs serially as shard 0.
+        int pass_FEN_and_first_UCI_sharded(std::function<void(std::string_view, std::string_view, size_t, size_t)> processor, size_t nb_shards, size_t first_row = 0);
+
+        // Same as pass_FEN_and_first_UCI, with the whole Moves column
+        int pass_FEN_and_moves(std::function<void(std::string_view, std::string_view, size_t)> processor, size_t first_row = 0);
+
+        // Same as pass_FEN_and_first_UCI_sharded, with the whole Moves column
+        int pass_FEN_and_moves_sharded(std::function<void(std::string_view, std::string_view, size_t, size_t)> processor, size_t nb_shards, size_t first_row = 0);
+
+        // Picks up rows appended to the CSV since the index was built, see
+        // UltraFastCSVParser::refresh. Returns the first new row id, 0 when
+        // the CSV was rewritten and every row has to be read again.
+        size_t refresh();
+        size_t row_count() const { return streaming ? streamed_rows : parser.row_count(); }
+
+        // Calls processor for each row in ids, which must be sorted ascending.
+        // Works in streaming mode too, where get_full/get_view are unavailable.
+        int pass_rows(const std::vector<size_t> &ids, std::function<void(size_t, const LichessPuzzleView &)> processor);
+
+        bool is_streaming() const { return streaming; }
 
         LichessPuzzle get_full(size_t index);
+        LichessPuzzleView get_view(size_t index);
     };
 
 }
\ No newline at end of file
@@ -5,6 +5,8 @@
 using i64 = std::int64_t;
 using u64 = std::uint64_t;
 using i32 = std::int32_t;
+using u32 = std::uint32_t;
+using i16 = std::int16_t;
 using u16 = std::uint16_t;
 using i8 = std::int8_t;
 using u8 = std::uint8_t;
@@ -13,6 +15,7 @@ namespace Chess {
 
 
     using Bitboard = u64;
+    using Key = u64;
 
     enum Color {
         White,
@@ -49,6 +52,19 @@ namespace Chess {
         Piece_NB = 16,
     };
 
+    enum CastlingRights {
+        No_Castling,
+        White_OO,
+        White_OOO = White_OO << 1,
+        Black_OO = White_OO << 2,
+        Black_OOO = White_OO << 3,
+
+        White_Castling = White_OO | White_OOO,
+        Black_Castling = Black_OO | Black_OOO,
+        Any_Castling = White_Castling | Black_Castling,
+        Castling_Right_NB = 16
+    };
+
     enum Square: int {
         A1, B1, C1, D1, E1, F1, G1, H1,
         A2, B2, C2, D2, E2, F2, G2, H2,
@@ -108,6 +124,18 @@ namespace Chess {
 
     constexpr PieceType typeof_piece(Piece p) { return PieceType(p & 7); }
 
+    // Material in centipawns, used by the exchange evaluation. The king is
+    // never traded so it is worth nothing.
+    constexpr int PawnValue = 100;
+    constexpr int KnightValue = 320;
+    constexpr int BishopValue = 330;
+    constexpr int RookValue = 500;
+    constexpr int QueenValue = 900;
+
+    constexpr int PieceValue[Piece_NB] = {
+        0, PawnValue, KnightValue, BishopValue, RookValue, QueenValue, 0, 0,
+        0, PawnValue, KnightValue, BishopValue, RookValue, QueenValue, 0, 0};
+
     inline Color color_of(Piece pc) {
         return Color(pc >> 3);
     }
@@ -117,6 +145,9 @@ namespace Chess {
     constexpr File file_of(Square s) { return File(int(s) & 7); }
     constexpr Rank rank_of(Square s) { return Rank(s >> 3); }
 
+    // Same file, rank 1 swapped with rank 8 and so on
+    constexpr Square flip_rank(Square s) { return Square(s ^ A8); }
+
     constexpr Direction pawn_push(Color c) { return c == White ? Up : Down; }
 
     
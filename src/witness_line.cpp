@@ -0,0 +1,181 @@
+#include <algorithm>
+
+#include "witness_line.h"
+
+namespace Chess
+{
+
+    WitnessLineIndex::WitnessLineIndex(size_t nb_plies, bool track_pieces)
+        : plies(nb_plies), track_pieces(track_pieces)
+    {
+        if (!track_pieces)
+            return;
+
+        // Piece ids follow from the row, which duplicates would not have
+        for (auto &manager : plies)
+            manager.set_dedup(false);
+    }
+
+    void WitnessLineIndex::begin_first_pass(u64 nb_rows)
+    {
+        for (auto &manager : plies)
+            manager.begin_first_pass(nb_rows);
+    }
+
+    void WitnessLineIndex::push_position_first_pass(size_t ply, const Position &p, u64 row)
+    {
+        plies[ply].push_position_first_pass(p, row);
+    }
+
+    void WitnessLineIndex::end_first_pass()
+    {
+        for (auto &manager : plies)
+            manager.end_first_pass();
+    }
+
+    void WitnessLineIndex::begin_second_pass(size_t nb_shards)
+    {
+        for (auto &manager : plies)
+            manager.begin_second_pass(nb_shards);
+
+        if (!track_pieces)
+            return;
+
+        nb_shards = std::max<size_t>(nb_shards, 1);
+        const size_t nb_transitions = plies.empty() ? 0 : plies.size() - 1;
+
+        transitions.assign(nb_transitions, TemporalRelations());
+        shard_transitions.assign(nb_shards, std::vector<TemporalRelations>(nb_transitions));
+        last_captures.assign(nb_shards, LastCapture());
+    }
+
+    void WitnessLineIndex::process_position_second_pass(size_t ply, const Position &p, Move m, u64 row, size_t shard)
+    {
+        plies[ply].process_position_second_pass(p, row, shard);
+
+        if (track_pieces && ply > 0)
+            link_pieces(ply, p, m, row, shard);
+    }
+
+    void WitnessLineIndex::end_second_pass()
+    {
+        for (auto &manager : plies)
+            manager.end_second_pass();
+
+        // Shard order is row order, whatever order the shards ran in
+        for (const auto &shard : shard_transitions)
+        {
+            for (size_t k = 0; k < transitions.size(); k++)
+                transitions[k].append(shard[k]);
+        }
+        shard_transitions.clear();
+        last_captures.clear();
+    }
+
+    void WitnessLineIndex::link_pieces(size_t ply, const Position &p, Move m, u64 row, size_t shard)
+    {
+        assert(m.is_ok());
+        assert(shard < shard_transitions.size());
+
+        const BitsetManager &before = plies[ply - 1];
+        const BitsetManager &after = plies[ply];
+        TemporalRelations &out = shard_transitions[shard][ply - 1];
+
+        const Color us = ~p.side_to_move();
+        const Square from = m.from_sq();
+        const Square to = m.to_sq();
+        const bool capture = p.captured_piece() != No_Piece;
+
+        // Undo the move on the occupancy to number the pieces of ply - 1
+        const Bitboard now = p.pieces();
+        Bitboard was = now ^ from ^ to;
+        Square rook_from = Sq_None, rook_to = Sq_None, captured_on = Sq_None;
+
+        if (m.type_of() == CASTLING)
+        {
+            const Rank rank = us == White ? Rank_1 : Rank_8;
+            const bool king_side = file_of(to) == File_G;
+            rook_from = make_square(king_side ? File_H : File_A, rank);
+            rook_to = make_square(king_side ? File_F : File_D, rank);
+            was ^= square_bb(rook_from) ^ rook_to;
+        }
+        else if (m.type_of() == EN_PASSANT)
+        {
+            captured_on = to - pawn_push(us);
+            was ^= captured_on;
+        }
+        else if (capture)
+        {
+            captured_on = to;
+            was ^= to;
+        }
+
+        auto id_before = [&](Square s) { return before.piece_id(row, was, s); };
+        auto id_after = [&](Square s) { return after.piece_id(row, now, s); };
+
+        Bitboard stayed = was & now & ~square_bb(to);
+        if (rook_to != Sq_None)
+            stayed &= ~square_bb(rook_to);
+
+        while (stayed)
+        {
+            const Square s = pop_lsb(stayed);
+            out.same_piece.add(id_before(s), id_after(s));
+        }
+
+        out.same_piece.add(id_before(from), id_after(to));
+        out.moved.add(id_before(from), id_after(to));
+
+        if (rook_from != Sq_None)
+        {
+            out.same_piece.add(id_before(rook_from), id_after(rook_to));
+            out.moved.add(id_before(rook_from), id_after(rook_to));
+        }
+
+        LastCapture &last = last_captures[shard];
+
+        if (captured_on != Sq_None)
+        {
+            out.captured.add(id_before(from), id_before(captured_on));
+
+            if (last.row == row && last.ply + 1 == ply && last.square == captured_on)
+                out.recaptured_by.add(id_before(captured_on), id_before(from));
+        }
+
+        last = {row, ply, captured_on};
+    }
+
+    Bitset WitnessLineIndex::follow(size_t ply, const Bitset &pieces) const
+    {
+        assert(ply + 1 < plies.size());
+        return project_left(transitions[ply].same_piece, pieces, plies[ply + 1].piece_count());
+    }
+
+    Bitset WitnessLineIndex::rows_where(std::initializer_list<Condition> conditions) const
+    {
+        return rows_where(std::vector<Condition>(conditions));
+    }
+
+    Bitset WitnessLineIndex::rows_where(const std::vector<Condition> &conditions) const
+    {
+        // Without nb_rows a serial first pass only counts a ply up to the
+        // last row reaching it, the missing rows do not match there
+        u64 nb_rows = 0;
+        for (const auto &manager : plies)
+            nb_rows = std::max(nb_rows, manager.row_count());
+
+        Bitset rows(nb_rows);
+        rows.fill();
+
+        for (const Condition &c : conditions)
+        {
+            assert(c.ply < plies.size());
+
+            Bitset matching = plies[c.ply].rows_with(c.id);
+            matching.resize(nb_rows);
+            rows &= matching;
+        }
+
+        return rows;
+    }
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <initializer_list>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "types.h"
+#include "position.h"
+#include "matcher.h"
+
+namespace Chess {
+
+    // Features and relations at each ply of every row's solution line, one
+    // BitsetManager per ply, all indexed by row. Ply 0 is the position after
+    // the first move, the one main matches on its own; ply k is k moves
+    // further down the line. A row whose line ends before ply k has no
+    // pieces there and matches nothing.
+    //
+    // The passes are framed as for a single BitsetManager. Each worker
+    // replays a row with one Position, so a ply costs one make_move and one
+    // extraction.
+    //
+    // With track_pieces, repeated positions keep their own pieces and each
+    // move links the pieces of ply k to those of ply k + 1 (see
+    // TemporalRelations), so a pattern spanning plies is a projection
+    // through transition(k) rather than a replay of the rows.
+    class WitnessLineIndex
+    {
+    public:
+        explicit WitnessLineIndex(size_t nb_plies, bool track_pieces = false);
+
+        size_t ply_count() const { return plies.size(); }
+
+        BitsetManager &ply(size_t k) { return plies[k]; }
+        const BitsetManager &ply(size_t k) const { return plies[k]; }
+
+        void begin_first_pass(u64 nb_rows = 0);
+        void push_position_first_pass(size_t ply, const Position &p, u64 row);
+        void end_first_pass();
+
+        void begin_second_pass(size_t nb_shards = 1);
+        // m is the move that led from ply - 1 to p, Move::none() at ply 0
+        void process_position_second_pass(size_t ply, const Position &p, Move m, u64 row, size_t shard = 0);
+        void end_second_pass();
+
+        // Edges from ply k to ply k + 1, empty unless pieces are tracked
+        const TemporalRelations &transition(size_t k) const { return transitions[k]; }
+
+        // The same physical pieces at ply + 1, dropping the captured ones
+        Bitset follow(size_t ply, const Bitset &pieces) const;
+
+        struct Condition
+        {
+            size_t ply;
+            FeatureID id;
+        };
+
+        // Rows where each condition holds at its ply
+        Bitset rows_where(std::initializer_list<Condition> conditions) const;
+        Bitset rows_where(const std::vector<Condition> &conditions) const;
+
+        // Plays the moves after the first onto p, which holds ply 0, and calls
+        // visit(ply, p, m) on every ply below nb_plies, m being the move just
+        // made. Moves are UCI text or packed as in the position store.
+        template <typename Visit>
+        static void replay(Position &p, std::string_view uci_moves, size_t nb_plies, Visit &&visit);
+
+        template <typename Visit>
+        static void replay(Position &p, std::span<const u16> moves, size_t nb_plies, Visit &&visit);
+
+    private:
+        void link_pieces(size_t ply, const Position &p, Move m, u64 row, size_t shard);
+
+        // Last transition a shard linked, to spot recaptures
+        struct LastCapture
+        {
+            u64 row = ~0ULL;
+            size_t ply = 0;
+            Square square = Sq_None;
+        };
+
+        std::vector<BitsetManager> plies;
+        bool track_pieces;
+        std::vector<TemporalRelations> transitions;
+        std::vector<std::vector<TemporalRelations>> shard_transitions;
+        std::vector<LastCapture> last_captures;
+    };
+
+    template <typename Visit>
+    void WitnessLineIndex::replay(Position &p, std::string_view uci_moves, size_t nb_plies, Visit &&visit)
+    {
+        if (nb_plies == 0)
+            return;
+        visit(0, p, Move::none());
+
+        // A move that does not parse ends the line
+        for (size_t ply = 1; ply < nb_plies && !uci_moves.empty();)
+        {
+            size_t space = uci_moves.find(' ');
+            std::string_view uci = uci_moves.substr(0, space);
+            uci_moves = space == std::string_view::npos ? std::string_view() : uci_moves.substr(space + 1);
+
+            if (uci.empty())
+                continue;
+
+            Move m = p.parse_uci(uci);
+            if (!m.is_ok() || p.empty(m.from_sq()))
+                return;
+
+            p.make_move(m);
+            visit(ply++, p, m);
+        }
+    }
+
+    template <typename Visit>
+    void WitnessLineIndex::replay(Position &p, std::span<const u16> moves, size_t nb_plies, Visit &&visit)
+    {
+        if (nb_plies == 0)
+            return;
+        visit(0, p, Move::none());
+
+        for (size_t ply = 1; ply < nb_plies && ply <= moves.size(); ply++)
+        {
+            const Move m(moves[ply - 1]);
+            if (!m.is_ok() || p.empty(m.from_sq()))
+                return;
+
+            p.make_move(m);
+            visit(ply, p, m);
+        }
+    }
+}